@@ -31,9 +31,19 @@
 #define CONFIG_DEVNAME      "\x01SERREMT"
 
 #undef  CONFIG_ALIGNED
-#define CONFIG_NFILEINFO    1
+#define CONFIG_NFILEINFO    32      // FILES/NFILESの1回の応答の大きさ (固定長のエントリに換算した数)
 #define CONFIG_DATASIZE     1024
-#define CONFIG_NDCACHE      2
-#define CONFIG_NFCACHE      1
+#define CONFIG_NDCACHE      8       // データキャッシュのブロック数 (/cで変更可能)
+#define CONFIG_NDCACHE_MAX  256
+#define CONFIG_NDFILE       8       // クローズ後もキャッシュを残せるオープン中のファイル数
+#define CONFIG_NDNAME       16      // 識別子を覚えておくファイル名の数
+#define CONFIG_NDIRHANDLE   8       // パス名の送信に使うディレクトリハンドルの数
+#define CONFIG_NDEFER       8       // 後でまとめて送るコマンドの数
+#define CONFIG_NWERR        4       // 後で報告する書き込みエラーを覚えておくファイル数
+#define CONFIG_NSTREAM      4       // 順次読み込みを検出するファイル数
+#define CONFIG_READAHEAD_MAX 8      // 先読みするブロック数の上限
+#define CONFIG_NFCACHE      4       // 同時に進行中のFILES/NFILESのエントリを保持するFILBUFの数
+#define CONFIG_NFILES_FIRST 8       // ワイルドカードを含むFILESで最初に受け取るエントリ数
+#define CONFIG_NMCACHE      8       // CHDIR/CHMODの結果を覚えておくパス名の数
 
 #endif /* _CONFIG_H_ */
@@ -30,6 +30,7 @@
 #include <string.h>
 #include <setjmp.h>
 #include <x68k/dos.h>
+#include <x68k/iocs.h>
 
 #include <config.h>
 #include <x68kremote.h>
@@ -47,6 +48,7 @@ static union {
   struct res_init     res_init;
   struct cmd_dirop    cmd_dirop;
   struct res_dirop    res_dirop;
+  struct res_chdir    res_chdir;
   struct cmd_rename   cmd_rename;
   struct res_rename   res_rename;
   struct cmd_chmod    cmd_chmod;
@@ -69,8 +71,454 @@ static union {
   struct res_filedate res_filedate;
   struct cmd_dskfre   cmd_dskfre;
   struct res_dskfre   res_dskfre;
+  struct cmd_openread cmd_openread;
+  struct res_openread res_openread;
+  struct cmd_createwrite cmd_createwrite;
+  struct res_createwrite res_createwrite;
+  struct cmd_compound cmd_compound;
+  struct res_compound res_compound;
 } b;
 
+static struct cmd_create pcreate;   // 作成を遅らせているファイル (fcbが0なら無し)
+static struct {
+  uint32_t fcb;                     // 遅らせていた作成に失敗したファイル (0なら無し)
+  int res;                          // そのエラー (クローズするまでそのファイルへの操作で返す)
+} pcreate_err;
+static int pcreate_flush(uint32_t fcb, const void *data, size_t len);
+
+// 他のファイルのブロックを追い出した際など、その場で報告できなかった書き込みエラー
+// そのファイルへの次の読み書き・シーク・日時操作またはクローズの結果として一度だけ返す
+static struct {
+  uint32_t fcb;                     // 0なら未使用
+  int res;
+} werr[CONFIG_NWERR];
+static int werr_next;
+
+//****************************************************************************
+// Metadata cache
+//****************************************************************************
+
+// CHDIRとCHMOD(属性の取得)の結果はパス名毎に、DSKFREの結果はユニット毎に、サーバが
+// 応答に付けたリース期間だけ覚えておいて問い合わせずに答える
+// 応答に付いてくるユニットの世代が変わったら、そのユニットの結果は全て捨てる
+
+struct mcache {
+  uint8_t command;          // コマンド (ユニット番号込み)
+  uint8_t lease;            // リース期間 (1/10秒単位、0なら未使用)
+  int8_t res;
+  int time;                 // 結果を受け取った時刻
+  uint32_t lru;
+  dos_namebuf path;
+} mcache[CONFIG_NMCACHE];
+static uint32_t mcache_clock;
+
+static struct {
+  uint8_t lease;
+  int time;
+  struct res_dskfre res;
+} mdskfre[8];
+
+static uint8_t mgen[8];     // ユニット毎の世代
+
+// 応答がなかった場合はその間にサーバ側で変更があったかもしれないので全て捨てる
+void mcache_reset(void)
+{
+  for (int i = 0; i < CONFIG_NMCACHE; i++)
+    mcache[i].lease = 0;
+  for (int i = 0; i < 8; i++)
+    mdskfre[i].lease = 0;
+}
+
+// 応答に付いていたユニットの世代を確認する
+static void mcache_gen(int unit, uint8_t gen)
+{
+  if (mgen[unit] == gen)
+    return;
+  mgen[unit] = gen;
+  for (int i = 0; i < CONFIG_NMCACHE; i++) {
+    if ((mcache[i].command >> 5) == unit)
+      mcache[i].lease = 0;
+  }
+  mdskfre[unit].lease = 0;
+}
+
+// timeに受け取った結果のリース期間が切れていないか
+static bool mcache_valid(int time, int lease)
+{
+  int t = _iocs_ontime().sec - time;
+  if (t < 0)
+    t += 8640000;           // 日付が変わった
+  return lease != 0 && t < lease * 10;
+}
+
+static struct mcache *mcache_find(uint8_t command, const void *path)
+{
+  for (int i = 0; i < CONFIG_NMCACHE; i++) {
+    struct mcache *mc = &mcache[i];
+    if (mc->lease && mc->command == command && memcmp(&mc->path, path, sizeof(mc->path)) == 0) {
+      if (!mcache_valid(mc->time, mc->lease)) {
+        mc->lease = 0;
+        return NULL;
+      }
+      mc->lru = ++mcache_clock;
+      return mc;
+    }
+  }
+  return NULL;
+}
+
+static void mcache_store(uint8_t command, const void *path, int res, int lease)
+{
+  struct mcache *mc = NULL;
+  if (lease == 0)
+    return;
+  for (int i = 0; i < CONFIG_NMCACHE; i++) {
+    if (mcache[i].lease == 0) {
+      mc = &mcache[i];
+      break;
+    }
+    if (mc == NULL || (int32_t)(mcache[i].lru - mc->lru) < 0)
+      mc = &mcache[i];
+  }
+  mc->command = command;
+  mc->lease = lease;
+  mc->res = res;
+  mc->time = _iocs_ontime().sec;
+  mc->lru = ++mcache_clock;
+  memcpy(&mc->path, path, sizeof(mc->path));
+}
+
+// コマンドを送って応答を受け取り、応答に付いていた世代を確認する
+// (応答でwbufが上書きされるので、ユニット番号は先に取り出しておく)
+static void com_xfer(void *wbuf, size_t wsize, void *rbuf, size_t rsize)
+{
+  int unit = *(uint8_t *)wbuf >> 5;
+  com_cmdres(wbuf, wsize, rbuf, rsize);
+  mcache_gen(unit, com_gen);
+}
+
+//****************************************************************************
+// Compact path
+//****************************************************************************
+
+// パス名を含むコマンドは、パス名の詰め物を除き、最近使ったディレクトリをハンドルで
+// 参照する形に変換して送る
+// ハンドルは直接指定したディレクトリにサーバが割り当てて応答で知らせてくるので、
+// そのうち最近使ったCONFIG_NDIRHANDLE個を覚えておく
+
+struct dhandle {
+  uint8_t valid;
+  uint8_t unit;
+  uint8_t handle;           // サーバが割り当てたハンドル番号
+  uint8_t len;
+  uint8_t path[65];
+  uint32_t lru;
+} dhandle[CONFIG_NDIRHANDLE];
+static uint32_t dhandle_clock;
+
+// 最後に変換したコマンドの変換前の先頭部分 (最後のパス名まで)
+// サーバがハンドルを知らなかった場合の送り直しと、割り当てられたハンドルの登録に使う
+static struct {
+  uint8_t n;                // パス名の数 (0なら変換していない)
+  uint8_t literal;          // ディレクトリを直接指定したパス名 (ビット毎)
+  uint8_t off[2];           // パス名の位置
+  uint16_t size;            // 先頭部分のサイズ
+  uint16_t head;            // 変換後の先頭部分のサイズ (残りのバイト列はこの後ろに続く)
+  uint8_t orig[sizeof(struct cmd_rename)];
+} pc;
+
+// 応答がなかった場合はサーバとハンドルの内容が食い違っている可能性があるので全て捨てる
+void dhandle_reset(void)
+{
+  for (int i = 0; i < CONFIG_NDIRHANDLE; i++)
+    dhandle[i].valid = false;
+}
+
+static void dhandle_drop(int unit)
+{
+  for (int i = 0; i < CONFIG_NDIRHANDLE; i++) {
+    if (dhandle[i].unit == unit)
+      dhandle[i].valid = false;
+  }
+}
+
+static int trimlen(const uint8_t *p, int len, uint8_t pad)
+{
+  while (len > 0 && p[len - 1] == pad)
+    len--;
+  return len;
+}
+
+// サーバが割り当てたハンドルを登録する
+// (サーバが同じ番号を別のディレクトリに割り当て直した場合はその内容を置き換える)
+static void dhandle_register(int unit, int handle, const dos_namebuf *ns)
+{
+  struct dhandle *h = NULL;
+  for (int i = 0; i < CONFIG_NDIRHANDLE; i++) {
+    if (dhandle[i].valid && dhandle[i].unit == unit && dhandle[i].handle == handle) {
+      h = &dhandle[i];
+      break;
+    }
+  }
+  if (h == NULL) {
+    // 空きか最も長く使われていないハンドルに登録する
+    for (int i = 0; i < CONFIG_NDIRHANDLE; i++) {
+      if (!dhandle[i].valid) {
+        h = &dhandle[i];
+        break;
+      }
+      if (h == NULL || (int32_t)(dhandle[i].lru - h->lru) < 0)
+        h = &dhandle[i];
+    }
+  }
+  h->valid = true;
+  h->unit = unit;
+  h->handle = handle;
+  h->len = trimlen(ns->path, sizeof(ns->path), 0x00);
+  memcpy(h->path, ns->path, h->len);
+  h->lru = ++dhandle_clock;
+}
+
+// パス名nsを符号化してpに書き込み、書き込んだ末尾を返す
+// (*literalにはディレクトリを直接指定したかどうかを返す)
+static uint8_t *path_encode(uint8_t *p, int unit, const dos_namebuf *ns, bool *literal)
+{
+  struct dhandle *h = NULL;
+  int len = trimlen(ns->path, sizeof(ns->path), 0x00);
+
+  *p++ = ns->flag;
+  *p++ = ns->drive;
+
+  for (int i = 0; i < CONFIG_NDIRHANDLE; i++) {
+    struct dhandle *e = &dhandle[i];
+    if (e->valid && e->unit == unit && e->len == len && memcmp(e->path, ns->path, len) == 0) {
+      h = e;
+      break;
+    }
+  }
+  if (h) {
+    *p++ = 0x80 | h->handle;
+    h->lru = ++dhandle_clock;
+  } else {
+    *p++ = len;
+    memcpy(p, ns->path, len);
+    p += len;
+  }
+  *literal = h == NULL;
+
+  int n1 = trimlen(ns->name1, sizeof(ns->name1), 0x20);
+  int ne = trimlen(ns->ext, sizeof(ns->ext), 0x20);
+  int n2 = trimlen(ns->name2, sizeof(ns->name2), 0x00);
+  *p++ = n1 | (ne << 4);
+  *p++ = n2;
+  memcpy(p, ns->name1, n1);
+  p += n1;
+  memcpy(p, ns->ext, ne);
+  p += ne;
+  memcpy(p, ns->name2, n2);
+  p += n2;
+  return p;
+}
+
+// パス名を含むコマンドをwbufの位置で変換して、変換後のサイズを返す
+static size_t path_compact(void *wbuf, size_t wsize)
+{
+  static uint8_t pbuf[5 + 2 * (8 + sizeof(dos_namebuf) + 5)];
+  uint8_t *w = wbuf;
+  uint8_t *p = pbuf;
+  int off[2];
+  int n = 1;
+
+  switch ((w[0] & 0x1f) | 0x40) {
+  case 0x41: /* chdir */
+  case 0x42: /* mkdir */
+  case 0x43: /* rmdir */
+  case 0x45: /* delete */
+    off[0] = offsetof(struct cmd_dirop, path);
+    break;
+  case 0x44: /* rename */
+    off[0] = offsetof(struct cmd_rename, path_old);
+    off[1] = offsetof(struct cmd_rename, path_new);
+    n = 2;
+    break;
+  case 0x46: /* chmod */
+    off[0] = offsetof(struct cmd_chmod, path);
+    break;
+  case 0x47: /* files */
+    off[0] = offsetof(struct cmd_files, path);
+    break;
+  case 0x49: /* create */
+    off[0] = offsetof(struct cmd_create, path);
+    break;
+  case 0x4a: /* open */
+    off[0] = offsetof(struct cmd_open, path);
+    break;
+  case 0x59: /* openread */
+    off[0] = offsetof(struct cmd_openread, path);
+    break;
+  case 0x5a: /* createwrite */
+    off[0] = offsetof(struct cmd_createwrite, path);
+    break;
+  default:
+    pc.n = 0;
+    return wsize;
+  }
+
+  *p++ = (w[0] & 0xe0) | 0x1c; /* compact */
+  *p++ = w[0];
+  *p++ = n;
+  int pos = 1;
+  pc.n = n;
+  pc.literal = 0;
+  for (int i = 0; i < n; i++) {
+    bool literal;
+    *p++ = off[i] - pos;
+    memcpy(p, w + pos, off[i] - pos);
+    p += off[i] - pos;
+    p = path_encode(p, w[0] >> 5, (dos_namebuf *)(w + off[i]), &literal);
+    pos = off[i] + sizeof(dos_namebuf);
+    pc.off[i] = off[i];
+    pc.literal |= literal << i;
+  }
+  size_t tail = wsize - pos;
+  *p++ = tail >> 8;
+  *p++ = tail & 0xff;
+
+  size_t head = p - pbuf;
+  memcpy(pc.orig, w, pos);
+  pc.size = pos;
+  pc.head = head;
+  memmove(w + head, w + pos, tail);
+  memcpy(w, pbuf, head);
+  return head + tail;
+}
+
+// path_compact()で変換したコマンドをwbufの位置に元に戻して、元のサイズを返す
+// (frameは送ったコマンドのある位置、wsizeは変換後のサイズ)
+static size_t path_restore(void *wbuf, const uint8_t *frame, size_t wsize)
+{
+  uint8_t *w = wbuf;
+  size_t tail = wsize - pc.head;
+  memmove(w + pc.size, frame + pc.head, tail);
+  memcpy(w, pc.orig, pc.size);
+  return pc.size + tail;
+}
+
+// 変換したコマンドの応答に付いてきたハンドルを登録する
+static void path_update(int unit, const struct res_compact *res)
+{
+  for (int i = 0; i < pc.n; i++) {
+    if ((pc.literal & (1 << i)) && res->handle[i] < DIRHANDLE_MAX)
+      dhandle_register(unit, res->handle[i], (dos_namebuf *)(pc.orig + pc.off[i]));
+  }
+}
+
+//****************************************************************************
+// Deferred commands
+//****************************************************************************
+
+// 結果をすぐに必要としない操作 (読み込み専用ファイルのクローズ) は送らずに溜めておき、
+// 次のコマンドと一緒に複合コマンドとして送る
+
+static struct {
+  uint8_t command;
+  uint8_t count;
+  uint8_t data[CONFIG_NDEFER * (2 + sizeof(struct cmd_close))];
+} dq;
+static size_t dqlen;        // dq.dataに溜めたコマンドのサイズ
+
+// 溜めておいたコマンドだけを送る
+static void defer_flush(void)
+{
+  uint8_t res[COMPOUND_MAX + 1];
+
+  if (dq.count == 0)
+    return;
+  dq.command = (dq.data[2] & 0xe0) | 0x1b; /* compound */
+  DPRINTF2(" compound: %d commands\r\n", dq.count);
+  com_xfer(&dq, 2 + dqlen, res, sizeof(res));
+  dq.count = 0;
+  dqlen = 0;
+}
+
+static void defer_cmd(void *cmd, size_t size)
+{
+  if (dqlen + 2 + size > sizeof(dq.data) || dq.count >= COMPOUND_MAX - 1)
+    defer_flush();
+  uint8_t *p = dq.data + dqlen;
+  p[0] = size >> 8;
+  p[1] = size & 0xff;
+  memcpy(p + 2, cmd, size);
+  dqlen += 2 + size;
+  dq.count++;
+}
+
+// コマンドを送って応答を受け取る
+// 溜めておいたコマンドがあれば、その後ろにこのコマンドを付けた複合コマンドとして送る
+// (wbuf,rbufはbの先頭を指していること)
+static void send_cmdres(void *wbuf, size_t wsize, void *rbuf, size_t rsize)
+{
+  struct cmd_compound *cmd = &b.cmd_compound;
+  struct res_compound *res = &b.res_compound;
+  int unit = *(uint8_t *)wbuf >> 5;
+  bool retry = false;
+  uint8_t *frame;           // 送ったコマンドの位置
+  uint8_t *resp;            // このコマンドの応答の位置
+  size_t hsize = 0;         // 応答の前に付く変換したコマンドの結果のサイズ
+
+again:
+  wsize = path_compact(wbuf, wsize);
+  if (pc.n)
+    hsize = offsetof(struct res_compact, handle) + pc.n;
+  int n = dq.count + 1;
+  if (dq.count == 0 ||
+      dqlen + 2 + wsize > sizeof(cmd->data) || n - 1 + hsize + rsize > sizeof(res->data)) {
+    // 溜めたコマンドがないか、入りきらなければ別々に送る
+    defer_flush();
+    frame = wbuf;
+    resp = rbuf;
+    com_xfer(wbuf, wsize, rbuf, hsize + rsize);
+  } else {
+    uint8_t *p = cmd->data + dqlen;
+    memmove(p + 2, wbuf, wsize);
+    p[0] = wsize >> 8;
+    p[1] = wsize & 0xff;
+    memcpy(cmd->data, dq.data, dqlen);
+    cmd->command = (p[2] & 0xe0) | 0x1b; /* compound */
+    cmd->count = n;
+    DPRINTF2(" compound: %d commands\r\n", n);
+    dq.count = 0;
+    dqlen = 0;
+
+    frame = p + 2;
+    resp = res->data + n - 1;
+    com_xfer(cmd, 2 + (p + 2 - cmd->data) + wsize, res, n - 1 + hsize + rsize);
+  }
+
+  if (pc.n) {
+    // 変換したコマンドの応答の先頭には結果と割り当てられたハンドルが付いている
+    struct res_compact *r = (struct res_compact *)resp;
+    if (r->res == COMPACT_UNKNOWN && !retry) {
+      // サーバがハンドルを知らない (再起動したなど) ので、そのユニットのハンドルを捨てて
+      // パス名を直接指定して送り直す (応答は短いので送ったコマンドは残っている)
+      DPRINTF1(" compact: unknown handle\r\n");
+      dhandle_drop(unit);
+      wsize = path_restore(wbuf, frame, wsize);
+      retry = true;
+      goto again;
+    }
+    path_update(unit, r);
+    if (r->res != 0) {
+      // コマンドは実行されていない (パス名を含むコマンドの応答は先頭が結果)
+      *(int8_t *)rbuf = r->res < 0 ? r->res : _DOSE_ILGPARM;
+      return;
+    }
+    resp += hsize;
+  }
+  if (resp != rbuf)
+    memmove(rbuf, resp, rsize);
+}
+
 //****************************************************************************
 // Utility routine
 //****************************************************************************
@@ -80,15 +528,19 @@ ssize_t send_read(uint32_t fcb, char *buf, uint32_t pos, size_t len)
   struct cmd_read *cmd = &b.cmd_read;
   struct res_read *res = &b.res_read;
   ssize_t total = 0;
+  int r;
+
+  if ((r = pcreate_flush(fcb, NULL, 0)) < 0)
+    return r;
 
   while (len > 0) {
     size_t size = len > sizeof(res->data) ? sizeof(res->data) : len;
     cmd->command = 0x4c; /* read */
-    cmd->fcb = (uint32_t)fcb;
+    cmd->fd = dos_fcb_fd(fcb);
     cmd->pos = pos;
     cmd->len = size;
 
-    com_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
+    send_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
 
     DPRINTF1(" read: addr=0x%08x pos=%d len=%d size=%d\r\n", (uint32_t)buf, pos, len, res->len);
     if (res->len < 0)
@@ -106,96 +558,657 @@ ssize_t send_read(uint32_t fcb, char *buf, uint32_t pos, size_t len)
   return total;
 }
 
-ssize_t send_write(uint32_t fcb, char *buf, uint32_t pos, size_t len)
+// cmd_write.dataに用意したsizeバイトのデータを書き込む
+static ssize_t send_write_data(uint32_t fcb, uint32_t pos, size_t size)
 {
   struct cmd_write *cmd = &b.cmd_write;
   struct res_write *res = &b.res_write;
+  int r;
+
+  if (pcreate_err.fcb == fcb)
+    return pcreate_err.res;
+  if (pcreate.fcb == fcb) {
+    // 作成を遅らせているファイルの先頭への書き込みは作成と同時に行う
+    if (pos == 0 && size > 0)
+      return pcreate_flush(fcb, cmd->data, size);
+    // 書き込みデータを退避してから作成する
+    // (複合コマンドにすると退避したデータを上書きしてしまうので、溜めたコマンドは先に送る)
+    defer_flush();
+    memmove(b.cmd_createwrite.data, cmd->data, size);
+    r = pcreate_flush(fcb, NULL, 0);
+    memmove(cmd->data, b.cmd_createwrite.data, size);
+    if (r < 0)
+      return r;
+  }
+
+  cmd->command = 0x4d; /* write */
+  cmd->fd = dos_fcb_fd(fcb);
+  cmd->pos = pos;
+  cmd->len = size;
+
+  send_cmdres(cmd, offsetof(struct cmd_write, data) + size, res, sizeof(*res));
+  return res->len;
+}
+
+ssize_t send_write(uint32_t fcb, char *buf, uint32_t pos, size_t len)
+{
+  struct cmd_write *cmd = &b.cmd_write;
   ssize_t total = 0;
 
   do {
     size_t size = len > sizeof(cmd->data) ? sizeof(cmd->data) : len;
-    cmd->command = 0x4d; /* write */
-    cmd->fcb = (uint32_t)fcb;
-    cmd->pos = pos;
-    cmd->len = size;
     memcpy(cmd->data, buf, size);
-
-    com_cmdres(cmd, offsetof(struct cmd_write, data) + size, res, sizeof(*res));
-
-    DPRINTF1(" write: addr=0x%08x pos=%d len=%d size=%d\r\n", (uint32_t)buf, pos, len, res->len);
-    if (res->len < 0)
-      return res->len;
-    buf += res->len;
-    total += res->len;
-    pos += res->len;
-    len -= res->len;
+    ssize_t wlen = send_write_data(fcb, pos, size);
+
+    DPRINTF1(" write: addr=0x%08x pos=%d len=%d size=%d\r\n", (uint32_t)buf, pos, len, wlen);
+    if (wlen < 0)
+      return wlen;
+    buf += wlen;
+    total += wlen;
+    pos += wlen;
+    len -= wlen;
   } while (len > 0);
   DPRINTF1(" write: total=%d\r\n", total);
   return total;
 }
 
+//****************************************************************************
+// Data cache
+//****************************************************************************
+
+// ファイルの内容をCONFIG_DATASIZEバイト単位のブロックで保持する
+// ブロック数はCONFIG.SYSの/c<ブロック数>で指定し、ドライバ本体の後ろに確保する
+// (/h指定時はHIMEM.SYSでハイメモリに確保する)
+// 1つのファイルで複数のブロックを使うので、FCBとファイル位置からブロックを探す
+// 空きブロックがなければ最も長く使われていないブロックを再利用する
+// 書き込みはブロックに溜めておき(ライトバック)、ブロック毎に未書き込みの範囲を覚えておく
+// クローズ時などにファイル位置順にまとめて書き込む
+// 読み込み専用でオープンしたファイルのブロックは、FCBの代わりにサーバから受け取った
+// ファイルの識別子をキーにしてクローズ後も残しておき、識別子と更新日時・サイズが
+// 同じファイルを再度オープンした際にそのまま使う
+
 struct dcache {
-  uint32_t fcb;
-  uint32_t pos;
-  int16_t len;
-  bool dirty;
+  uint32_t key;             // FCBのアドレスまたはファイルの識別子 (0なら未使用)
+  uint32_t stamp;           // ファイルの更新日時とサイズから作る値 (キーがFCBなら0)
+  uint32_t pos;             // ブロック先頭のファイル位置
+  int16_t len;              // 有効なデータのサイズ
+  bool dirty;               // サーバに書き込んでいないデータがある
+  int16_t dstart;           // 未書き込みの範囲 (ブロック内のオフセット)
+  int16_t dend;
+  uint32_t lru;             // 最後に使った時刻 (dcache_clock)
   uint8_t cache[CONFIG_DATASIZE];
-} dcache[CONFIG_NDCACHE];
+};
+
+int dcache_blocks = CONFIG_NDCACHE; // ブロック数
+bool dcache_himem = false;          // ハイメモリに確保する
+static struct dcache *dcache;
+static uint32_t dcache_clock;
+
+// 読み込み専用でオープン中のファイルの識別子
+struct dfile {
+  uint32_t fcb;             // 0なら未使用
+  uint32_t key;             // ファイルの識別子 (FCBのアドレスと区別するため最下位ビットを1にする)
+  uint32_t stamp;
+  uint32_t date;            // 更新日時 (FILEDATEの応答形式、0なら不明)
+} dfile[CONFIG_NDFILE];
+
+// ファイル名から前回オープンした際の識別子を引く表
+// キャッシュに残っているファイルをオープンする際にサーバに渡して、先頭のデータを受け取らないようにする
+struct dname {
+  uint32_t hash;            // ファイル名のハッシュ値
+  uint32_t ident;
+  uint32_t mtime;
+  uint32_t size;
+} dname[CONFIG_NDNAME];
+static int dname_next;
+
+// HIMEM.SYSでハイメモリを確保する (HIMEM.SYSが組み込まれていなければNULLを返す)
+static void *himem_alloc(size_t size)
+{
+  // IOCS _HIMEMが未定義ならベクタはROM内を指している
+  if (*(uint32_t *)(0x400 + 0xf8 * 4) >= 0xfe0000)
+    return NULL;
 
-struct dcache *dcache_alloc(uint32_t fcb)
+  register int32_t d0 __asm__("d0") = 0xf8;     // IOCS _HIMEM
+  register int32_t d1 __asm__("d1") = 1;        // HIMEM_MALLOC
+  register int32_t d2 __asm__("d2") = size;
+  register void *a1 __asm__("a1");
+  __asm__ volatile ("trap #15" : "+r"(d0), "+r"(d1), "+r"(d2), "=r"(a1) : : "memory");
+  return d0 == 0 ? a1 : NULL;
+}
+
+// キャッシュ領域を確保してドライバの終了アドレスを返す
+void *dcache_init(void *end)
 {
-  for (int i = 0; i < CONFIG_NDCACHE; i++) {
-    if (dcache[i].fcb == fcb)
-      return &dcache[i];
+  size_t size = sizeof(struct dcache) * dcache_blocks;
+  end = (void *)(((uint32_t)end + 3) & ~3);
+  if (!(dcache_himem && (dcache = himem_alloc(size)))) {
+    dcache = end;
+    end = (char *)end + size;
   }
-  for (int i = 0; i < CONFIG_NDCACHE; i++) {
-    if (dcache[i].fcb == 0)
-      return &dcache[i];
+  for (int i = 0; i < dcache_blocks; i++)
+    dcache[i].key = 0;
+  DPRINTF1("dcache: %d blocks at 0x%08x\r\n", dcache_blocks, (uint32_t)dcache);
+  return end;
+}
+
+static void dcache_touch(struct dcache *d)
+{
+  d->lru = ++dcache_clock;
+}
+
+// FCBのファイルの書き込みエラーを後で返すために覚えておく (先に覚えたエラーを優先する)
+static void werr_set(uint32_t fcb, int res)
+{
+  int i;
+  for (i = 0; i < CONFIG_NWERR; i++) {
+    if (werr[i].fcb == fcb)
+      return;
+  }
+  for (i = 0; i < CONFIG_NWERR; i++) {
+    if (werr[i].fcb == 0)
+      break;
+  }
+  if (i == CONFIG_NWERR) {    // 空きがなければ古いものから上書きする
+    i = werr_next;
+    werr_next = (werr_next + 1) % CONFIG_NWERR;
+  }
+  DPRINTF1("fcb=0x%08x: write back failed -> %d\r\n", fcb, res);
+  werr[i].fcb = fcb;
+  werr[i].res = res;
+}
+
+// FCBのファイルの書き込みエラーを取り出す (なければ0)
+static int werr_take(uint32_t fcb)
+{
+  for (int i = 0; i < CONFIG_NWERR; i++) {
+    if (werr[i].fcb == fcb) {
+      werr[i].fcb = 0;
+      return werr[i].res;
+    }
+  }
+  return 0;
+}
+
+// ブロックの未書き込みデータをサーバに書き込む (書き込めなければエラーコードを返す)
+static int dcache_writeback(struct dcache *d)
+{
+  if (!d->dirty)
+    return 0;
+  d->dirty = false;
+  size_t len = d->dend - d->dstart;
+  ssize_t r = send_write(d->key, d->cache + d->dstart, d->pos + d->dstart, len);
+  return r == len ? 0 : (r < 0 ? r : _DOSE_DISKFULL);
+}
+
+// ブロック内のoffsetからlenバイトを書き換える
+static void dcache_update(struct dcache *d, int offset, const void *buf, size_t len)
+{
+  memcpy(d->cache + offset, buf, len);
+  if (offset + len > d->len)
+    d->len = offset + len;
+  if (!d->dirty) {
+    d->dirty = true;
+    d->dstart = offset;
+    d->dend = offset + len;
+  } else {
+    // 間に挟まる範囲もキャッシュ上のデータは最新なので、まとめて1つの範囲にする
+    if (offset < d->dstart)
+      d->dstart = offset;
+    if (offset + len > d->dend)
+      d->dend = offset + len;
+  }
+  dcache_touch(d);
+}
+
+// FCBのファイルのブロックのキーを得る
+static uint32_t dcache_key(uint32_t fcb, uint32_t *stamp)
+{
+  for (int i = 0; i < CONFIG_NDFILE; i++) {
+    if (dfile[i].fcb == fcb) {
+      *stamp = dfile[i].stamp;
+      return dfile[i].key;
+    }
+  }
+  *stamp = 0;
+  return fcb;
+}
+
+// キーがkeyでstampが異なるブロックを捨てる (stampが0ならすべて捨てる)
+static void dcache_purge(uint32_t key, uint32_t stamp)
+{
+  for (int i = 0; i < dcache_blocks; i++) {
+    if (dcache[i].key == key && (stamp == 0 || dcache[i].stamp != stamp))
+      dcache[i].key = 0;
+  }
+}
+
+static uint32_t dcache_stamp(uint32_t mtime, uint32_t size)
+{
+  return (mtime ^ size * 2654435761u) | 1;
+}
+
+// 識別子・更新日時・サイズが同じファイルの先頭のブロックがキャッシュにあるか
+static bool dcache_cached(uint32_t ident, uint32_t mtime, uint32_t size)
+{
+  uint32_t key = ident | 1;
+  uint32_t stamp = dcache_stamp(mtime, size);
+  for (int i = 0; i < dcache_blocks; i++) {
+    if (dcache[i].key == key && dcache[i].stamp == stamp && dcache[i].pos == 0)
+      return true;
+  }
+  return false;
+}
+
+// 読み込み専用でオープンしたファイルのブロックを識別子で管理する
+void dfile_open(uint32_t fcb, uint32_t ident, uint32_t mtime, uint32_t size, uint32_t date)
+{
+  uint32_t key = ident | 1;
+  uint32_t stamp = dcache_stamp(mtime, size);
+  dcache_purge(key, stamp);   // 内容が変わったファイルのブロックは捨てる
+  for (int i = 0; i < CONFIG_NDFILE; i++) {
+    if (dfile[i].fcb == 0 || dfile[i].fcb == fcb) {
+      dfile[i].fcb = fcb;
+      dfile[i].key = key;
+      dfile[i].stamp = stamp;
+      dfile[i].date = date;
+      return;
+    }
+  }
+}
+
+// オープン中の読み込み専用ファイルの更新日時を返す (不明なら0)
+uint32_t dfile_date(uint32_t fcb)
+{
+  for (int i = 0; i < CONFIG_NDFILE; i++) {
+    if (dfile[i].fcb == fcb)
+      return dfile[i].date;
+  }
+  return 0;
+}
+
+void dfile_setdate(uint32_t fcb, uint32_t date)
+{
+  for (int i = 0; i < CONFIG_NDFILE; i++) {
+    if (dfile[i].fcb == fcb)
+      dfile[i].date = date;
+  }
+}
+
+static uint32_t dname_hash(void *name)
+{
+  uint8_t *p = name;
+  uint32_t h = 2166136261u;
+  for (int i = 0; i < sizeof(struct dos_namestbuf); i++)
+    h = (h ^ *p++) * 16777619u;
+  return h;
+}
+
+struct dname *dname_find(uint32_t hash)
+{
+  for (int i = 0; i < CONFIG_NDNAME; i++) {
+    if (dname[i].hash == hash)
+      return &dname[i];
   }
   return NULL;
 }
 
+void dname_update(uint32_t hash, uint32_t ident, uint32_t mtime, uint32_t size)
+{
+  struct dname *n = dname_find(hash);
+  if (n == NULL) {
+    n = &dname[dname_next];
+    dname_next = (dname_next + 1) % CONFIG_NDNAME;
+  }
+  n->hash = hash;
+  n->ident = ident;
+  n->mtime = mtime;
+  n->size = size;
+}
+
+// 識別子での管理をやめる (discardならブロックも捨てる)
+void dfile_close(uint32_t fcb, bool discard)
+{
+  for (int i = 0; i < CONFIG_NDFILE; i++) {
+    if (dfile[i].fcb == fcb) {
+      if (discard)
+        dcache_purge(dfile[i].key, 0);
+      dfile[i].fcb = 0;
+    }
+  }
+}
+
+// 書き込むためにオープンしたファイルの古いブロックを捨てる
+void dfile_modify(uint32_t ident)
+{
+  if (ident)                  // 識別子が0のファイルのブロックは残していない
+    dcache_purge(ident | 1, 0);
+}
+
+// ファイル位置posのデータを持つブロックを探す
+struct dcache *dcache_find(uint32_t fcb, uint32_t pos)
+{
+  uint32_t stamp;
+  uint32_t key = dcache_key(fcb, &stamp);
+  for (int i = 0; i < dcache_blocks; i++) {
+    struct dcache *d = &dcache[i];
+    if (d->key == key && d->stamp == stamp && pos >= d->pos && pos < d->pos + d->len)
+      return d;
+  }
+  return NULL;
+}
+
+// ファイルの全ブロックの未書き込みデータをサーバに書き込む (cleanならブロックを解放する)
+// ファイル位置の順に書き込み、連続する範囲は1回の送信にまとめる
+// 書き込めなかったデータがあればエラーコードを返す
+// (未書き込みのデータがあるブロックのキーは常にFCBで、識別子のキーのブロックは解放しない)
 int dcache_flash(uint32_t fcb, bool clean)
 {
+  struct cmd_write *cmd = &b.cmd_write;
+  size_t clen = 0;          // cmd->dataに溜めたデータのサイズ
+  uint32_t cpos = 0;        // cmd->dataに溜めたデータのファイル位置
   int res = 0;
-  for (int i = 0; i < CONFIG_NDCACHE; i++) {
-    if (dcache[i].fcb == fcb) {
-      if (dcache[i].dirty) {
-        if (send_write(dcache[i].fcb, dcache[i].cache, dcache[i].pos, dcache[i].len) < 0)
-          res = -1;
-        dcache[i].dirty = false;
+
+  while (1) {
+    struct dcache *d = NULL;
+    for (int i = 0; i < dcache_blocks; i++) {
+      struct dcache *e = &dcache[i];
+      if (e->key == fcb && e->dirty &&
+          (d == NULL || e->pos + e->dstart < d->pos + d->dstart))
+        d = e;
+    }
+    if (d == NULL)
+      break;
+
+    d->dirty = false;
+    uint32_t pos = d->pos + d->dstart;
+    uint8_t *p = d->cache + d->dstart;
+    size_t len = d->dend - d->dstart;
+    while (len > 0) {
+      if (clen > 0 && (cpos + clen != pos || clen == sizeof(cmd->data))) {
+        ssize_t r = send_write_data(fcb, cpos, clen);
+        if (r != clen && res == 0)
+          res = r < 0 ? r : _DOSE_DISKFULL;
+        clen = 0;
       }
-      if (clean)
-        dcache[i].fcb = 0;
+      if (clen == 0)
+        cpos = pos;
+      size_t size = sizeof(cmd->data) - clen;
+      size = size < len ? size : len;
+      memcpy(cmd->data + clen, p, size);
+      clen += size;
+      pos += size;
+      p += size;
+      len -= size;
+    }
+  }
+  if (clen > 0) {
+    ssize_t r = send_write_data(fcb, cpos, clen);
+    if (r != clen && res == 0)
+      res = r < 0 ? r : _DOSE_DISKFULL;
+  }
+  DPRINTF2(" flush: fcb=0x%08x -> %d\r\n", fcb, res);
+
+  if (clean) {
+    for (int i = 0; i < dcache_blocks; i++) {
+      if (dcache[i].key == fcb)
+        dcache[i].key = 0;
     }
   }
   return res;
 }
 
-#if CONFIG_NFILEINFO > 1
+// 空きブロックを確保する (なければ最も長く使われていないブロックを追い出す)
+struct dcache *dcache_alloc(uint32_t fcb)
+{
+  struct dcache *d = NULL;
+  for (int i = 0; i < dcache_blocks; i++) {
+    if (dcache[i].key == 0) {
+      d = &dcache[i];
+      break;
+    }
+    if (d == NULL || (int32_t)(dcache[i].lru - d->lru) < 0)
+      d = &dcache[i];
+  }
+  if (d == NULL)
+    return NULL;
+  if (d->key && d->dirty) {
+    // 追い出すブロックのファイルの未書き込みデータをまとめて書き込む
+    // (書き込めなかったデータは失われるので、そのファイルへの次の操作でエラーを返す)
+    int r = dcache_flash(d->key, false);
+    if (r < 0)
+      werr_set(d->key, r);
+  }
+  d->key = dcache_key(fcb, &d->stamp);
+  d->pos = 0;
+  d->len = 0;
+  dcache_touch(d);
+  return d;
+}
+
+// ファイルのpos～pos+len-1の範囲と重なるブロックを書き込んでから解放する (exceptは除く)
+// 書き込めなかったデータがあれば、そのファイルへの次の操作でエラーを返す
+void dcache_discard(uint32_t fcb, uint32_t pos, size_t len, struct dcache *except)
+{
+  uint32_t stamp;
+  uint32_t key = dcache_key(fcb, &stamp);
+  for (int i = 0; i < dcache_blocks; i++) {
+    struct dcache *d = &dcache[i];
+    if (d != except && d->key == key &&
+        pos < d->pos + d->len && d->pos < pos + len) {
+      int r = dcache_writeback(d);
+      if (r < 0)
+        werr_set(fcb, r);
+      d->key = 0;
+    }
+  }
+}
+
+//****************************************************************************
+// Deferred create
+//****************************************************************************
+
+// 上書きを許すファイル作成はサーバに送らずに成功を返しておき、最初の書き込みの際に
+// 書き込みデータと一緒に送る (作成して書き込んでクローズする通信を減らす)
+// 書き込み以外の操作を行う前には作成を済ませておく
+// 作成に失敗したら、そのファイルへのそれ以降の操作はクローズまで全てそのエラーを返す
+
+// 作成を遅らせているファイルを作成する (fcbが0ならどのファイルでも)
+// dataがNULLでなければ先頭のlenバイトを書き込んで、書き込んだサイズを返す
+static int pcreate_flush(uint32_t fcb, const void *data, size_t len)
+{
+  struct cmd_createwrite *cmd = &b.cmd_createwrite;
+  struct res_createwrite *res = &b.res_createwrite;
+
+  if (fcb != 0 && pcreate_err.fcb == fcb)
+    return pcreate_err.res;
+  if (pcreate.fcb == 0 || (fcb != 0 && pcreate.fcb != fcb))
+    return 0;
+  fcb = pcreate.fcb;
+
+  if (data == NULL)
+    len = 0;
+  else
+    memmove(cmd->data, data, len);  // dataはb.cmd_write.dataの場合がある
+  memcpy(cmd, &pcreate, sizeof(pcreate));
+  cmd->command = (pcreate.command & 0xe0) | 0x1a; /* createwrite */
+  cmd->len = len;
+  pcreate.fcb = 0;
+
+  send_cmdres(cmd, offsetof(struct cmd_createwrite, data) + len, res, sizeof(*res));
+
+  DPRINTF1(" createwrite: fcb=0x%08x len=%d -> %d %d\r\n", fcb, len, res->res, res->len);
+  if (res->res != 0) {
+    pcreate_err.fcb = fcb;
+    pcreate_err.res = res->res;
+    return res->res;
+  }
+  dos_fcb_fd(fcb) = res->fd;
+  dfile_modify(res->ident);
+  return res->len;
+}
+
+//****************************************************************************
+// Read-ahead
+//****************************************************************************
+
+// FCB毎に前回の読み込み位置を覚えておき、続きから読む順次読み込みが続くと
+// キャッシュに充填するブロック数(先読みウィンドウ)を1,2,4,8...と増やしていく
+// 順次読み込みでなくなったら1ブロックに戻す
+
+struct stream {
+  uint32_t fcb;             // 0なら未使用
+  uint32_t next;            // 前回読み込んだ位置の次
+  int window;               // 先読みするブロック数
+  uint32_t lru;
+} stream[CONFIG_NSTREAM];
+
+// 今回の読み込みで充填するブロック数を決める
+int stream_window(uint32_t fcb, uint32_t pos)
+{
+  struct stream *s = NULL;
+  for (int i = 0; i < CONFIG_NSTREAM; i++) {
+    if (stream[i].fcb == fcb) {
+      s = &stream[i];
+      break;
+    }
+    if (s == NULL || (int32_t)(stream[i].lru - s->lru) < 0)
+      s = &stream[i];
+  }
+  if (s->fcb == fcb && s->next == pos) {
+    int max = dcache_blocks / 2;  // 1つのファイルでキャッシュを占有しないようにする
+    max = max < CONFIG_READAHEAD_MAX ? max : CONFIG_READAHEAD_MAX;
+    s->window = s->window * 2 < max ? s->window * 2 : max;
+  } else {
+    s->fcb = fcb;
+    s->window = 1;
+  }
+  s->lru = ++dcache_clock;
+  return s->window > 0 ? s->window : 1;
+}
+
+void stream_update(uint32_t fcb, uint32_t pos)
+{
+  for (int i = 0; i < CONFIG_NSTREAM; i++) {
+    if (stream[i].fcb == fcb) {
+      stream[i].next = pos;
+      return;
+    }
+  }
+}
+
+void stream_free(uint32_t fcb)
+{
+  for (int i = 0; i < CONFIG_NSTREAM; i++) {
+    if (stream[i].fcb == fcb)
+      stream[i].fcb = 0;
+  }
+}
+
+//****************************************************************************
+// Directory entry cache
+//****************************************************************************
+
+// FILBUF毎にサーバからまとめて受け取ったエントリを可変長形式のまま保持し、
+// NFILESで1つずつFILBUFに展開して返す
+// ワイルドカードを含む検索では最初にCONFIG_NFILES_FIRST個を受け取り、NFILESで
+// 取り直す度に受け取る数を倍にしていく (実際に受け取る数は応答に入る数まで)
+
 struct fcache {
-  uint32_t filep;
-  int cnt;
-  struct res_files files;
+  uint32_t filep;           // 0なら未使用
+  uint8_t cnt;              // 返したエントリ数
+  uint8_t num;              // 受け取ったエントリ数
+  uint8_t window;           // 次に受け取るエントリ数
+  bool eof;                 // サーバ側にもう残っているエントリがない
+  uint16_t pos;             // 次に返すエントリのdata内の位置
+  uint16_t time;            // 直前に返したエントリの時刻と日付
+  uint16_t date;
+  uint32_t lru;
+  uint8_t data[FILES_DATA_MAX];
 } fcache[CONFIG_NFCACHE];
+static uint32_t fcache_clock;
 
+// FILBUFのエントリを探す (newなら空きか最も長く使われていないエントリを割り当てる)
 struct fcache *fcache_alloc(uint32_t filep, bool new)
 {
+  struct fcache *fc = NULL;
   for (int i = 0; i < CONFIG_NFCACHE; i++) {
     if (fcache[i].filep == filep) {
-      return &fcache[i];
+      fc = &fcache[i];
+      break;
     }
   }
-  if (!new)
-    return NULL;
-  for (int i = 0; i < CONFIG_NFCACHE; i++) {
-    if (fcache[i].filep == 0) {
-      return &fcache[i];
+  if (fc == NULL && new) {
+    for (int i = 0; i < CONFIG_NFCACHE; i++) {
+      if (fcache[i].filep == 0) {
+        fc = &fcache[i];
+        break;
+      }
+      if (fc == NULL || (int32_t)(fcache[i].lru - fc->lru) < 0)
+        fc = &fcache[i];
     }
   }
-  return NULL;
+  if (fc) {
+    if (new) {
+      fc->filep = filep;
+      fc->cnt = fc->num = 0;
+      fc->eof = false;
+    }
+    fc->lru = ++fcache_clock;
+  }
+  return fc;
+}
+
+// 保持しているエントリを1つFILBUFに展開する
+static void fcache_next(struct fcache *fc, struct dos_filbuf *fb)
+{
+  uint8_t *p = &fc->data[fc->pos];
+  int flag = *p++;
+  int len = FILESENT_NAMELEN(flag);
+
+  fb->atr = *p++;
+  if (flag & FILESENT_TIME) {
+    fc->time = (p[0] << 8) | p[1];
+    p += 2;
+  }
+  if (flag & FILESENT_DATE) {
+    fc->date = (p[0] << 8) | p[1];
+    p += 2;
+  }
+  fb->time = fc->time;
+  fb->date = fc->date;
+  uint32_t size = 0;
+  do {
+    size = (size << 7) | (*p & 0x7f);
+  } while (*p++ & 0x80);
+  fb->filelen = size;
+  memcpy(fb->name, p, len);
+  memset(fb->name + len, 0, sizeof(fb->name) - len);
+
+  fc->pos = p + len - fc->data;
+  fc->cnt++;
+}
+
+// 受け取ったエントリを保持して先頭をFILBUFに返す
+static void fcache_store(struct fcache *fc, struct dos_filbuf *fb, struct res_files *res)
+{
+  memcpy(fc->data, res->data, sizeof(fc->data));
+  fc->eof = res->eof;
+  fc->cnt = 0;
+  fc->num = res->num;
+  fc->pos = 0;
+  fc->time = fc->date = 0;
+  fc->window = fc->window < 0x80 ? fc->window * 2 : 0xff;
+  fcache_next(fc, fb);
+}
+
+// 検索するファイル名にワイルドカードが含まれるか
+static bool name_wildcard(const dos_namebuf *ns)
+{
+  return memchr(ns->name1, '?', sizeof(ns->name1)) ||
+         memchr(ns->ext, '?', sizeof(ns->ext)) ||
+         memchr(ns->name2, '?', sizeof(ns->name2));
 }
-#endif
 
 //****************************************************************************
 // Device driver interrupt rountine
@@ -207,6 +1220,8 @@ void interrupt(void)
   struct dos_req_header *req = reqheader;
 
   if (setjmp(jenv)) {
+    dhandle_reset();
+    mcache_reset();
     com_timeout(req);
     return;
   }
@@ -215,7 +1230,41 @@ void interrupt(void)
 
   req->command = (req->command & 0x1f) | ((req->unit & 7) << 5);
 
-  switch (((req->command) & 0x1f) | 0x40) {
+  // 作成を遅らせているファイルは、そのファイルへの書き込み・シーク・クローズ以外の操作の前に作成する
+  // (失敗はpcreate_errに残り、以下でそのファイルへの操作の結果として返す)
+  int c = ((req->command) & 0x1f) | 0x40;
+  if (pcreate.fcb) {
+    if (!((c == 0x4b || c == 0x4d || c == 0x4e) && (uint32_t)req->fcb == pcreate.fcb))
+      pcreate_flush(0, NULL, 0);
+  }
+  if (pcreate_err.fcb && (uint32_t)req->fcb == pcreate_err.fcb) {
+    if (c == 0x49 || c == 0x4a) {
+      pcreate_err.fcb = 0;        // FCBが別のファイルに使われた
+    } else if (c >= 0x4b && c <= 0x4f) {
+      DPRINTF1("fcb=0x%08x: deferred create failed -> %d\r\n", (uint32_t)req->fcb, pcreate_err.res);
+      req->status = pcreate_err.res;
+      if (c == 0x4b) {
+        dcache_flash((uint32_t)req->fcb, true);   // 書き込めないブロックを捨てる
+        dfile_close((uint32_t)req->fcb, true);
+        stream_free((uint32_t)req->fcb);
+        werr_take((uint32_t)req->fcb);
+        pcreate_err.fcb = 0;
+      }
+      goto out;
+    }
+  }
+  if (c == 0x49 || c == 0x4a) {
+    werr_take((uint32_t)req->fcb);    // FCBが別のファイルに使われた
+  } else if (c >= 0x4c && c <= 0x4f) {
+    int r = werr_take((uint32_t)req->fcb);
+    if (r < 0) {
+      DPRINTF1("fcb=0x%08x: write back failed earlier -> %d\r\n", (uint32_t)req->fcb, r);
+      req->status = r;
+      goto out;
+    }
+  }
+
+  switch (c) {
   case 0x40: /* init */
   {
     req->command = 0; /* for Human68k bug workaround */
@@ -223,7 +1272,7 @@ void interrupt(void)
     if (r >= 0) {
       req->attr = r; /* Number of units */
       extern char _end;
-      req->addr = &_end;
+      req->addr = dcache_init(&_end);
     } else {
       err = r;
     }
@@ -233,10 +1282,18 @@ void interrupt(void)
   case 0x41: /* chdir */
   {
     struct cmd_dirop *cmd = &b.cmd_dirop;
-    struct res_dirop *res = &b.res_dirop;
+    struct res_chdir *res = &b.res_chdir;
+    struct mcache *mc;
+    if (mc = mcache_find(req->command, req->addr)) {
+      DNAMEPRINT(req->addr, false, "CHDIR: ");
+      DPRINTF1(" -> %d cached\r\n", mc->res);
+      req->status = mc->res;
+      break;
+    }
     cmd->command = req->command;
     memcpy(&cmd->path, req->addr, sizeof(struct dos_namestbuf));
-    com_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
+    send_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
+    mcache_store(req->command, req->addr, res->res, res->lease);
     DNAMEPRINT(req->addr, false, "CHDIR: ");
     DPRINTF1(" -> %d\r\n", res->res);
     req->status = res->res;
@@ -249,7 +1306,7 @@ void interrupt(void)
     struct res_dirop *res = &b.res_dirop;
     cmd->command = req->command;
     memcpy(&cmd->path, req->addr, sizeof(struct dos_namestbuf));
-    com_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
+    send_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
     DNAMEPRINT(req->addr, true, "MKDIR: ");
     DPRINTF1(" -> %d\r\n", res->res);
     req->status = res->res;
@@ -262,7 +1319,7 @@ void interrupt(void)
     struct res_dirop *res = &b.res_dirop;
     cmd->command = req->command;
     memcpy(&cmd->path, req->addr, sizeof(struct dos_namestbuf));
-    com_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
+    send_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
     DNAMEPRINT(req->addr, true, "RMDIR: ");
     DPRINTF1(" -> %d\r\n", res->res);
     req->status = res->res;
@@ -276,7 +1333,7 @@ void interrupt(void)
     cmd->command = req->command;
     memcpy(&cmd->path_old, req->addr, sizeof(struct dos_namestbuf));
     memcpy(&cmd->path_new, (void *)req->status, sizeof(struct dos_namestbuf));
-    com_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
+    send_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
     DNAMEPRINT(req->addr, true, "RENAME: ");
     DNAMEPRINT((void *)req->status, true, " to ");
     DPRINTF1(" -> %d\r\n", res->res);
@@ -290,7 +1347,7 @@ void interrupt(void)
     struct res_dirop *res = &b.res_dirop;
     cmd->command = req->command;
     memcpy(&cmd->path, req->addr, sizeof(struct dos_namestbuf));
-    com_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
+    send_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
     DNAMEPRINT(req->addr, true, "DELETE: ");
     DPRINTF1(" -> %d\r\n", res->res);
     req->status = res->res;
@@ -301,10 +1358,19 @@ void interrupt(void)
   {
     struct cmd_chmod *cmd = &b.cmd_chmod;
     struct res_chmod *res = &b.res_chmod;
+    struct mcache *mc;
+    if (req->attr == 0xff && (mc = mcache_find(req->command, req->addr))) {
+      DNAMEPRINT(req->addr, true, "CHMOD: ");
+      DPRINTF1(" 0x%02x -> 0x%02x cached\r\n", req->attr, mc->res);
+      req->status = mc->res;
+      break;
+    }
     cmd->command = req->command;
     cmd->attr = req->attr;
     memcpy(&cmd->path, req->addr, sizeof(struct dos_namestbuf));
-    com_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
+    send_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
+    if (req->attr == 0xff)
+      mcache_store(req->command, req->addr, res->res, res->lease);
     DNAMEPRINT(req->addr, true, "CHMOD: ");
     DPRINTF1(" 0x%02x -> 0x%02x\r\n", req->attr, res->res);
     req->status = res->res;
@@ -319,34 +1385,20 @@ void interrupt(void)
     cmd->attr = req->attr;
     cmd->filep = req->status;
     memcpy(&cmd->path, req->addr, sizeof(struct dos_namestbuf));
-#if CONFIG_NFILEINFO > 1
+    // ワイルドカードを含まなければ1つしか見つからない
     struct fcache *fc = fcache_alloc(cmd->filep, true);
-    if (fc) {
-      fc->filep = cmd->filep;
-      fc->cnt = 0;
-      cmd->num = CONFIG_NFILEINFO;
-    } else {
-      cmd->num = 1;
-    }
-#endif
+    fc->window = name_wildcard(&cmd->path) ? CONFIG_NFILES_FIRST : 1;
+    cmd->num = fc->window;
 
-    com_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
+    send_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
 
     struct dos_filbuf *fb = (struct dos_filbuf *)req->status;
-#if CONFIG_NFILEINFO > 1
-    if (fc) {
-      if (res->res == 0 && res->num > 1) {
-        fc->files = *res;
-        fc->cnt = 1;
-      } else {
-        fc->filep = 0;
-      }
-    }
-#endif
     if (res->res == 0)
-      memcpy(&fb->atr, &res->file[0].atr, sizeof(res->file[0]) - 1);
+      fcache_store(fc, fb, res);
+    else
+      fc->filep = 0;
     DNAMEPRINT(req->addr, false, "FILES: ");
-    DPRINTF1(" attr=0x%02x filep=0x%08x -> %d %s\r\n", req->attr, req->status, res->res, res->file[0].name);
+    DPRINTF1(" attr=0x%02x filep=0x%08x -> %d %s\r\n", req->attr, req->status, res->res, fb->name);
     req->status = res->res;
     break;
   }
@@ -359,40 +1411,35 @@ void interrupt(void)
     cmd->filep = req->status;
 
     struct dos_filbuf *fb = (struct dos_filbuf *)req->status;
-#if CONFIG_NFILEINFO > 1
-    struct fcache *fc;
-    if (fc = fcache_alloc(cmd->filep, false)) {
-      memcpy(&fb->atr, &fc->files.file[fc->cnt].atr, sizeof(fc->files.file[0]) - 1);
-      fc->cnt++;
+    struct fcache *fc = fcache_alloc(cmd->filep, false);
+    if (fc && fc->cnt < fc->num) {
+      // 受け取ってあるエントリを返す
+      fcache_next(fc, fb);
       res->res = 0;
-      if (fc->cnt >= fc->files.num) {
-        fc->filep = 0;
-      }
       goto out_nfiles;
     }
-    if (fc = fcache_alloc(cmd->filep, true)) {
-      fc->filep = cmd->filep;
-      fc->cnt = 0;
-      cmd->num = CONFIG_NFILEINFO;
-    } else {
-      cmd->num = 1;
+    if (fc && fc->eof) {
+      // サーバ側にも残っていないのでサーバに問い合わせずに終わる
+      fc->filep = 0;
+      res->res = _DOSE_NOMORE;
+      goto out_nfiles;
+    }
+    int size = offsetof(struct cmd_nfiles, name);
+    if (fc == NULL) {
+      // 他の検索に追い出されていたので、最後に返したファイル名の次から取り直す
+      fc = fcache_alloc(cmd->filep, true);
+      fc->window = CONFIG_NFILES_FIRST;
+      memcpy(cmd->name, fb->name, sizeof(cmd->name));
+      size = sizeof(*cmd);
     }
-#endif
+    cmd->num = fc->window;
 
-    com_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
+    send_cmdres(cmd, size, res, sizeof(*res));
 
-#if CONFIG_NFILEINFO > 1
-    if (fc) {
-      if (res->res == 0 && res->num > 1) {
-        fc->files = *(struct res_files *)res;
-        fc->cnt = 1;
-      } else {
-        fc->filep = 0;
-      }
-    }
-#endif
     if (res->res == 0)
-      memcpy(&fb->atr, &res->file[0].atr, sizeof(res->file[0]) - 1);
+      fcache_store(fc, fb, (struct res_files *)res);
+    else
+      fc->filep = 0;
 out_nfiles:
     DPRINTF1("NFILES: filep=0x%08x -> %d %s\r\n", req->status, res->res, fb->name);
     req->status = res->res;
@@ -403,12 +1450,28 @@ out_nfiles:
   {
     struct cmd_create *cmd = &b.cmd_create;
     struct res_create *res = &b.res_create;
+    if (req->status != 0) {
+      // 上書きを許す作成は最初の書き込みまで遅らせる
+      cmd = &pcreate;
+    }
     cmd->command = req->command;
     cmd->attr = req->attr;
     cmd->mode = req->status;
     cmd->fcb = (uint32_t)req->fcb;
     memcpy(&cmd->path, req->addr, sizeof(struct dos_namestbuf));
-    com_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
+    dos_fcb_fd(req->fcb) = FILEHANDLE_NONE;
+    if (cmd == &pcreate) {
+      dos_fcb_size(req->fcb) = 0;
+      DNAMEPRINT(req->addr, true, "CREATE: ");
+      DPRINTF1(" fcb=0x%08x attr=0x%02x mode=%d -> deferred\r\n", (uint32_t)req->fcb, req->attr, req->status);
+      req->status = 0;
+      break;
+    }
+    send_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
+    if (res->res == 0) {
+      dos_fcb_fd(req->fcb) = res->fd;
+      dfile_modify(res->ident);
+    }
     dos_fcb_size(req->fcb) = 0;
     DNAMEPRINT(req->addr, true, "CREATE: ");
     DPRINTF1(" fcb=0x%08x attr=0x%02x mode=%d -> %d\r\n", (uint32_t)req->fcb, req->attr, req->status, res->res);
@@ -421,11 +1484,60 @@ out_nfiles:
     struct cmd_open *cmd = &b.cmd_open;
     struct res_open *res = &b.res_open;
     int mode = dos_fcb_mode(req->fcb);
+    if (mode == 0) {
+      // 読み込み専用ならファイルの先頭のデータも受け取ってキャッシュに入れる
+      struct cmd_openread *cmd = &b.cmd_openread;
+      struct res_openread *res = &b.res_openread;
+      uint32_t fcb = (uint32_t)req->fcb;
+      uint32_t hash = dname_hash(req->addr);
+      struct dname *n = dname_find(hash);
+      struct dcache *d = dcache_alloc(fcb);
+      cmd->command = (req->command & 0xe0) | 0x19; /* openread */
+      cmd->mode = mode;
+      cmd->fcb = fcb;
+      memcpy(&cmd->path, req->addr, sizeof(struct dos_namestbuf));
+      cmd->len = d ? sizeof(d->cache) : 0;
+      cmd->ident = cmd->mtime = cmd->size = 0;
+      if (n && dcache_cached(n->ident, n->mtime, n->size)) {
+        // キャッシュにあるファイルなら変更されていない限りデータを受け取らない
+        cmd->ident = n->ident;
+        cmd->mtime = n->mtime;
+        cmd->size = n->size;
+      }
+      send_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
+      if (res->res == 0) {
+        dos_fcb_fd(req->fcb) = res->fd;
+        if (res->ident) {
+          dfile_open(fcb, res->ident, res->mtime, res->size, res->time | (res->date << 16));
+          dname_update(hash, res->ident, res->mtime, res->size);
+        }
+        if (d && res->len > 0) {
+          dcache_discard(fcb, 0, res->len, d);
+          d->key = dcache_key(fcb, &d->stamp);
+          d->pos = 0;
+          d->len = res->len;
+          d->dirty = false;
+          memcpy(d->cache, res->data, res->len);
+          d = NULL;
+        }
+      }
+      if (d)
+        d->key = 0;
+      dos_fcb_size(req->fcb) = res->size;
+      DNAMEPRINT(req->addr, true, "OPEN: ");
+      DPRINTF1(" fcb=0x%08x mode=%d -> %d %d (%d)\r\n", fcb, mode, res->res, res->size, res->len);
+      req->status = res->res;
+      break;
+    }
     cmd->command = req->command;
     cmd->mode = mode;
     cmd->fcb = (uint32_t)req->fcb;
     memcpy(&cmd->path, req->addr, sizeof(struct dos_namestbuf));
-    com_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
+    send_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
+    if (res->res == 0) {
+      dos_fcb_fd(req->fcb) = res->fd;
+      dfile_modify(res->ident);
+    }
     dos_fcb_size(req->fcb) = res->size;
     DNAMEPRINT(req->addr, true, "OPEN: ");
     DPRINTF1(" fcb=0x%08x mode=%d -> %d %d\r\n", (uint32_t)req->fcb, mode, res->res, res->size);
@@ -435,61 +1547,97 @@ out_nfiles:
 
   case 0x4b: /* close */
   {
-    dcache_flash((uint32_t)req->fcb, true);
+    // 書き込めなかったデータがあってもサーバ側のファイルは閉じてからエラーを返す
+    int ferr = dcache_flash((uint32_t)req->fcb, true);
+    int w = werr_take((uint32_t)req->fcb);    // 以前に書き込めなかったデータがあった
+    if (w < 0)
+      ferr = w;
+    dfile_close((uint32_t)req->fcb, false);
+    stream_free((uint32_t)req->fcb);
 
     struct cmd_close *cmd = &b.cmd_close;
     struct res_close *res = &b.res_close;
+    int r;
+    if ((r = pcreate_flush((uint32_t)req->fcb, NULL, 0)) < 0) {
+      req->status = r;    // 遅らせていたファイル作成に失敗した
+      break;
+    }
     cmd->command = req->command;
-    cmd->fcb = (uint32_t)req->fcb;
-    com_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
-    DPRINTF1("CLOSE: fcb=0x%08x\r\n", (uint32_t)req->fcb);
-    req->status = res->res;
+    cmd->fd = dos_fcb_fd(req->fcb);
+    if (dos_fcb_mode(req->fcb) == 0) {
+      // 読み込み専用ファイルのクローズは失敗しないので結果を待たずに後で送る
+      defer_cmd(cmd, sizeof(*cmd));
+      DPRINTF1("CLOSE: fcb=0x%08x (deferred)\r\n", (uint32_t)req->fcb);
+      req->status = ferr;
+      break;
+    }
+    send_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
+    DPRINTF1("CLOSE: fcb=0x%08x %d -> %d\r\n", (uint32_t)req->fcb, ferr, res->res);
+    req->status = ferr < 0 ? ferr : res->res;
     break;
   }
 
   case 0x4c: /* read */
   {
-    dcache_flash((uint32_t)req->fcb, false);
-
+    uint32_t fcb = (uint32_t)req->fcb;
     uint32_t *pp = &dos_fcb_fpos(req->fcb);
     char *buf = (char *)req->addr;
     size_t len = (size_t)req->status;
     ssize_t size = 0;
     struct dcache *d;
-    
-    if (d = dcache_alloc((uint32_t)req->fcb)) {
-      // キャッシュが未使用または自分のデータが入っている場合
-      do {
-        if (d->fcb == (uint32_t)req->fcb &&
-            *pp >= d->pos && *pp < d->pos + d->len) {
-          // これから読むデータがキャッシュに入っている場合、キャッシュから読めるだけ読む
-          size_t clen = d->pos + d->len - *pp;   // キャッシュから読めるサイズ
-          clen = clen < len ? clen : len;
-
-          memcpy(buf, d->cache + (*pp - d->pos), clen);
-          buf += clen;
-          len -= clen;
-          size += clen;
-          *pp += clen;    // FCBのファイルポインタを進める
-        }
-        if (len == 0 || len >= sizeof(d->cache))
+    int window = stream_window(fcb, *pp);
+    int r;
+
+    while (len > 0) {
+      if (d = dcache_find(fcb, *pp)) {
+        // これから読むデータがキャッシュに入っている場合、キャッシュから読めるだけ読む
+        size_t clen = d->pos + d->len - *pp;   // キャッシュから読めるサイズ
+        clen = clen < len ? clen : len;
+
+        memcpy(buf, d->cache + (*pp - d->pos), clen);
+        buf += clen;
+        len -= clen;
+        size += clen;
+        *pp += clen;    // FCBのファイルポインタを進める
+        dcache_touch(d);
+        continue;
+      }
+      if (len >= CONFIG_DATASIZE)
+        break;
+      // キャッシュサイズ未満の読み込みならキャッシュを先読みウィンドウ分充填
+      if ((r = dcache_flash(fcb, false)) < 0) {
+        size = r;
+        goto errout_read;
+      }
+      uint32_t rpos = *pp;
+      for (int i = 0; i < window; i++) {
+        if (i > 0 && (rpos >= dos_fcb_size(req->fcb) || dcache_find(fcb, rpos)))
+          break;        // ファイル末尾または既にキャッシュにある
+        if ((d = dcache_alloc(fcb)) == NULL)
+          break;
+        d->pos = rpos;
+        d->len = send_read(fcb, d->cache, rpos, sizeof(d->cache));
+        if (d->len <= 0) {
+          d->key = 0;
+          if (d->len < 0 && i == 0) {
+            size = -1;
+            goto errout_read;
+          }
           break;
-        // キャッシュサイズ未満の読み込みならキャッシュを充填
-        dcache_flash((uint32_t)req->fcb, true);
-        d->len = send_read((uint32_t)req->fcb, d->cache, *pp, sizeof(d->cache));
-        if (d->len < 0) {
-          size = -1;
-          goto errout_read;
         }
-        d->fcb = (uint32_t)req->fcb;
-        d->pos = *pp;
-        d->dirty = false;
-      } while (d->len > 0);
+        rpos += d->len;
+      }
+      if (rpos == *pp)
+        break;          // ファイル末尾
     }
 
     if (len > 0) {
-      size_t rlen;
-      rlen = send_read((uint32_t)req->fcb, buf, *pp, len);
+      ssize_t rlen;
+      if ((r = dcache_flash(fcb, false)) < 0) {
+        size = r;
+        goto errout_read;
+      }
+      rlen = send_read(fcb, buf, *pp, len);
       if (rlen < 0) {
         size = -1;
         goto errout_read;
@@ -497,6 +1645,7 @@ out_nfiles:
       size += rlen;
       *pp += rlen;    // FCBのファイルポインタを進める
     }
+    stream_update(fcb, *pp);
 
 errout_read:
     DPRINTF1("READ: fcb=0x%08x %d -> %d\r\n", (uint32_t)req->fcb, req->status, size);
@@ -506,37 +1655,69 @@ errout_read:
 
   case 0x4d: /* write */
   {
+    uint32_t fcb = (uint32_t)req->fcb;
     uint32_t *pp = &dos_fcb_fpos(req->fcb);
     uint32_t *sp = &dos_fcb_size(req->fcb);
     size_t len = (uint32_t)req->status;
     struct dcache *d;
 
-    if (len > 0 && len < sizeof(dcache[0].cache)) {  // 書き込みサイズがキャッシュサイズ未満
-      if (d = dcache_alloc((uint32_t)req->fcb)) {
-        // キャッシュが未使用または自分のデータが入っている場合
-        if (d->fcb == (uint32_t)req->fcb) {         //キャッシュに自分のデータが入っている
-          if ((*pp = d->pos + d->len) &&
-              ((*pp + len) <= (d->pos + sizeof(d->cache)))) {
-            // 書き込みデータがキャッシュに収まる場合はキャッシュに書く
-            memcpy(d->cache + d->len, (char *)req->addr, len);
-            d->len += len;
-            goto okout_write;
-          } else {    //キャッシュに収まらないのでフラッシュ
-            dcache_flash((uint32_t)req->fcb, true);
+    dfile_close(fcb, true);     // 書き込むファイルのブロックは識別子で管理しない
+
+    if (len > 0 && len < CONFIG_DATASIZE) {  // 書き込みサイズがキャッシュサイズ未満
+      // 書き込み位置のデータを持つブロックか、書き込み位置で終わっているブロックに書く
+      // なければ新しいブロックに書く
+      char *buf = (char *)req->addr;
+      uint32_t pos = *pp;
+      size_t rest = len;
+      while (rest > 0) {
+        if ((d = dcache_find(fcb, pos)) == NULL) {
+          for (int i = 0; i < dcache_blocks; i++) {
+            if (dcache[i].key == fcb && dcache[i].pos + dcache[i].len == pos &&
+                dcache[i].len < sizeof(dcache[i].cache)) {
+              d = &dcache[i];
+              break;
+            }
           }
         }
-        // 書き込みデータをキャッシュに書く
-        d->fcb = (uint32_t)req->fcb;
-        d->pos = *pp;
-        memcpy(d->cache, (char *)req->addr, len);
-        d->len = len;
-        d->dirty = true;
+        if (d == NULL) {
+          if ((d = dcache_alloc(fcb)) == NULL)
+            break;
+          d->pos = pos;
+        }
+        int offset = pos - d->pos;
+        size_t size = sizeof(d->cache) - offset;
+        size = size < rest ? size : rest;
+        // 書き込み範囲の古いデータを持つ他のブロックは捨てる
+        dcache_discard(fcb, pos, size, d);
+        dcache_update(d, offset, buf, size);
+        buf += size;
+        pos += size;
+        rest -= size;
+      }
+      if (rest == 0)
+        goto okout_write;
+      if (rest < len) {
+        // キャッシュに書けなかった残りのデータを書き込む
+        dcache_discard(fcb, pos, rest, NULL);
+        ssize_t wlen = send_write(fcb, buf, pos, rest);
+        len -= rest;
+        len += wlen > 0 ? wlen : 0;
         goto okout_write;
       }
     }
 
-    dcache_flash((uint32_t)req->fcb, false);
-    len = send_write((uint32_t)req->fcb, (char *)req->addr, *pp, (uint32_t)req->status);
+    if (len == 0) {
+      // truncateするのでキャッシュをすべて捨てる (書き込めなかったデータがあればエラーを返す)
+      int r = dcache_flash(fcb, true);
+      if (r < 0) {
+        DPRINTF1("WRITE: fcb=0x%08x 0 -> %d\r\n", (uint32_t)req->fcb, r);
+        req->status = r;
+        break;
+      }
+    } else {
+      dcache_discard(fcb, *pp, len, NULL);
+    }
+    len = send_write(fcb, (char *)req->addr, *pp, (uint32_t)req->status);
     if (len == 0) {
       *sp = *pp;      //0バイト書き込み=truncateなのでFCBのファイルサイズをポインタ位置にする
     }
@@ -554,14 +1735,15 @@ okout_write:
 
   case 0x4e: /* seek */
   {
-    dcache_flash((uint32_t)req->fcb, false);
-
     int whence = req->attr;
     int32_t offset = req->status;
     uint32_t pos = dos_fcb_fpos(req->fcb);
     uint32_t size = dos_fcb_size(req->fcb);
     pos = (whence == 0 ? 0 : (whence == 1 ? pos : size)) + offset;
     if (pos > size) {   // ファイル末尾を越えてseekしようとした
+      int r = dcache_flash((uint32_t)req->fcb, false);
+      if (r < 0)
+        werr_set((uint32_t)req->fcb, r);
       pos = _DOSE_CANTSEEK;
     } else {
       dos_fcb_fpos(req->fcb) = pos;
@@ -573,13 +1755,29 @@ okout_write:
 
   case 0x4f: /* filedate */
   {
+    // 書き込みで日付が変わらないように先に書き込む
+    int r = dcache_flash((uint32_t)req->fcb, false);
+    if (r < 0) {
+      DPRINTF1("FILEDATE: fcb=0x%08x -> %d\r\n", (uint32_t)req->fcb, r);
+      req->status = r;
+      break;
+    }
+
+    if (req->status == 0 && (req->status = dfile_date((uint32_t)req->fcb)) != 0) {
+      // オープン時に受け取った更新日時を返す
+      DPRINTF1("FILEDATE: fcb=0x%08x -> 0x%08x (cached)\r\n", (uint32_t)req->fcb, req->status);
+      break;
+    }
+
     struct cmd_filedate *cmd = &b.cmd_filedate;
     struct res_filedate *res = &b.res_filedate;
     cmd->command = req->command;
-    cmd->fcb = (uint32_t)req->fcb;
+    cmd->fd = dos_fcb_fd(req->fcb);
     cmd->time = req->status & 0xffff;
     cmd->date = req->status >> 16;
-    com_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
+    if (req->status != 0)
+      dfile_setdate((uint32_t)req->fcb, 0);   // 変更後の日時はサーバに問い合わせる
+    send_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
     DPRINTF1("FILEDATE: fcb=0x%08x 0x%04x 0x%04x -> 0x%04x 0x%04x\r\n", (uint32_t)req->fcb, req->status >> 16, req->status & 0xffff, res->date, res->time);
     req->status = res->time + (res->date << 16);
     break;
@@ -589,8 +1787,16 @@ okout_write:
   {
     struct cmd_dskfre *cmd = &b.cmd_dskfre;
     struct res_dskfre *res = &b.res_dskfre;
-    cmd->command = req->command;
-    com_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
+    int unit = req->command >> 5;
+    if (mdskfre[unit].lease && mcache_valid(mdskfre[unit].time, mdskfre[unit].lease)) {
+      res = &mdskfre[unit].res;
+    } else {
+      cmd->command = req->command;
+      send_cmdres(cmd, sizeof(*cmd), res, sizeof(*res));
+      mdskfre[unit].res = *res;
+      mdskfre[unit].lease = res->lease;
+      mdskfre[unit].time = _iocs_ontime().sec;
+    }
 
     uint16_t *p = (uint16_t *)req->addr;
     p[0] = res->freeclu;
@@ -656,6 +1862,7 @@ okout_write:
     break;
   }
 
+out:
   req->errl = err & 0xff;
   req->errh = err >> 8;
 }
@@ -43,9 +43,15 @@ void DNAMEPRINT(void *n, bool full, char *head);
 #endif
 
 extern jmp_buf jenv;
+extern uint8_t com_gen;
 
 void com_cmdres(void *wbuf, size_t wsize, void *rbuf, size_t rsize);
 void com_timeout(struct dos_req_header *req);
 int com_init(struct dos_req_header *req);
 
+extern int dcache_blocks;
+extern bool dcache_himem;
+
+void *dcache_init(void *end);
+
 #endif /* _REMOTEDRV_H_ */
@@ -43,6 +43,7 @@
 bool recovery = false;  //エラー回復モードフラグ
 int timeout = 500;      //コマンド受信タイムアウト(5sec)
 int resmode = 0;        //登録モード (0:常に登録 / 1:起動時にサーバと通信できたら登録)
+uint8_t com_gen;        //最後に受け取った応答に付いていたユニットの世代
 
 #ifdef DEBUG
 int debuglevel = 0;
@@ -170,6 +171,7 @@ static void serin(void *buf, size_t len)
   // データサイズを取得
   size = inp232c() << 8;
   size += inp232c();
+  com_gen = inp232c();
   DPRINTF3("\r\n");
   if (size > len) {
     longjmp(jenv, -1);
@@ -263,6 +265,15 @@ int com_init(struct dos_req_header *req)
         if (timeout == 0)
           timeout = 500;
         break;
+      case 'c':         // /c<blocks> .. データキャッシュのブロック数設定
+        p++;
+        dcache_blocks = my_atoi(p);
+        if (dcache_blocks > CONFIG_NDCACHE_MAX)
+          dcache_blocks = CONFIG_NDCACHE_MAX;
+        break;
+      case 'h':         // /h .. データキャッシュをハイメモリに確保
+        dcache_himem = true;
+        break;
       case 'u':         // /u<units> .. ユニット数設定
         p++;
         units = my_atoi(p);
@@ -99,6 +99,14 @@
 #define dos_fcb_mode(fcb)   (((uint8_t *)(fcb))[14])
 #define dos_fcb_fpos(fcb)   (*(uint32_t *)(&((uint8_t *)(fcb))[6]))
 #define dos_fcb_size(fcb)   (*(uint32_t *)(&((uint8_t *)(fcb))[64]))
+// サーバが割り当てたファイルハンドルはFCBの+68に置く
+// FCBの+64以降はファイルサイズ(+64)に続いてブロックデバイスのFATを辿るための情報を
+// Human68kが保持する領域で、リモートデバイスではファイルの読み書きをすべてドライバに任せるため
+// Human68kはこの領域を使わない (サイズはdos_fcb_sizeとしてドライバが設定している)
+// FCBはDUPしても複製されず共有されるので、オープンからクローズまでドライバが値を保持できる
+// 万一書き換えられても、サーバはハンドルの世代番号で古いハンドルや不正なハンドルを拒否する
+#define dos_fcb_fd(fcb)     (*(uint16_t *)(&((uint8_t *)(fcb))[68]))
+#define FILEHANDLE_NONE     0       // サーバはファイルハンドルに0を使わない
 
 struct dos_req_header {
   uint8_t magic;       // +0x00.b  Constant (26)
@@ -135,6 +143,11 @@ typedef struct {
 // ZRMTDSK serial communication protocol definition
 //****************************************************************************
 
+// 応答フレームはサイズの後に、コマンドを送ったユニットの世代(1byte)を付ける
+// サーバはユニットの内容を変える操作を行う度にそのユニットの世代を進める
+// CHDIR/CHMOD(属性の取得)/DSKFREの応答のleaseは、ドライバが世代が変わらない限り
+// その結果を使ってよい時間 (1/10秒単位、0なら覚えておかない)
+
 struct cmd_init {
   uint8_t command;
 } __attribute__((packed));
@@ -150,6 +163,11 @@ struct res_dirop {
   int8_t res;
 } __attribute__((packed));
 
+struct res_chdir {
+  int8_t res;
+  uint8_t lease;
+} __attribute__((packed));
+
 struct cmd_rename {
   uint8_t command;
   dos_namebuf path_old;
@@ -166,38 +184,51 @@ struct cmd_chmod {
 } __attribute__((packed));
 struct res_chmod {
   int8_t res;
+  uint8_t lease;
 } __attribute__((packed));
 
+// FILES/NFILESはnumにドライバが受け取れるエントリ数を指定し、サーバは1回の応答に
+// 入るだけのエントリを以下の可変長形式で詰めて返す
+// 応答のサイズは返したエントリによって変わる
+//   +0     bit7-2:ファイル名の長さ bit1:日付あり bit0:時刻あり
+//   +1     属性
+//   (時刻)  2bytes 直前のエントリと同じなら省略 (先頭のエントリは0と比べる)
+//   (日付)  2bytes 同上
+//   サイズ 上位から7bitずつ 最後のバイト以外はbit7を立てる
+//   ファイル名 (NULなし)
+#define FILESENT_TIME       0x01
+#define FILESENT_DATE       0x02
+#define FILESENT_NAMELEN(f) ((f) >> 2)
+#define FILES_DATA_MAX      (CONFIG_NFILEINFO * sizeof(struct dos_filesinfo))
+
 struct cmd_files {
   uint8_t command;
   uint8_t attr;
-#if CONFIG_NFILEINFO > 1
   uint8_t num;
-#endif
   UINT32_T filep;
   dos_namebuf path;
 } __attribute__((packed));
 struct res_files {
   int8_t res;
-#if CONFIG_NFILEINFO > 1
   uint8_t num;
-#endif
-  struct dos_filesinfo file[CONFIG_NFILEINFO];
+  uint8_t eof;                  // サーバ側のファイル名リストが空になった
+  uint8_t data[FILES_DATA_MAX];
 } __attribute__((packed));
 
+// ドライバが受け取ったエントリを返し終える前にキャッシュから追い出した場合は、
+// 最後に返したファイル名をnameに付けて送り、サーバはその次のエントリから返し直す
+// (通常はnameを付けずに送る)
 struct cmd_nfiles {
   uint8_t command;
-#if CONFIG_NFILEINFO > 1
   uint8_t num;
-#endif
   UINT32_T filep;
+  char name[23];
 } __attribute__((packed));
 struct res_nfiles {
   int8_t res;
-#if CONFIG_NFILEINFO > 1
   uint8_t num;
-#endif
-  struct dos_filesinfo file[CONFIG_NFILEINFO];
+  uint8_t eof;                  // サーバ側のファイル名リストが空になった
+  uint8_t data[FILES_DATA_MAX];
 } __attribute__((packed));
 
 struct cmd_create {
@@ -209,6 +240,8 @@ struct cmd_create {
 } __attribute__((packed));
 struct res_create {
   int8_t res;
+  UINT32_T ident;     // ファイルの識別子
+  UINT16_T fd;        // 以降の操作で使うファイルハンドル
 } __attribute__((packed));
 
 struct cmd_open {
@@ -220,11 +253,14 @@ struct cmd_open {
 struct res_open {
   int8_t res;
   UINT32_T size;
+  UINT32_T ident;     // ファイルの識別子 (パス名とinode番号から作る, 作れなければ0)
+  UINT32_T mtime;     // ファイルの更新日時 (ナノ秒まで反映した比較用の値)
+  UINT16_T fd;        // 以降の操作で使うファイルハンドル
 } __attribute__((packed));
 
 struct cmd_close {
   uint8_t command;
-  UINT32_T fcb;
+  UINT16_T fd;
 } __attribute__((packed));
 struct res_close {
   int8_t res;
@@ -232,7 +268,7 @@ struct res_close {
 
 struct cmd_read {
   uint8_t command;
-  UINT32_T fcb;
+  UINT16_T fd;
   UINT32_T pos;
   UINT16_T len;
 } __attribute__((packed));
@@ -243,7 +279,7 @@ struct res_read {
 
 struct cmd_write {
   uint8_t command;
-  UINT32_T fcb;
+  UINT16_T fd;
   UINT32_T pos;
   UINT16_T len;
   uint8_t data[CONFIG_DATASIZE];
@@ -254,7 +290,7 @@ struct res_write {
 
 struct cmd_filedate {
   uint8_t command;
-  UINT32_T fcb;
+  UINT16_T fd;
   UINT16_T time;
   UINT16_T date;
 } __attribute__((packed));
@@ -263,6 +299,88 @@ struct res_filedate {
   UINT16_T date;
 } __attribute__((packed));
 
+// ファイルを読み込み専用でオープンし、先頭のデータも返す
+// ドライバがキャッシュしているファイルと識別子・更新日時・サイズが同じならデータは返さない
+struct cmd_openread {
+  uint8_t command;
+  uint8_t mode;
+  UINT32_T fcb;
+  dos_namebuf path;
+  UINT16_T len;
+  UINT32_T ident;
+  UINT32_T mtime;
+  UINT32_T size;
+} __attribute__((packed));
+struct res_openread {
+  int8_t res;
+  UINT32_T size;
+  UINT32_T ident;
+  UINT32_T mtime;
+  UINT16_T fd;
+  uint8_t attr;
+  UINT16_T time;
+  UINT16_T date;
+  INT16_T len;
+  uint8_t data[CONFIG_DATASIZE];
+} __attribute__((packed));
+
+// ファイルを作成し、先頭のデータも書き込む
+struct cmd_createwrite {
+  uint8_t command;
+  uint8_t attr;
+  uint8_t mode;
+  UINT32_T fcb;
+  dos_namebuf path;
+  UINT16_T len;
+  uint8_t data[CONFIG_DATASIZE];
+} __attribute__((packed));
+struct res_createwrite {
+  int8_t res;
+  UINT32_T ident;
+  UINT16_T fd;
+  INT16_T len;
+} __attribute__((packed));
+
+// パス名を短く符号化したコマンド (サーバで元のコマンドに戻して実行する)
+//   0x1c|unit<<5, 元のコマンド, パス名の数,
+//   {直前のパス名からのバイト数, そのバイト列, 符号化したパス名} * パス名の数,
+//   残りのバイト数(2バイト), 残りのバイト列
+// 符号化したパス名は
+//   flag, drive, ディレクトリ, name1の長さ|extの長さ<<4, name2の長さ, name1, ext, name2
+// で、各フィールドは末尾の詰め物(pathとname2は0x00、name1とextは0x20)を除いて送る
+// ディレクトリは 0x80|ハンドル番号 で登録済みのディレクトリを参照するか、
+//   パスの長さ, パス
+// で直接指定する
+// 直接指定されたディレクトリはサーバがユニット毎にハンドルを割り当てて登録し、
+// 応答の先頭で知らせる (INITで全て無効になる)
+// 応答は以下の後ろに元のコマンドの応答を続けたもの
+//   結果 (0:実行した COMPACT_UNKNOWN:無効なハンドルを参照した 負:不正なコマンド),
+//   パス名毎のハンドル番号 (DIRHANDLE_NONEなら登録していない)
+// 結果が0以外ならコマンドは実行されていない
+// 無効なハンドルを参照した場合 (サーバが再起動した場合など)、ドライバはそのユニットの
+// ハンドルを捨ててパス名を直接指定して送り直す
+#define DIRHANDLE_MAX   64
+#define DIRHANDLE_NONE  0xff
+#define COMPACT_UNKNOWN 1
+
+struct res_compact {
+  int8_t res;
+  uint8_t handle[2];
+} __attribute__((packed));
+
+// 複数のコマンドをまとめて送り、サーバで順に実行する
+// dataには各コマンドを(2バイトのコマンド長, コマンド)の形でcount個並べる
+// 応答は最後以外のコマンドの結果(応答の先頭1バイト)を並べた後に最後のコマンドの応答を続けたもの
+#define COMPOUND_MAX  16
+struct cmd_compound {
+  uint8_t command;
+  uint8_t count;
+  uint8_t data[sizeof(struct cmd_createwrite) + 128];
+} __attribute__((packed));
+struct res_compound {
+  uint8_t data[COMPOUND_MAX - 1 + sizeof(struct res_compact) + sizeof(struct res_openread)];
+} __attribute__((packed));
+
 struct cmd_dskfre {
   uint8_t command;
 } __attribute__((packed));
@@ -272,6 +390,7 @@ struct res_dskfre {
   UINT16_T totalclu;
   UINT16_T clusect;
   UINT16_T sectsize;
+  uint8_t lease;
 } __attribute__((packed));
 
 #endif /* _X68KREMOTE_H_ */
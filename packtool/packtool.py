@@ -0,0 +1,222 @@
+#!/usr/bin/env python3
+
+# Copyright (c) 2023 Yuichi Nakamura
+# Licensed under the MIT license: http://www.opensource.org/licenses/mit-license.php
+
+import sys
+import os
+import zlib
+from struct import pack, unpack, calcsize
+
+# Pack file layout (all values are big-endian)
+#
+#  header     : magic, version, block size, # of entries, # of blocks,
+#               offset of the block table, offset of the name table
+#  entries    : entry #0 is the root directory. Entries are numbered in
+#               breadth-first order and the children of each directory are
+#               sorted by name (ASCII case-insensitive), so that each directory
+#               covers a contiguous range of entries that can be binary searched
+#  block table: (offset, compressed size) of each data block
+#               a block whose compressed size equals its original size is stored
+#  name table : NUL terminated UTF-8 names
+#  data       : blocks compressed independently with raw deflate
+
+MAGIC = b'X68KPACK'
+VERSION = 1
+BLOCKSIZE = 16384
+
+HEADER = '>8sHHIIIII'       # magic, version, flags, blocksize, nent, nblk, blkofs, nameofs
+ENTRY = '>IIIIIB3x'         # name, parent, mtime, size/first child, first block/children, attr
+BLOCK = '>II'               # offset, compressed size
+
+ATTR_RDONLY = 0x01
+ATTR_DIR = 0x10
+ATTR_FILE = 0x20
+
+class PackEntry:
+    def __init__(self, name, path, parent, st):
+        self.name = name
+        self.path = path
+        self.parent = parent
+        self.mtime = int(st.st_mtime)
+        self.isdir = os.path.isdir(path)
+        self.attr = ATTR_DIR if self.isdir else ATTR_FILE
+        if not (st.st_mode & 0o200):
+            self.attr |= ATTR_RDONLY
+        self.size = 0 if self.isdir else st.st_size
+        self.children = []
+        self.first = 0
+
+def sortkey(e):
+    return e.name.encode().lower()
+
+def createpack(fname, top, files, level):
+    """Create a pack file from files under the directory 'top'"""
+    root = PackEntry('', top, None, os.stat(top))
+
+    def scan(parent, names):
+        for n in names:
+            if n in ('.', '..'):
+                continue
+            path = os.path.join(parent.path, n)
+            e = PackEntry(n, path, parent, os.stat(path))
+            parent.children.append(e)
+            if e.isdir:
+                scan(e, os.listdir(path))
+
+    if files:
+        for f in files:
+            # add intermediate directories for 'dir/file'
+            parent = root
+            elems = [x for x in f.split('/') if x]
+            for d in elems[:-1]:
+                for c in parent.children:
+                    if c.name == d:
+                        parent = c
+                        break
+                else:
+                    c = PackEntry(d, os.path.join(parent.path, d), parent,
+                                  os.stat(os.path.join(parent.path, d)))
+                    parent.children.append(c)
+                    parent = c
+            scan(parent, elems[-1:])
+    else:
+        scan(root, os.listdir(top))
+
+    # number the entries in breadth-first order
+    entries = [root]
+    i = 0
+    while i < len(entries):
+        e = entries[i]
+        e.index = i
+        e.children.sort(key=sortkey)
+        for j in range(1, len(e.children)):
+            if sortkey(e.children[j - 1]) == sortkey(e.children[j]):
+                raise ValueError('Duplicated name: ' + e.children[j].path)
+        e.first = len(entries)
+        entries += e.children
+        i += 1
+
+    # compress the file data
+    blocks = []
+    for e in entries:
+        e.block = len(blocks)
+        if e.isdir:
+            continue
+        print(e.path)
+        with open(e.path, 'rb') as f:
+            while True:
+                data = f.read(BLOCKSIZE)
+                if not data:
+                    break
+                c = zlib.compressobj(level, zlib.DEFLATED, -15)
+                comp = c.compress(data) + c.flush()
+                blocks.append(comp if len(comp) < len(data) else data)
+
+    names = b''
+    nameofs = []
+    for e in entries:
+        nameofs.append(len(names))
+        names += e.name.encode() + b'\0'
+
+    blkofs = calcsize(HEADER) + calcsize(ENTRY) * len(entries)
+    nmofs = blkofs + calcsize(BLOCK) * len(blocks)
+    dataofs = nmofs + len(names)
+    dataofs = (dataofs + 15) & ~15
+
+    with open(fname, 'wb') as f:
+        f.write(pack(HEADER, MAGIC, VERSION, 0, BLOCKSIZE, len(entries), len(blocks), blkofs, nmofs))
+        for i, e in enumerate(entries):
+            parent = e.parent.index if e.parent else 0xffffffff
+            if e.isdir:
+                f.write(pack(ENTRY, nameofs[i], parent, e.mtime, e.first, len(e.children), e.attr))
+            else:
+                f.write(pack(ENTRY, nameofs[i], parent, e.mtime, e.size, e.block, e.attr))
+        ofs = dataofs
+        for b in blocks:
+            f.write(pack(BLOCK, ofs, len(b)))
+            ofs += len(b)
+        f.write(names)
+        f.write(bytes(dataofs - nmofs - len(names)))
+        for b in blocks:
+            f.write(b)
+
+class PackFile:
+    def __init__(self, fname):
+        with open(fname, 'rb') as f:
+            self.data = f.read()
+        (magic, ver, flags, self.blocksize, nent, nblk, blkofs, nmofs) = unpack(HEADER, self.data[:calcsize(HEADER)])
+        if magic != MAGIC or ver != VERSION:
+            raise ValueError('Not a pack file: ' + fname)
+        self.entries = []
+        for i in range(nent):
+            o = calcsize(HEADER) + calcsize(ENTRY) * i
+            (name, parent, mtime, a, b, attr) = unpack(ENTRY, self.data[o:o + calcsize(ENTRY)])
+            name = self.data[nmofs + name:self.data.index(b'\0', nmofs + name)].decode()
+            self.entries.append((name, parent, mtime, a, b, attr))
+        self.blocks = [unpack(BLOCK, self.data[blkofs + 8 * i:blkofs + 8 * i + 8]) for i in range(nblk)]
+
+    def path(self, i):
+        p = []
+        while i != 0:
+            p.insert(0, self.entries[i][0])
+            i = self.entries[i][1]
+        return '/'.join(p)
+
+    def read(self, i):
+        (name, parent, mtime, size, blk, attr) = self.entries[i]
+        out = b''
+        while len(out) < size:
+            (ofs, csize) = self.blocks[blk]
+            l = min(self.blocksize, size - len(out))
+            b = self.data[ofs:ofs + csize]
+            out += b if csize == l else zlib.decompress(b, -15)
+            blk += 1
+        return out
+
+def usage():
+    print(f'usage: {sys.argv[0]:s} t <pack file>                          : List pack contents')
+    print(f'       {sys.argv[0]:s} x <pack file>                          : Extract pack file')
+    print(f'       {sys.argv[0]:s} c [-0..-9] <pack file> <dir> [<files>...] : Create pack file')
+    sys.exit(1)
+
+if __name__ == '__main__':
+    if len(sys.argv) < 3:
+        usage()
+
+    try:
+        if sys.argv[1] == 't' or sys.argv[1] == 'list':
+            p = PackFile(sys.argv[2])
+            for i in range(1, len(p.entries)):
+                (name, parent, mtime, size, blk, attr) = p.entries[i]
+                if attr & ATTR_DIR:
+                    print(f'  <dir>   {p.path(i):s}/')
+                else:
+                    print(f'{size:-8d}  {p.path(i):s}')
+        elif sys.argv[1] == 'x' or sys.argv[1] == 'extract':
+            p = PackFile(sys.argv[2])
+            for i in range(1, len(p.entries)):
+                path = p.path(i)
+                if p.entries[i][5] & ATTR_DIR:
+                    os.makedirs(path, exist_ok=True)
+                else:
+                    print(path)
+                    with open(path, 'wb') as f:
+                        f.write(p.read(i))
+                    os.utime(path, times=(p.entries[i][2], p.entries[i][2]))
+        elif sys.argv[1] == 'c' or sys.argv[1] == 'create':
+            args = sys.argv[2:]
+            level = 9
+            if args[0][0] == '-' and args[0][1:].isdigit():
+                level = int(args[0][1:])
+                args = args[1:]
+            if len(args) < 2:
+                usage()
+            createpack(args[0], args[1], args[2:], level)
+        else:
+            usage()
+    except (OSError, ValueError) as e:
+        print(sys.argv[0] + ': error: ' + str(e))
+        sys.exit(1)
+
+    sys.exit(0)
@@ -26,7 +26,30 @@
 #define _CONFIG_H_
 
 #undef  CONFIG_ALIGNED
-#define CONFIG_NFILEINFO    1
+#define CONFIG_NFILEINFO    32      // FILES/NFILESの1回の応答の大きさ (固定長のエントリに換算した数)
 #define CONFIG_DATASIZE     1024
 
+#define CONFIG_DIRMEM_LIMIT (1024 * 1024)   // ディレクトリ検索結果のメモリ使用量上限
+#define CONFIG_DIRLIST_MAX  1024            // 保持するディレクトリ検索数の上限
+
+#define CONFIG_HOSTFD_MAX   64              // 同時に開いておくホストfd数の上限
+#define CONFIG_HOSTFD_CACHE 16              // クローズ後も開いたままにする読み込み専用ファイル数
+#define CONFIG_MMAP_MAX     (256 * 1024 * 1024) // メモリにマップするファイルサイズの上限
+#define CONFIG_READAHEAD    (16 * 1024)     // 順次読み込み時に先読みするサイズ
+#define CONFIG_WRITEBEHIND  (1024 * 1024)   // 書き込み待ちにしておくデータ量の上限
+#define CONFIG_WRITEMERGE   (64 * 1024)     // 連続した書き込みをまとめるサイズの上限
+
+#define CONFIG_STATBATCH    32              // ディレクトリ検索時にまとめて取得するファイル情報の数
+#define CONFIG_IOURING_ENTRIES 64           // io_uringのリングのエントリ数
+
+#define CONFIG_ARCBLOCK     (64 * 1024)     // 書庫内の圧縮ファイルを展開してキャッシュする単位
+#define CONFIG_ARCCACHE     (8 * 1024 * 1024) // 書庫・パックファイルの展開済みブロックのキャッシュサイズ
+
+#define CONFIG_FCACHE_SIZE  (16 * 1024 * 1024) // メモリに保持するファイル内容の合計サイズの上限
+#define CONFIG_FCACHE_FILEMAX (1024 * 1024) // 内容をメモリに保持するファイルサイズの上限
+
+#define CONFIG_LEASE        20              // ドライバがCHDIR/CHMOD/DSKFREの結果を覚えておける時間 (1/10秒単位)
+
+#define CONFIG_PIPELINE     4               // rx/worker/tx間で受け渡すフレーム数 (SPSCQ_SIZE以下)
+
 #endif /* _CONFIG_H_ */
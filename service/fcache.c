@@ -0,0 +1,338 @@
+/*
+ * Copyright (c) 2023 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+
+#include <config.h>
+#include <fileop.h>
+#include "remoteserv.h"
+#include "vfs.h"
+#include "fcache.h"
+
+//****************************************************************************
+// Global variables
+//****************************************************************************
+
+struct fcent {
+  vfs_t *vfs;
+  char *path;
+  time_t mtime;
+  long mtime_nsec;
+  ino_t ino;
+  size_t size;
+  time_t filled;              // 読み込んだ時刻
+  uint8_t *data;              // NULLならまだ読み込んでいない
+  bool pinned;                // 捨てない
+  bool stale;                 // 無効化されたがオープン中なので残している
+  int refs;                   // オープン中の数
+  struct fcent *hnext;        // ハッシュチェーン
+  struct fcent *prev;         // LRUリスト
+  struct fcent *next;
+};
+
+#define FC_NBUCKET    1024
+#define FC_NPIN       16
+#define FC_NDEFER     1024    // 読み込みを保留しているエントリ数の上限
+
+static fcent_t *fc_bucket[FC_NBUCKET];
+static fcent_t fc_lru = { .prev = &fc_lru, .next = &fc_lru };   // 先頭ほど最近使ったもの
+static size_t fc_mem = 0;
+static size_t fc_pinmem = 0;
+static int fc_ndefer = 0;
+
+static const char *fc_pattern[FC_NPIN];
+static int fc_npin = 0;
+
+// statistics
+static unsigned long fc_lookups = 0;
+static unsigned long fc_hits = 0;
+static unsigned long fc_fills = 0;
+static unsigned long fc_evicts = 0;
+static uint64_t fc_served = 0;
+
+//****************************************************************************
+// Local functions
+//****************************************************************************
+
+static unsigned fc_hash(vfs_t *v, const char *path)
+{
+  uint32_t h = 2166136261u ^ (uint32_t)(uintptr_t)v;
+  while (*path)
+    h = (h ^ (uint8_t)*path++) * 16777619u;
+  return h & (FC_NBUCKET - 1);
+}
+
+// '*'と'?'を使ったパターンに一致するか (大文字小文字は区別しない)
+static bool fc_match(const char *pat, const char *s)
+{
+  for (; *pat; pat++, s++) {
+    if (*pat == '*') {
+      for (const char *p = s; ; p++) {
+        if (fc_match(pat + 1, p))
+          return true;
+        if (*p == '\0')
+          return false;
+      }
+    }
+    if (*s == '\0' || (*pat != '?' && tolower((uint8_t)*pat) != tolower((uint8_t)*s)))
+      return false;
+  }
+  return *s == '\0';
+}
+
+static void fc_unhash(fcent_t *c)
+{
+  for (fcent_t **p = &fc_bucket[fc_hash(c->vfs, c->path)]; *p; p = &(*p)->hnext) {
+    if (*p == c) {
+      *p = c->hnext;
+      break;
+    }
+  }
+}
+
+static void fc_unlink(fcent_t *c)
+{
+  c->prev->next = c->next;
+  c->next->prev = c->prev;
+}
+
+static void fc_push(fcent_t *c)
+{
+  c->prev = &fc_lru;
+  c->next = fc_lru.next;
+  c->next->prev = c;
+  fc_lru.next = c;
+}
+
+static void fc_destroy(fcent_t *c)
+{
+  if (c->data) {
+    fc_mem -= c->size;
+    if (c->pinned)
+      fc_pinmem -= c->size;
+  } else {
+    fc_ndefer--;
+  }
+  free(c->path);
+  free(c->data);
+  free(c);
+}
+
+// エントリを無効にする (オープン中ならクローズ時に解放する)
+static void fc_drop(fcent_t *c)
+{
+  fc_unhash(c);
+  fc_unlink(c);
+  if (c->refs > 0)
+    c->stale = true;
+  else
+    fc_destroy(c);
+}
+
+// sizeバイトを追加できるように使われていないエントリを捨てる
+static bool fc_reserve(size_t size)
+{
+  fcent_t *c = fc_lru.prev;
+  while (fc_mem + size > CONFIG_FCACHE_SIZE && c != &fc_lru) {
+    fcent_t *prev = c->prev;
+    if (!c->pinned && c->refs == 0 && c->data) {
+      fc_drop(c);
+      fc_evicts++;
+    }
+    c = prev;
+  }
+  return fc_mem + size <= CONFIG_FCACHE_SIZE;
+}
+
+//****************************************************************************
+// Cache operations
+//****************************************************************************
+
+// 常に保持するファイルのパターンを追加する (ルートディレクトリからの相対パス)
+void fc_pin(const char *pattern)
+{
+  if (fc_npin < FC_NPIN)
+    fc_pattern[fc_npin++] = pattern;
+}
+
+// オープンしたファイルの内容をキャッシュから探し、なければ読み込んで登録する
+// 一度しかオープンされないファイルまで読み込まないように、最初のオープンではキーだけを
+// 登録しておき、同じ内容のまま再度オープンされたときに全体を読み込む
+// (固定するファイルは最初のオープンで読み込む。バックエンドがファイルをメモリにマップして
+// いる場合は内容を二重に持つことになるので、固定するファイル以外はキャッシュしない)
+// キャッシュできないファイルならNULLを返す
+fcent_t *fc_open(vfs_t *v, vfs_file_t *fh, const char *path, TYPE_STAT *st)
+{
+  size_t size = STAT_SIZE(st);
+  time_t mtime = STAT_MTIME(st);
+  if (size > CONFIG_FCACHE_FILEMAX)
+    return NULL;
+
+  fc_lookups++;
+  fcent_t *c;
+  for (c = fc_bucket[fc_hash(v, path)]; c; c = c->hnext) {
+    if (c->vfs == v && strcmp(c->path, path) == 0)
+      break;
+  }
+  bool same = c && c->mtime == mtime && c->mtime_nsec == STAT_MTIME_NSEC(st) &&
+              c->ino == st->st_ino && c->size == size;
+  if (c && c->data) {
+    // 更新日時が秒単位のファイルシステムでは、読み込んだ時刻と同じ秒のうちに書き換えられると
+    // 更新日時が変わらないので、その場合は内容が同じとは判断しない
+    if (same && (c->mtime_nsec != 0 || c->mtime < c->filled)) {
+      fc_hits++;
+      fc_unlink(c);
+      fc_push(c);
+      c->refs++;
+      return c;
+    }
+    fc_drop(c);               // ファイルが更新されている
+    c = NULL;
+  } else if (c && !same) {
+    fc_drop(c);               // 保留中にファイルが更新されている
+    c = NULL;
+  }
+
+  const char *rel = path + strlen(v->base);
+  rel += strspn(rel, "/");
+  bool pinned = false;
+  for (int i = 0; i < fc_npin; i++) {
+    if (fc_match(fc_pattern[i], rel)) {
+      pinned = true;
+      break;
+    }
+  }
+  if (!pinned && v->ops->mapped && v->ops->mapped(v, fh)) {
+    if (c)
+      fc_drop(c);
+    return NULL;
+  }
+
+  if (!c) {
+    c = calloc(1, sizeof(*c));
+    c->vfs = v;
+    c->path = strdup(path);
+    c->mtime = mtime;
+    c->mtime_nsec = STAT_MTIME_NSEC(st);
+    c->ino = st->st_ino;
+    c->size = size;
+    c->pinned = pinned;
+    unsigned h = fc_hash(v, path);
+    c->hnext = fc_bucket[h];
+    fc_bucket[h] = c;
+    fc_push(c);
+    fc_ndefer++;
+    if (!pinned) {
+      // 読み込みを保留しているエントリが多すぎれば古いものから捨てる
+      for (fcent_t *p = fc_lru.prev; fc_ndefer > FC_NDEFER && p != &fc_lru; ) {
+        fcent_t *prev = p->prev;
+        if (!p->data && p != c)
+          fc_drop(p);
+        p = prev;
+      }
+      DPRINTF2("FCACHE: defer %s\n", path);
+      return NULL;
+    }
+  }
+
+  if (!fc_reserve(size))
+    return NULL;
+
+  // ファイル全体を読み込む
+  uint8_t *data = malloc(size ? size : 1);
+  for (size_t pos = 0; pos < size; ) {
+    const void *p;
+    ssize_t n = v->ops->read(v, NULL, fh, data + pos, size - pos, pos, &p);
+    if (n <= 0) {
+      free(data);
+      return NULL;
+    }
+    if (p != data + pos)
+      memcpy(data + pos, p, n);
+    pos += n;
+  }
+
+  c->filled = time(NULL);
+  c->data = data;
+  c->refs = 1;
+  fc_ndefer--;
+  fc_mem += size;
+  if (pinned)
+    fc_pinmem += size;
+  fc_fills++;
+  DPRINTF2("FCACHE: fill %s (%lu bytes)%s\n", path, (unsigned long)size, pinned ? " pinned" : "");
+  return c;
+}
+
+void fc_close(fcent_t *c)
+{
+  if (--c->refs == 0 && c->stale)
+    fc_destroy(c);
+}
+
+// キャッシュした内容を返す (*dataはクローズするまで有効)
+ssize_t fc_read(fcent_t *c, void *buf, size_t count, off_t pos, const void **data)
+{
+  if (pos >= c->size) {
+    *data = buf;
+    return 0;
+  }
+  count = c->size - pos < count ? c->size - pos : count;
+  *data = c->data + pos;
+  fc_served += count;
+  return count;
+}
+
+// オープン後にファイルが変更・削除されて無効になっていればtrueを返す
+bool fc_stale(fcent_t *c)
+{
+  return c->stale;
+}
+
+// ファイルの変更・削除時にキャッシュした内容を捨てる
+void fc_invalidate(vfs_t *v, const char *path)
+{
+  for (fcent_t *c = fc_bucket[fc_hash(v, path)]; c; c = c->hnext) {
+    if (c->vfs == v && strcmp(c->path, path) == 0) {
+      fc_drop(c);
+      return;
+    }
+  }
+}
+
+void fc_stats(void)
+{
+  DPRINTF1("fcache: mem=%lu pinned=%lu limit=%lu lookups=%lu hits=%lu (%.1f%%) fills=%lu deferred=%d evicted=%lu served=%llu\n",
+           (unsigned long)fc_mem, (unsigned long)fc_pinmem, (unsigned long)CONFIG_FCACHE_SIZE,
+           fc_lookups, fc_hits, fc_lookups ? 100.0 * fc_hits / fc_lookups : 0.0,
+           fc_fills, fc_ndefer, fc_evicts, (unsigned long long)fc_served);
+}
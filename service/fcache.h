@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2023 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef _FCACHE_H_
+#define _FCACHE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <fileop.h>
+#include "vfs.h"
+
+//****************************************************************************
+// File content cache
+//****************************************************************************
+
+// 読み込み専用でオープンしたファイルの内容を(ユニット,パス名,更新日時,サイズ)をキーにして
+// メモリに保持しておき、以後のオープンではバックエンドから読まずに応答する
+// CONFIG_FCACHE_FILEMAX以下のファイルが対象で、全体のサイズがCONFIG_FCACHE_SIZEを越えたら
+// 使われていないものから捨てる
+// fc_pin()で指定したパターンに一致するファイルは一度読み込んだら捨てない
+// 内容は2回目のオープンで読み込み、ファイルをメモリにマップするバックエンドでは固定する
+// ファイルだけを対象にする
+
+typedef struct fcent fcent_t;
+
+void fc_pin(const char *pattern);
+fcent_t *fc_open(vfs_t *v, vfs_file_t *fh, const char *path, TYPE_STAT *st);
+void fc_close(fcent_t *c);
+ssize_t fc_read(fcent_t *c, void *buf, size_t count, off_t pos, const void **data);
+bool fc_stale(fcent_t *c);
+void fc_invalidate(vfs_t *v, const char *path);
+void fc_stats(void);
+
+#endif /* _FCACHE_H_ */
@@ -36,15 +36,20 @@
 #include <iconv.h>
 #include <sys/param.h>
 #include <sys/mount.h>
+#include <sys/mman.h>
 #include <libkern/OSByteOrder.h>
 #else
 #include <iconv.h>
 #include <sys/statfs.h>
+#include <sys/mman.h>
 #include <endian.h>
 #endif
 #else
 #include <windows.h>
 #endif
+#ifdef CONFIG_IOURING
+#include "uring.h"
+#endif
 
 //****************************************************************************
 // Data types
@@ -53,6 +58,13 @@
 typedef struct stat TYPE_STAT;
 #define STAT_SIZE(st)     ((st)->st_size)
 #define STAT_MTIME(st)    ((st)->st_mtime)
+#if defined(WINNT)
+#define STAT_MTIME_NSEC(st) 0     // 更新日時は秒単位
+#elif defined(__APPLE__) && defined(__MACH__)
+#define STAT_MTIME_NSEC(st) ((st)->st_mtimespec.tv_nsec)
+#else
+#define STAT_MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
+#endif
 #define STAT_ISDIR(st)    (S_ISDIR((st)->st_mode))
 
 typedef DIR *TYPE_DIR;
@@ -60,7 +72,7 @@ typedef struct dirent TYPE_DIRENT;
 typedef int TYPE_FD;
 #define FD_BADFD -1
 #define DIR_BADDIR NULL
-#define DIRENT_NAME(d)    ((d)->d_name);
+#define DIRENT_NAME(d)    ((d)->d_name)
 
 //****************************************************************************
 // for MinGW
@@ -182,10 +194,24 @@ static inline int FUNC_CHMOD(int *err, const char *path, int mode)
 
 static inline int FUNC_STAT(int *err, const char *path, TYPE_STAT *st)
 {
+#ifdef CONFIG_IOURING
+  return uring_stat(err, path, st);
+#else
   int r = stat(path, st);
   if (err)
     *err = errno;
   return r;
+#endif
+}
+// n個のファイルのstatをまとめて行う (res[]に成功なら0、失敗なら-errnoを返す)
+static inline void FUNC_STATV(const char **path, TYPE_STAT *st, int *res, int n)
+{
+#ifdef CONFIG_IOURING
+  uring_statv(path, st, res, n);
+#else
+  for (int i = 0; i < n; i++)
+    res[i] = stat(path[i], &st[i]) < 0 ? -errno : 0;
+#endif
 }
 static inline int FUNC_MKDIR(int *err, const char *path)
 {
@@ -252,31 +278,95 @@ static inline int FUNC_CLOSEDIR(int *err, TYPE_DIR dir)
 
 static inline TYPE_FD FUNC_OPEN(int *err, const char *path, int flags)
 {
+#ifdef CONFIG_IOURING
+  return uring_open(err, path, flags, 0777);
+#else
   TYPE_FD fd = open(path, flags, 0777);
   if (err)
     *err = errno;
   return fd;
+#endif
 }
 static inline int FUNC_CLOSE(int *err, TYPE_FD fd)
 {
+#ifdef CONFIG_IOURING
+  return uring_close(err, fd);
+#else
   int r = close(fd);
   if (err)
     *err = errno;
   return r;
+#endif
 }
 static inline ssize_t FUNC_READ(int *err, TYPE_FD fd, void *buf, size_t count)
 {
+#ifdef CONFIG_IOURING
+  return uring_read(err, fd, buf, count, -1);
+#else
   ssize_t r = read(fd, buf, count);
   if (err)
     *err = errno;
   return r;
+#endif
+}
+// 指定位置から読み込む (Windowsではファイルポインタが移動する)
+static inline ssize_t FUNC_PREAD(int *err, TYPE_FD fd, void *buf, size_t count, off_t offset)
+{
+#if defined(CONFIG_IOURING)
+  return uring_read(err, fd, buf, count, offset);
+#elif !defined(WINNT)
+  ssize_t r = pread(fd, buf, count, offset);
+  if (err)
+    *err = errno;
+  return r;
+#else
+  OVERLAPPED ov = { 0 };
+  DWORD n;
+  ov.Offset = (uint64_t)offset & 0xffffffff;
+  ov.OffsetHigh = (uint64_t)offset >> 32;
+  if (!ReadFile((HANDLE)_get_osfhandle(fd), buf, count, &n, &ov)) {
+    if (GetLastError() == ERROR_HANDLE_EOF)
+      return 0;
+    if (err)
+      *err = EIO;
+    return -1;
+  }
+  return n;
+#endif
 }
 static inline ssize_t FUNC_WRITE(int *err, TYPE_FD fd, const void *buf, size_t count)
 {
+#ifdef CONFIG_IOURING
+  return uring_write(err, fd, buf, count, -1);
+#else
   ssize_t r = write(fd, buf, count);
   if (err)
     *err = errno;
   return r;
+#endif
+}
+// 指定位置に書き込む (Windowsではファイルポインタが移動する)
+static inline ssize_t FUNC_PWRITE(int *err, TYPE_FD fd, const void *buf, size_t count, off_t offset)
+{
+#if defined(CONFIG_IOURING)
+  return uring_write(err, fd, buf, count, offset);
+#elif !defined(WINNT)
+  ssize_t r = pwrite(fd, buf, count, offset);
+  if (err)
+    *err = errno;
+  return r;
+#else
+  OVERLAPPED ov = { 0 };
+  DWORD n;
+  ov.Offset = (uint64_t)offset & 0xffffffff;
+  ov.OffsetHigh = (uint64_t)offset >> 32;
+  if (!WriteFile((HANDLE)_get_osfhandle(fd), buf, count, &n, &ov)) {
+    if (err)
+      *err = EIO;
+    return -1;
+  }
+  return n;
+#endif
 }
 static inline int FUNC_FTRUNCATE(int *err, TYPE_FD fd, off_t length)
 {
@@ -285,6 +375,21 @@ static inline int FUNC_FTRUNCATE(int *err, TYPE_FD fd, off_t length)
     *err = errno;
   return r;
 }
+static inline int FUNC_FSYNC(int *err, TYPE_FD fd)
+{
+#ifdef CONFIG_IOURING
+  return uring_fsync(err, fd);
+#else
+#ifndef WINNT
+  int r = fsync(fd);
+#else
+  int r = _commit(fd);
+#endif
+  if (err)
+    *err = errno;
+  return r;
+#endif
+}
 static inline off_t FUNC_LSEEK(int *err, TYPE_FD fd, off_t offset, int whence)
 {
   off_t r = lseek(fd, offset, whence);
@@ -295,10 +400,14 @@ static inline off_t FUNC_LSEEK(int *err, TYPE_FD fd, off_t offset, int whence)
 
 static inline int FUNC_FSTAT(int *err, TYPE_FD fd, TYPE_STAT *st)
 {
+#ifdef CONFIG_IOURING
+  return uring_fstat(err, fd, st);
+#else
   int r = fstat(fd, st);
   if (err)
     *err = errno;
   return r;
+#endif
 }
 
 static inline int FUNC_FILEDATE(int *err, TYPE_FD fd, uint16_t time, uint16_t date)
@@ -327,6 +436,54 @@ static inline int FUNC_FILEDATE(int *err, TYPE_FD fd, uint16_t time, uint16_t da
   return 0;
 }
 
+//****************************************************************************
+// Memory mapped file
+//****************************************************************************
+
+static inline void *FUNC_MMAP(int *err, TYPE_FD fd, size_t size)
+{
+#ifndef WINNT
+  void *p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (err)
+    *err = errno;
+  return p == MAP_FAILED ? NULL : p;
+#else
+  HANDLE hmap = CreateFileMapping((HANDLE)_get_osfhandle(fd), NULL, PAGE_READONLY, 0, 0, NULL);
+  if (hmap == NULL) {
+    if (err)
+      *err = EACCES;
+    return NULL;
+  }
+  void *p = MapViewOfFile(hmap, FILE_MAP_READ, 0, 0, size);
+  CloseHandle(hmap);      // ビューが残っている間はマッピングオブジェクトも残る
+  if (err)
+    *err = p ? 0 : EACCES;
+  return p;
+#endif
+}
+static inline int FUNC_MUNMAP(void *addr, size_t size)
+{
+#ifndef WINNT
+  return munmap(addr, size);
+#else
+  return UnmapViewOfFile(addr) ? 0 : -1;
+#endif
+}
+// マッピングのaddrからsizeバイトをメモリに読み込ませる
+static inline void FUNC_MPREFETCH(void *addr, size_t size)
+{
+#ifndef WINNT
+  // 他のプロセスがファイルを切り詰めていてもSIGBUSにならないようにページには触れない
+  uintptr_t a = (uintptr_t)addr & ~(uintptr_t)(getpagesize() - 1);
+  madvise((void *)a, size + ((uintptr_t)addr - a), MADV_WILLNEED);
+#else
+  // マップしているファイルは切り詰められないので該当ページに触れる
+  volatile uint8_t *p = addr;
+  for (size_t i = 0; i < size; i += 4096)
+    (void)p[i];
+#endif
+}
+
 //****************************************************************************
 // Misc functions
 //****************************************************************************
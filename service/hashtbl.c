@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2023 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashtbl.h"
+#include "remoteserv.h"
+
+//****************************************************************************
+// Local functions
+//****************************************************************************
+
+// キーのハッシュ値 (Fibonacci hashing)
+// FCBやFILBUFのアドレスは下位ビットが揃っているので上位ビットを使う
+static inline int ht_hash(hashtbl_t *ht, uint32_t key)
+{
+  return ((key * 2654435761u) >> 16) & (ht->nbucket - 1);
+}
+
+// バケット数を増やしてハッシュチェーンをつなぎ直す
+static void ht_rehash(hashtbl_t *ht, int nbucket)
+{
+  free(ht->bucket);
+  ht->nbucket = nbucket;
+  ht->bucket = malloc(sizeof(int) * nbucket);
+  for (int i = 0; i < nbucket; i++)
+    ht->bucket[i] = -1;
+
+  for (int i = 0; i < ht->size; i++) {
+    htnode_t *n = &ht->node[i];
+    if (n->key != 0) {
+      int h = ht_hash(ht, n->key);
+      n->next = ht->bucket[h];
+      ht->bucket[h] = i;
+    }
+  }
+}
+
+// エントリ領域をHT_SLABSIZE個分拡張してフリーリストにつなぐ
+static void ht_grow(hashtbl_t *ht)
+{
+  int nslab = ht->size / HT_SLABSIZE;
+  ht->slab = realloc(ht->slab, sizeof(uint8_t *) * (nslab + 1));
+  ht->slab[nslab] = calloc(HT_SLABSIZE, ht->entsize);
+  ht->node = realloc(ht->node, sizeof(htnode_t) * (ht->size + HT_SLABSIZE));
+  for (int i = ht->size + HT_SLABSIZE - 1; i >= ht->size; i--) {
+    ht->node[i].key = 0;
+    ht->node[i].next = ht->freelist;
+    ht->freelist = i;
+  }
+  ht->size += HT_SLABSIZE;
+}
+
+//****************************************************************************
+// Hash table operations
+//****************************************************************************
+
+void ht_init(hashtbl_t *ht, size_t entsize)
+{
+  memset(ht, 0, sizeof(*ht));
+  ht->entsize = entsize;
+  ht->freelist = -1;
+  ht_rehash(ht, HT_SLABSIZE);
+}
+
+// 全エントリを解放して初期状態に戻す (統計情報は保持する)
+void ht_clear(hashtbl_t *ht)
+{
+  for (int i = 0; i < ht->size / HT_SLABSIZE; i++)
+    free(ht->slab[i]);
+  free(ht->slab);
+  free(ht->node);
+  ht->slab = NULL;
+  ht->node = NULL;
+  ht->size = ht->used = 0;
+  ht->freelist = -1;
+  ht_rehash(ht, HT_SLABSIZE);
+}
+
+void *ht_entry(hashtbl_t *ht, int index)
+{
+  if (index < 0 || index >= ht->size || ht->node[index].key == 0)
+    return NULL;
+  return ht->slab[index / HT_SLABSIZE] + ht->entsize * (index % HT_SLABSIZE);
+}
+
+uint32_t ht_key(hashtbl_t *ht, int index)
+{
+  if (index < 0 || index >= ht->size)
+    return 0;
+  return ht->node[index].key;
+}
+
+int ht_index(hashtbl_t *ht, void *ent)
+{
+  for (int i = 0; i < ht->size / HT_SLABSIZE; i++) {
+    uint8_t *p = ent;
+    if (p >= ht->slab[i] && p < ht->slab[i] + ht->entsize * HT_SLABSIZE)
+      return i * HT_SLABSIZE + (p - ht->slab[i]) / ht->entsize;
+  }
+  return -1;
+}
+
+// キーに対応するエントリを探す
+void *ht_find(hashtbl_t *ht, uint32_t key)
+{
+  int probe = 0;
+  int i;
+
+  if (ht->nbucket == 0)
+    return NULL;
+  for (i = ht->bucket[ht_hash(ht, key)]; i >= 0; i = ht->node[i].next) {
+    probe++;
+    if (ht->node[i].key == key)
+      break;
+  }
+  ht->lookups++;
+  ht->probes += probe;
+  if (probe > ht->maxprobe)
+    ht->maxprobe = probe;
+  return i >= 0 ? ht_entry(ht, i) : NULL;
+}
+
+// キーに対応するエントリを探し、なければ新規作成する
+// 新規作成したエントリはゼロクリアされている
+void *ht_alloc(hashtbl_t *ht, uint32_t key, int *isnew)
+{
+  void *ent = ht_find(ht, key);
+  if (isnew)
+    *isnew = (ent == NULL);
+  if (ent)
+    return ent;
+
+  if (ht->freelist < 0)
+    ht_grow(ht);
+  if (ht->nbucket == 0)
+    ht_rehash(ht, HT_SLABSIZE);
+  else if (ht->used >= ht->nbucket)      // 負荷率が1を越えたらバケットを増やす
+    ht_rehash(ht, ht->nbucket * 2);
+
+  int i = ht->freelist;
+  htnode_t *n = &ht->node[i];
+  ht->freelist = n->next;
+  int h = ht_hash(ht, key);
+  n->key = key;
+  n->next = ht->bucket[h];
+  ht->bucket[h] = i;
+  ht->used++;
+
+  ent = ht_entry(ht, i);
+  memset(ent, 0, ht->entsize);
+  return ent;
+}
+
+// キーに対応するエントリをフリーリストに戻す
+void ht_free(hashtbl_t *ht, uint32_t key)
+{
+  if (ht->nbucket == 0)
+    return;
+  for (int *p = &ht->bucket[ht_hash(ht, key)]; *p >= 0; p = &ht->node[*p].next) {
+    int i = *p;
+    if (ht->node[i].key == key) {
+      *p = ht->node[i].next;
+      ht->node[i].key = 0;
+      ht->node[i].next = ht->freelist;
+      ht->freelist = i;
+      ht->used--;
+      return;
+    }
+  }
+}
+
+// テーブルの使用状況と探索長を表示する
+void ht_stats(hashtbl_t *ht, const char *name)
+{
+  int nonempty = 0;
+  int longest = 0;
+  for (int i = 0; i < ht->nbucket; i++) {
+    int len = 0;
+    for (int j = ht->bucket[i]; j >= 0; j = ht->node[j].next)
+      len++;
+    if (len > 0)
+      nonempty++;
+    if (len > longest)
+      longest = len;
+  }
+  DPRINTF1("%s: used=%d/%d buckets=%d/%d chain=%d lookups=%lu avgprobe=%.2f maxprobe=%d\n",
+           name, ht->used, ht->size, nonempty, ht->nbucket, longest,
+           ht->lookups, ht->lookups ? (double)ht->probes / ht->lookups : 0.0,
+           ht->maxprobe);
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2023 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _HASHTBL_H_
+#define _HASHTBL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+//****************************************************************************
+// Hash-indexed handle table
+//****************************************************************************
+
+// 32bitのキー(FCBやFILBUFのアドレス)からエントリをO(1)で引くためのテーブル
+// エントリはHT_SLABSIZE個単位で確保するので、一度確保したエントリのアドレスは
+// テーブルが拡張されても移動しない
+// 解放したエントリはフリーリストにつないで再利用する
+
+#define HT_SLABSIZE   32
+
+typedef struct {
+  uint32_t key;         // キー (0は未使用)
+  int next;             // ハッシュチェーンまたはフリーリストの次のエントリ番号
+} htnode_t;
+
+typedef struct {
+  size_t entsize;       // 1エントリのサイズ
+  int size;             // 確保済みエントリ数
+  int used;             // 使用中エントリ数
+  int freelist;         // 未使用エントリのリスト先頭
+  uint8_t **slab;       // エントリ格納領域
+  htnode_t *node;       // エントリ毎のキーとリンク
+  int nbucket;          // ハッシュバケット数 (2のべき乗)
+  int *bucket;          // ハッシュバケット毎のチェーン先頭
+  // statistics
+  unsigned long lookups;
+  unsigned long probes;
+  int maxprobe;
+} hashtbl_t;
+
+// 静的に定義したテーブルの初期化子 (バケットは最初のエントリ作成時に確保する)
+#define HT_INITIALIZER(type)  { .entsize = sizeof(type), .freelist = -1 }
+
+void ht_init(hashtbl_t *ht, size_t entsize);
+void ht_clear(hashtbl_t *ht);
+void *ht_find(hashtbl_t *ht, uint32_t key);
+void *ht_alloc(hashtbl_t *ht, uint32_t key, int *isnew);
+void ht_free(hashtbl_t *ht, uint32_t key);
+void *ht_entry(hashtbl_t *ht, int index);
+int ht_index(hashtbl_t *ht, void *ent);
+uint32_t ht_key(hashtbl_t *ht, int index);
+void ht_stats(hashtbl_t *ht, const char *name);
+
+#endif /* _HASHTBL_H_ */
@@ -0,0 +1,945 @@
+/*
+ * Copyright (c) 2023 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#ifndef WINNT
+#include <signal.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+#endif
+
+#include <config.h>
+#include <fileop.h>
+#include "remoteserv.h"
+#include "hostfd.h"
+
+//****************************************************************************
+// Global variables
+//****************************************************************************
+
+bool hf_writebehind = false;        // 遅延書き込みモード
+
+static hostfd_t hf_lru = { .prev = &hf_lru, .next = &hf_lru };  // 先頭ほど最近使ったもの
+static int hf_nreal = 0;            // 実fdを持っているファイル数
+static int hf_ncached = 0;          // クローズ済みで再利用待ちのファイル数
+static hostmap_t *hm_list = NULL;   // マップ中のファイル一覧
+
+// 先読みスレッドとの間で共有するデータはhf_lockで保護する
+static pthread_mutex_t hf_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_req = PTHREAD_COND_INITIALIZER;    // 先読み要求があった
+static pthread_cond_t ra_done = PTHREAD_COND_INITIALIZER;   // 先読みが終わった
+static hostfd_t *ra_head = NULL;    // 先読み要求キュー
+static hostfd_t *ra_tail = NULL;
+static bool ra_started = false;
+static pthread_cond_t wb_req = PTHREAD_COND_INITIALIZER;    // 書き込み要求があった
+static pthread_cond_t wb_done = PTHREAD_COND_INITIALIZER;   // 書き込みが終わった
+static hostfd_t *wb_head = NULL;    // 書き込み要求キュー
+static hostfd_t *wb_tail = NULL;
+static hostfd_t *wb_cur = NULL;     // 書き込みスレッドが実行中の操作のファイル
+static bool wb_started = false;
+static size_t wb_staged = 0;        // 書き込み待ちのデータ量
+
+// statistics
+static int hf_peak = 0;
+static unsigned long hf_nopen = 0;
+static unsigned long hf_nreopen = 0;
+static unsigned long hf_nevict = 0;
+static unsigned long hf_nreuse = 0;
+static int hm_nmap = 0;
+static size_t hm_mapsize = 0;
+static unsigned long hm_nshare = 0;
+static unsigned long hm_nread = 0;
+static unsigned long long hm_bytes = 0;
+static unsigned long ra_nreq = 0;
+static unsigned long ra_nhit = 0;
+static unsigned long ra_nwait = 0;
+static unsigned long long ra_bytes = 0;
+static unsigned long wb_nop = 0;
+static unsigned long wb_nmerge = 0;
+static unsigned long wb_nstall = 0;
+static unsigned long wb_nerr = 0;
+static unsigned long wb_nsync = 0;
+static size_t wb_peak = 0;
+static unsigned long long wb_bytes = 0;
+
+//****************************************************************************
+// Local functions
+//****************************************************************************
+
+static void hf_unlink(hostfd_t *hf)
+{
+  hf->prev->next = hf->next;
+  hf->next->prev = hf->prev;
+  hf->prev = hf->next = NULL;
+}
+
+// LRUリストの先頭につなぐ
+static void hf_touch(hostfd_t *hf)
+{
+  if (hf->prev)
+    hf_unlink(hf);
+  hf->prev = &hf_lru;
+  hf->next = hf_lru.next;
+  hf_lru.next->prev = hf;
+  hf_lru.next = hf;
+}
+
+static bool hf_samefile(TYPE_STAT *a, TYPE_STAT *b)
+{
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+         STAT_SIZE(a) == STAT_SIZE(b) && STAT_MTIME(a) == STAT_MTIME(b);
+}
+
+#ifndef WINNT
+// マップ後に他のプロセスがファイルを切り詰めると、サイズを確かめてから実際に読むまでの間に
+// マッピングの範囲外に触れてSIGBUSになることがある
+// マッピングからのコピーはhm_copy()で行い、コピー中の範囲で起きたSIGBUSだけをコピーの
+// 失敗として戻す (それ以外のSIGBUSは既定の動作に戻して再発生させる)
+static __thread sigjmp_buf *volatile hm_jmp = NULL;  // コピー中のスレッドの戻り先
+static __thread const uint8_t *hm_fault_start;      // コピー中のマッピングの範囲
+static __thread const uint8_t *hm_fault_end;
+
+static void hm_sigbus(int sig, siginfo_t *si, void *uc)
+{
+  const uint8_t *addr = si->si_addr;
+  if (hm_jmp && si->si_code == BUS_ADRERR &&
+      addr >= hm_fault_start && addr < hm_fault_end)
+    siglongjmp(*hm_jmp, 1);
+  signal(SIGBUS, SIG_DFL);
+}
+
+static void hm_sigbus_init(void)
+{
+  struct sigaction sa = { .sa_sigaction = hm_sigbus, .sa_flags = SA_SIGINFO };
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGBUS, &sa, NULL);
+}
+
+// マッピングからbufにコピーする (途中でSIGBUSになったらfalseを返す)
+static bool hm_copy(void *buf, const void *src, size_t len)
+{
+  sigjmp_buf jmp;
+  if (sigsetjmp(jmp, 1)) {
+    hm_jmp = NULL;
+    return false;
+  }
+  hm_fault_start = src;
+  hm_fault_end = (const uint8_t *)src + len;
+  hm_jmp = &jmp;
+  memcpy(buf, src, len);
+  hm_jmp = NULL;
+  return true;
+}
+#else
+static bool hm_copy(void *buf, const void *src, size_t len)
+{
+  memcpy(buf, src, len);
+  return true;
+}
+#endif
+
+// ファイルをマップする (同じファイルのマッピングがあれば共有する)
+static hostmap_t *hm_get(const char *path, TYPE_FD fd)
+{
+  TYPE_STAT st;
+  hostmap_t *hm;
+
+  if (FUNC_FSTAT(NULL, fd, &st) < 0 ||
+      STAT_SIZE(&st) == 0 || STAT_SIZE(&st) > CONFIG_MMAP_MAX)
+    return NULL;
+
+  for (hm = hm_list; hm; hm = hm->next) {
+    if (strcmp(hm->path, path) == 0 && hf_samefile(&hm->st, &st)) {
+      hm->refcnt++;
+      hm_nshare++;
+      return hm;
+    }
+  }
+
+#ifndef WINNT
+  static pthread_once_t sigbus_once = PTHREAD_ONCE_INIT;
+  pthread_once(&sigbus_once, hm_sigbus_init);
+#endif
+  void *addr = FUNC_MMAP(NULL, fd, STAT_SIZE(&st));
+  if (addr == NULL)
+    return NULL;
+  hm = calloc(1, sizeof(*hm));
+  hm->path = strdup(path);
+  hm->st = st;
+  hm->addr = addr;
+  hm->size = STAT_SIZE(&st);
+  hm->refcnt = 1;
+  hm->next = hm_list;
+  hm_list = hm;
+  hm_nmap++;
+  hm_mapsize += hm->size;
+  DPRINTF2("hostfd: map %s %lu bytes\n", path, (unsigned long)hm->size);
+  return hm;
+}
+
+static void hm_put(hostmap_t *hm)
+{
+  if (--hm->refcnt > 0)
+    return;
+  for (hostmap_t **p = &hm_list; *p; p = &(*p)->next) {
+    if (*p == hm) {
+      *p = hm->next;
+      break;
+    }
+  }
+  DPRINTF2("hostfd: unmap %s\n", hm->path);
+  FUNC_MUNMAP(hm->addr, hm->size);
+  hm_nmap--;
+  hm_mapsize -= hm->size;
+  free(hm->path);
+  free(hm);
+}
+
+//****************************************************************************
+// Read-ahead thread
+//****************************************************************************
+
+static void *ra_thread(void *arg)
+{
+  pthread_mutex_lock(&hf_lock);
+  while (1) {
+    while (ra_head == NULL)
+      pthread_cond_wait(&ra_req, &hf_lock);
+    hostfd_t *hf = ra_head;
+    if ((ra_head = hf->ra.next) == NULL)
+      ra_tail = NULL;
+    hf->ra.next = NULL;
+    hf->ra.state = RA_BUSY;
+
+    // 先読み中はメインスレッドがこのファイルのfdとマッピングを解放しない
+    TYPE_FD fd = hf->fd;
+    hostmap_t *hm = hf->map;
+    off_t pos = hf->ra.pos;
+    size_t len = hf->ra.len;
+    pthread_mutex_unlock(&hf_lock);
+
+    ssize_t r;
+    if (hm) {
+      // マッピングの該当ページをメモリに読み込ませる
+      len = hm->size - pos < len ? hm->size - pos : len;
+      FUNC_MPREFETCH((uint8_t *)hm->addr + pos, len);
+      r = len;
+    } else {
+      r = FUNC_PREAD(NULL, fd, hf->ra.buf, len, pos);
+    }
+
+    pthread_mutex_lock(&hf_lock);
+    hf->ra.len = r < 0 ? 0 : r;
+    hf->ra.state = RA_READY;
+#ifdef WINNT
+    hf->pos = -1;           // ファイルポインタが移動している
+#endif
+    pthread_cond_broadcast(&ra_done);
+  }
+  return NULL;
+}
+
+// 先読み要求を取り消す (先読み中なら終わるまで待つ)
+// hf_lockを取得した状態で呼ぶ
+static void ra_cancel(hostfd_t *hf)
+{
+  if (hf->ra.state == RA_QUEUED) {
+    for (hostfd_t **p = &ra_head; *p; p = &(*p)->ra.next) {
+      if (*p == hf) {
+        *p = hf->ra.next;
+        break;
+      }
+    }
+    ra_tail = NULL;
+    for (hostfd_t *h = ra_head; h; h = h->ra.next)
+      ra_tail = h;
+    hf->ra.next = NULL;
+  }
+  while (hf->ra.state == RA_BUSY) {
+    ra_nwait++;
+    pthread_cond_wait(&ra_done, &hf_lock);
+  }
+  hf->ra.state = RA_IDLE;
+}
+
+// posから先の領域の先読みを要求する
+void hf_prefetch(hostfd_t *hf, off_t pos)
+{
+  pthread_mutex_lock(&hf_lock);
+  if (hf->ra.state == RA_QUEUED || hf->ra.state == RA_BUSY ||
+      (hf->ra.state == RA_READY && pos >= hf->ra.pos &&
+       pos + CONFIG_READAHEAD / 2 < hf->ra.pos + hf->ra.len) ||    // 先読み済みのデータがまだ十分ある
+      (hf->map ? pos >= hf->map->size : hf->fd == FD_BADFD)) {
+    pthread_mutex_unlock(&hf_lock);
+    return;
+  }
+
+  if (!ra_started) {
+    pthread_t th;
+    ra_started = pthread_create(&th, NULL, ra_thread, NULL) == 0;
+    if (!ra_started) {
+      pthread_mutex_unlock(&hf_lock);
+      return;
+    }
+    pthread_detach(th);
+  }
+  if (!hf->map && hf->ra.buf == NULL &&
+      (hf->ra.buf = malloc(CONFIG_READAHEAD)) == NULL) {
+    pthread_mutex_unlock(&hf_lock);
+    return;
+  }
+
+  hf->ra.pos = pos;
+  hf->ra.len = CONFIG_READAHEAD;
+  hf->ra.state = RA_QUEUED;
+  if (ra_tail)
+    ra_tail->ra.next = hf;
+  else
+    ra_head = hf;
+  ra_tail = hf;
+  ra_nreq++;
+  pthread_cond_signal(&ra_req);
+  pthread_mutex_unlock(&hf_lock);
+}
+
+// ファイルをメモリにマップしているか
+bool hf_mapped(hostfd_t *hf)
+{
+  return hf->map != NULL;
+}
+
+//****************************************************************************
+// Write-behind thread
+//****************************************************************************
+
+static int hf_seek(int *err, hostfd_t *hf, off_t pos);
+
+static void *wb_thread(void *arg)
+{
+  pthread_mutex_lock(&hf_lock);
+  while (1) {
+    while (wb_head == NULL)
+      pthread_cond_wait(&wb_req, &hf_lock);
+    hostfd_t *hf = wb_head;
+    if ((wb_head = hf->wb.next) == NULL)
+      wb_tail = NULL;
+    hf->wb.next = NULL;
+    hf->wb.queued = false;
+    wbop_t *op = hf->wb.head;
+    if ((hf->wb.head = op->next) == NULL)
+      hf->wb.tail = NULL;
+    hf->wb.busy = true;
+    wb_cur = hf;
+    pthread_mutex_unlock(&hf_lock);
+
+    // 実行中はメインスレッドがこのファイルのfdとファイルポインタを使わない
+    int err = 0;
+    int e;
+    switch (op->type) {
+    case WB_WRITE:
+      if (hf_seek(&e, hf, op->pos) < 0) {
+        err = e;
+      } else {
+        ssize_t r = FUNC_WRITE(&e, hf->fd, op->data, op->len);
+        if (r < 0) {
+          hf->pos = -1;
+          err = e;
+        } else {
+          hf->pos += r;
+          if (r < op->len)
+            err = ENOSPC;
+        }
+      }
+      break;
+    case WB_TRUNCATE:
+      if (FUNC_FTRUNCATE(&e, hf->fd, op->pos) < 0)
+        err = e;
+      break;
+    case WB_FILEDATE:
+      if (FUNC_FILEDATE(&e, hf->fd, op->time, op->date) < 0)
+        err = e;
+      break;
+    }
+
+    pthread_mutex_lock(&hf_lock);
+    DPRINTF2("writebehind: %d %s %d %d -> %d\n",
+             op->type, hf->path, (int)op->pos, (int)op->len, err);
+    if (err) {
+      wb_nerr++;
+      if (hf->wb.err == 0)
+        hf->wb.err = err;
+    }
+    wb_staged -= op->len;
+    free(op);
+    hf->wb.busy = false;
+    wb_cur = NULL;
+    if (hf->wb.head) {
+      hf->wb.queued = true;
+      if (wb_tail)
+        wb_tail->wb.next = hf;
+      else
+        wb_head = hf;
+      wb_tail = hf;
+    }
+    pthread_cond_broadcast(&wb_done);
+  }
+  return NULL;
+}
+
+// キューに残っている操作がすべて実行されるまで待つ
+// hf_lockを取得した状態で呼ぶ
+static void wb_drain(hostfd_t *hf)
+{
+  while (hf->wb.head || hf->wb.busy)
+    pthread_cond_wait(&wb_done, &hf_lock);
+}
+
+// pathのファイルに対してexcept以外のハンドルからの遅延書き込みが残っていない状態にする
+// (同じファイルを別のハンドルで読み書きした場合にも、操作した順に反映されるようにする)
+// 書き込みを待った場合はtrueを返す
+// hf_lockを取得した状態で呼ぶ
+static bool wb_sync(const char *path, hostfd_t *except)
+{
+  bool waited = false;
+  while (wb_head || wb_cur) {
+    hostfd_t *p = wb_cur;
+    if (p == NULL || p == except || strcmp(p->path, path) != 0) {
+      for (p = wb_head; p; p = p->wb.next) {
+        if (p != except && strcmp(p->path, path) == 0)
+          break;
+      }
+    }
+    if (p == NULL)
+      break;
+    wb_nsync++;
+    wb_drain(p);
+    waited = true;
+  }
+  return waited;
+}
+
+// pathのファイルを書き換える前に、同じファイルを開いているすべてのハンドルの先読みデータを破棄する
+// hf_lockを取得した状態で呼ぶ
+static void ra_invalidate(const char *path)
+{
+  for (hostfd_t *hf = hf_lru.next; hf != &hf_lru; hf = hf->next) {
+    if (hf->ra.state != RA_IDLE && strcmp(hf->path, path) == 0)
+      ra_cancel(hf);
+  }
+}
+
+static bool wb_pending(hostfd_t *hf)
+{
+  pthread_mutex_lock(&hf_lock);
+  bool r = hf->wb.head || hf->wb.busy;
+  pthread_mutex_unlock(&hf_lock);
+  return r;
+}
+
+// 先読み・書き込みスレッドがfdを使っていないことを保証して先読みデータを破棄する
+static void hf_quiesce(hostfd_t *hf)
+{
+  pthread_mutex_lock(&hf_lock);
+  ra_cancel(hf);
+  wb_drain(hf);
+  pthread_mutex_unlock(&hf_lock);
+}
+
+//****************************************************************************
+// File descriptor management
+//****************************************************************************
+
+// ファイルのマッピングを外す (以降はreadで読み込む)
+static void hf_unmap(hostfd_t *hf)
+{
+  hf_quiesce(hf);
+  if (hf->map) {
+    hm_put(hf->map);
+    hf->map = NULL;
+  }
+}
+
+static void hf_destroy(hostfd_t *hf)
+{
+  hf_quiesce(hf);
+  free(hf->ra.buf);
+  if (hf->fd != FD_BADFD) {
+    FUNC_CLOSE(NULL, hf->fd);
+    hf_nreal--;
+  }
+  if (hf->prev)
+    hf_unlink(hf);
+  if (hf->closed)
+    hf_ncached--;
+  if (hf->map)
+    hm_put(hf->map);
+  free(hf->path);
+  free(hf);
+}
+
+// 実fdを閉じる (クローズ済みのファイルはそのまま破棄する)
+// 実fdを閉じたファイルもhf_invalidate()で見つけられるようにLRUリストには残しておく
+static void hf_release(hostfd_t *hf)
+{
+  DPRINTF2("hostfd: release %d %s\n", hf->fd, hf->path);
+  hf_nevict++;
+  if (hf->closed) {
+    hf_destroy(hf);
+    return;
+  }
+  hf_quiesce(hf);
+  FUNC_CLOSE(NULL, hf->fd);
+  hf->fd = FD_BADFD;
+  hf_nreal--;
+}
+
+// 実fdの数が上限を越えないように最近使っていないものを閉じる
+// 再利用待ちのファイルが多すぎる場合も古いものから破棄する
+static bool hf_reclaim(int limit, hostfd_t *keep)
+{
+  bool released = false;
+  for (hostfd_t *hf = hf_lru.prev; hf != &hf_lru; ) {
+    hostfd_t *prev = hf->prev;
+    if (hf != keep && hf->fd != FD_BADFD && !wb_pending(hf) &&
+        (hf_nreal > limit || (hf->closed && hf_ncached > CONFIG_HOSTFD_CACHE))) {
+      hf_release(hf);
+      released = true;
+    }
+    hf = prev;
+  }
+  return released;
+}
+
+static TYPE_FD hf_realopen(int *err, const char *path, int flags, hostfd_t *keep)
+{
+  TYPE_FD fd;
+  int e;
+  hf_reclaim(CONFIG_HOSTFD_MAX - 1, keep);
+  while ((fd = FUNC_OPEN(&e, path, flags)) == FD_BADFD) {
+    // fdが足りない場合は使っていないものを閉じてからやり直す
+    if ((e != EMFILE && e != ENFILE) || !hf_reclaim(hf_nreal - 1, keep))
+      break;
+  }
+  if (err)
+    *err = e;
+  if (fd != FD_BADFD) {
+    hf_nreal++;
+    if (hf_nreal > hf_peak)
+      hf_peak = hf_nreal;
+  }
+  return fd;
+}
+
+// ファイルの実fdを取得する (閉じていたら開き直す)
+static TYPE_FD hf_openfd(int *err, hostfd_t *hf)
+{
+  if (hf->fd == FD_BADFD) {
+    if ((hf->fd = hf_realopen(err, hf->path, hf->flags, hf)) == FD_BADFD)
+      return FD_BADFD;
+    hf->pos = 0;
+    hf_nreopen++;
+    DPRINTF2("hostfd: reopen %d %s\n", hf->fd, hf->path);
+  }
+  hf_touch(hf);
+  return hf->fd;
+}
+
+// 先読み・遅延書き込みを済ませてからファイルの実fdを取得する
+static TYPE_FD hf_getfd(int *err, hostfd_t *hf)
+{
+  hf_quiesce(hf);
+  return hf_openfd(err, hf);
+}
+
+// 実fdのファイルポインタをposに合わせる
+static int hf_seek(int *err, hostfd_t *hf, off_t pos)
+{
+  if (hf->pos != pos) {
+    if (FUNC_LSEEK(err, hf->fd, pos, SEEK_SET) < 0) {
+      hf->pos = -1;
+      return -1;
+    }
+    hf->pos = pos;
+  }
+  return 0;
+}
+
+//****************************************************************************
+// File operations
+//****************************************************************************
+
+// pathのファイルが削除・名前変更・切り詰めされる前に呼ばれ、再利用待ちの実fdと
+// マッピングを破棄する
+// (切り詰められたファイルのマッピングを読むとSIGBUSになり、Windowsでは開いたままの
+// ハンドルやビューがあると削除や名前変更ができない)
+void hf_invalidate(const char *path)
+{
+  for (hostfd_t *hf = hf_lru.next; hf != &hf_lru; ) {
+    hostfd_t *next = hf->next;
+    if (strcmp(hf->path, path) == 0) {
+      if (hf->closed)
+        hf_destroy(hf);
+      else if (hf->map)
+        hf_unmap(hf);
+    }
+    hf = next;
+  }
+}
+
+hostfd_t *hf_open(int *err, const char *path, int flags)
+{
+  hostfd_t *hf;
+  bool rdonly = (flags & (O_WRONLY|O_RDWR|O_CREAT|O_TRUNC)) == 0;
+  TYPE_STAT st;
+
+  hf_nopen++;
+  if (rdonly && FUNC_STAT(NULL, path, &st) == 0) {
+    // 同じファイルを読み込み専用でクローズしたばかりなら実fdを再利用する
+    for (hf = hf_lru.next; hf != &hf_lru; hf = hf->next) {
+      if (hf->closed && hf->flags == flags && strcmp(hf->path, path) == 0) {
+        if (!hf_samefile(&hf->st, &st)) {
+          hf_destroy(hf);         // ファイルが変更されている
+          break;
+        }
+        hf->closed = false;
+        hf_ncached--;
+        hf_touch(hf);
+        hf_nreuse++;
+        DPRINTF2("hostfd: reuse %d %s\n", hf->fd, hf->path);
+        return hf;
+      }
+    }
+  }
+
+  if (flags & (O_CREAT|O_TRUNC))
+    hf_invalidate(path);
+  TYPE_FD fd = hf_realopen(err, path, flags, NULL);
+  if (fd == FD_BADFD)
+    return NULL;
+
+  hf = calloc(1, sizeof(*hf));
+  hf->path = strdup(path);
+  hf->flags = flags & ~(O_CREAT|O_TRUNC|O_EXCL);
+  hf->fd = fd;
+  hf->pos = 0;
+  if (rdonly)
+    hf->map = hm_get(path, fd);
+  hf_touch(hf);
+  return hf;
+}
+
+int hf_close(int *err, hostfd_t *hf)
+{
+  if ((hf->flags & (O_WRONLY|O_RDWR)) == 0 && hf->fd != FD_BADFD &&
+      FUNC_FSTAT(NULL, hf->fd, &hf->st) == 0) {
+    // 読み込み専用のファイルは実fdを開いたまま再利用待ちにする
+    hf->closed = true;
+    hf_ncached++;
+    hf_reclaim(CONFIG_HOSTFD_MAX, NULL);
+    return 0;
+  }
+
+  int r = 0;
+  hf_quiesce(hf);
+  if (hf->wb.err) {
+    // 遅延書き込みで発生したエラーを返す
+    if (err)
+      *err = hf->wb.err;
+    r = -1;
+  }
+  if (hf->fd != FD_BADFD) {
+    // 遅延書き込みモードではデータがディスクに書かれてから応答する
+    if (hf_writebehind && (hf->flags & (O_WRONLY|O_RDWR)) &&
+        FUNC_FSYNC(r < 0 ? NULL : err, hf->fd) < 0)
+      r = -1;
+    if (FUNC_CLOSE(r < 0 ? NULL : err, hf->fd) < 0)
+      r = -1;
+    hf->fd = FD_BADFD;
+    hf_nreal--;
+  }
+  hf_destroy(hf);
+  return r;
+}
+
+void hf_closeall(void)
+{
+  while (hf_lru.next != &hf_lru)
+    hf_destroy(hf_lru.next);
+}
+
+// ファイルのposからcountバイトを読み込む
+// dataがNULLでなければ*dataにbufを返す (マップしている場合もマッピングからbufにコピーする
+// マッピングを直接送信すると、送信中に切り詰められた場合に読み込みエラーを返せないため)
+ssize_t hf_read(int *err, hostfd_t *hf, void *buf, size_t count, off_t pos, const void **data)
+{
+  // 遅延書き込みが残っていれば済ませる (書き込み前の先読みデータは使わない)
+  pthread_mutex_lock(&hf_lock);
+  if (wb_sync(hf->path, NULL))
+    ra_cancel(hf);
+  pthread_mutex_unlock(&hf_lock);
+
+  hostmap_t *hm = hf->map;
+  if (hm && pos < hm->size) {
+    // マップ後に他のプロセスがファイルを切り詰めていると範囲外を読んでSIGBUSになるので
+    // サイズを確かめて、小さくなっていたらマッピングを外してreadで読む
+    TYPE_STAT st;
+    if ((hf->fd != FD_BADFD ? FUNC_FSTAT(NULL, hf->fd, &st) : FUNC_STAT(NULL, hf->path, &st)) < 0 ||
+        STAT_SIZE(&st) < hm->size) {
+      hf_unmap(hf);
+      return hf_read(err, hf, buf, count, pos, data);
+    }
+    size_t len = hm->size - pos < count ? hm->size - pos : count;
+    if (data)
+      *data = buf;
+    if (!hm_copy(buf, (uint8_t *)hm->addr + pos, len)) {
+      // サイズを確かめた後に切り詰められた
+      if (err)
+        *err = EIO;
+      return -1;
+    }
+    hm_nread++;
+    hm_bytes += len;
+    if (len == count || pos + len < hm->size)
+      return len;
+    // マップ後にファイルが伸びている場合は残りをreadで読む
+    ssize_t r = hf_read(err, hf, (uint8_t *)buf + len, count - len, pos + len, NULL);
+    return r < 0 ? len : len + r;
+  }
+
+  if (data)
+    *data = buf;
+
+  // 先読み済みのデータがあればそこからコピーする
+  size_t len = 0;
+  pthread_mutex_lock(&hf_lock);
+  if (!hf->map && hf->ra.state != RA_IDLE &&
+      pos >= hf->ra.pos && pos < hf->ra.pos + CONFIG_READAHEAD) {
+    while (hf->ra.state == RA_QUEUED || hf->ra.state == RA_BUSY) {
+      ra_nwait++;
+      pthread_cond_wait(&ra_done, &hf_lock);
+    }
+    if (pos < hf->ra.pos + hf->ra.len) {
+      len = hf->ra.pos + hf->ra.len - pos;
+      len = len < count ? len : count;
+      memcpy(buf, hf->ra.buf + (pos - hf->ra.pos), len);
+      ra_nhit++;
+      ra_bytes += len;
+    }
+  }
+  pthread_mutex_unlock(&hf_lock);
+  if (len == count)
+    return len;
+  if (len > 0) {
+    ssize_t r = hf_read(err, hf, (uint8_t *)buf + len, count - len, pos + len, NULL);
+    return r < 0 ? len : len + r;
+  }
+
+  if (hf_getfd(err, hf) == FD_BADFD || hf_seek(err, hf, pos) < 0)
+    return -1;
+  ssize_t r = FUNC_READ(err, hf->fd, buf, count);
+  if (r < 0)
+    hf->pos = -1;
+  else
+    hf->pos += r;
+  return r;
+}
+
+// 同期書き込みの前に、同じファイルの遅延書き込みと先読みデータを片付ける
+static void hf_modify(hostfd_t *hf)
+{
+  pthread_mutex_lock(&hf_lock);
+  wb_sync(hf->path, NULL);
+  ra_invalidate(hf->path);
+  pthread_mutex_unlock(&hf_lock);
+}
+
+// 遅延書き込みキューに操作を追加する
+static int wb_queue(int *err, hostfd_t *hf, int type, const void *buf, size_t count, off_t pos,
+                    uint16_t time, uint16_t date)
+{
+  pthread_mutex_lock(&hf_lock);
+  ra_invalidate(hf->path);
+  if (hf->wb.err) {
+    // 以前の遅延書き込みで発生したエラーを返す
+    if (err)
+      *err = hf->wb.err;
+    hf->wb.err = 0;
+    pthread_mutex_unlock(&hf_lock);
+    return -1;
+  }
+  if (!wb_started) {
+    pthread_t th;
+    if (pthread_create(&th, NULL, wb_thread, NULL) != 0) {
+      pthread_mutex_unlock(&hf_lock);
+      hf_writebehind = false;
+      return 1;             // スレッドが作れなければ同期書き込みに戻す
+    }
+    pthread_detach(th);
+    wb_started = true;
+  }
+  pthread_mutex_unlock(&hf_lock);
+
+  // キューに操作が残っている間は実fdが閉じられないので、ここで開いておく
+  if (hf_openfd(err, hf) == FD_BADFD)
+    return -1;
+
+  pthread_mutex_lock(&hf_lock);
+  wb_sync(hf->path, hf);    // 他のハンドルからの書き込みより後に実行されるようにする
+  while (wb_staged > 0 && wb_staged + count > CONFIG_WRITEBEHIND) {
+    wb_nstall++;
+    pthread_cond_wait(&wb_done, &hf_lock);
+  }
+  wbop_t *op = hf->wb.tail;
+  if (type == WB_WRITE && op && op->type == WB_WRITE && op->pos + op->len == pos &&
+      op->len + count <= CONFIG_WRITEMERGE) {
+    // 直前の書き込みに続く位置への書き込みはまとめる
+    wbop_t **pp = &hf->wb.head;
+    while (*pp != op)
+      pp = &(*pp)->next;
+    wbop_t *nop = realloc(op, sizeof(*op) + op->len + count);
+    if (nop) {
+      *pp = hf->wb.tail = op = nop;
+      memcpy(op->data + op->len, buf, count);
+      op->len += count;
+      wb_nmerge++;
+      goto queued;
+    }
+  }
+  if ((op = malloc(sizeof(*op) + (type == WB_WRITE ? count : 0))) == NULL) {
+    pthread_mutex_unlock(&hf_lock);
+    if (err)
+      *err = ENOMEM;
+    return -1;
+  }
+  op->type = type;
+  op->pos = pos;
+  op->len = type == WB_WRITE ? count : 0;
+  op->time = time;
+  op->date = date;
+  op->next = NULL;
+  if (type == WB_WRITE)
+    memcpy(op->data, buf, count);
+  if (hf->wb.tail)
+    hf->wb.tail->next = op;
+  else
+    hf->wb.head = op;
+  hf->wb.tail = op;
+  wb_nop++;
+
+queued:
+  if (type == WB_WRITE) {
+    wb_staged += count;
+    wb_bytes += count;
+    if (wb_staged > wb_peak)
+      wb_peak = wb_staged;
+  }
+  if (!hf->wb.queued && !hf->wb.busy) {
+    hf->wb.queued = true;
+    if (wb_tail)
+      wb_tail->wb.next = hf;
+    else
+      wb_head = hf;
+    wb_tail = hf;
+    pthread_cond_signal(&wb_req);
+  }
+  pthread_mutex_unlock(&hf_lock);
+  return 0;
+}
+
+ssize_t hf_write(int *err, hostfd_t *hf, const void *buf, size_t count, off_t pos)
+{
+  if (hf_writebehind) {
+    int r = wb_queue(err, hf, WB_WRITE, buf, count, pos, 0, 0);
+    if (r <= 0)
+      return r < 0 ? -1 : count;
+  }
+  hf_modify(hf);
+  if (hf_getfd(err, hf) == FD_BADFD || hf_seek(err, hf, pos) < 0)
+    return -1;
+  ssize_t r = FUNC_WRITE(err, hf->fd, buf, count);
+  if (r < 0)
+    hf->pos = -1;
+  else
+    hf->pos += r;
+  return r;
+}
+
+int hf_ftruncate(int *err, hostfd_t *hf, off_t length)
+{
+  if (hf_writebehind) {
+    int r = wb_queue(err, hf, WB_TRUNCATE, NULL, 0, length, 0, 0);
+    if (r <= 0)
+      return r;
+  }
+  hf_modify(hf);
+  if (hf_getfd(err, hf) == FD_BADFD)
+    return -1;
+  return FUNC_FTRUNCATE(err, hf->fd, length);
+}
+
+int hf_fstat(int *err, hostfd_t *hf, TYPE_STAT *st)
+{
+  pthread_mutex_lock(&hf_lock);
+  wb_sync(hf->path, NULL);  // 他のハンドルからの書き込みを反映したサイズを返す
+  pthread_mutex_unlock(&hf_lock);
+  if (hf_getfd(err, hf) == FD_BADFD)
+    return -1;
+  return FUNC_FSTAT(err, hf->fd, st);
+}
+
+int hf_filedate(int *err, hostfd_t *hf, uint16_t time, uint16_t date)
+{
+  if (hf_writebehind) {
+    int r = wb_queue(err, hf, WB_FILEDATE, NULL, 0, 0, time, date);
+    if (r <= 0)
+      return r;
+  }
+  if (hf_getfd(err, hf) == FD_BADFD)
+    return -1;
+  return FUNC_FILEDATE(err, hf->fd, time, date);
+}
+
+//****************************************************************************
+// Statistics
+//****************************************************************************
+
+void hf_stats(void)
+{
+  DPRINTF1("hostfd: real=%d/%d peak=%d cached=%d opens=%lu reused=%lu reopened=%lu evicted=%lu\n",
+           hf_nreal, CONFIG_HOSTFD_MAX, hf_peak, hf_ncached,
+           hf_nopen, hf_nreuse, hf_nreopen, hf_nevict);
+  DPRINTF1("readahead: requests=%lu hits=%lu bytes=%llu waits=%lu\n",
+           ra_nreq, ra_nhit, ra_bytes, ra_nwait);
+  DPRINTF1("writebehind: ops=%lu merged=%lu bytes=%llu peak=%lu stalls=%lu syncs=%lu errors=%lu\n",
+           wb_nop, wb_nmerge, wb_bytes, (unsigned long)wb_peak, wb_nstall, wb_nsync, wb_nerr);
+  DPRINTF1("hostmap: maps=%d size=%lu shared=%lu reads=%lu bytes=%llu\n",
+           hm_nmap, (unsigned long)hm_mapsize, hm_nshare, hm_nread, hm_bytes);
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2023 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef _HOSTFD_H_
+#define _HOSTFD_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <fileop.h>
+
+//****************************************************************************
+// Host file descriptor virtualization
+//****************************************************************************
+
+// オープン中のファイルに実際のホストfdを割り当てるのは最近使ったCONFIG_HOSTFD_MAX個
+// までとし、それを越えたら使われていないものから実fdを閉じる
+// 実fdを閉じたファイルは次にアクセスしたときにパス名で開き直す
+// 読み込み専用でオープンしていたファイルはクローズ後もしばらく実fdを開いたままにして
+// 同じファイルが再度オープンされたら再利用する
+
+// 読み込み専用でオープンしたファイルはメモリにマップして、同じファイルを開いている
+// 他のFCBとマッピングを共有する
+// ファイルが削除・名前変更・切り詰めされるときは再利用待ちの実fdとマッピングを破棄する
+typedef struct hostmap {
+  char *path;
+  TYPE_STAT st;               // マップした時点のファイル情報
+  void *addr;
+  size_t size;
+  int refcnt;
+  struct hostmap *next;
+} hostmap_t;
+
+// 順次読み込みされているファイルは先読みスレッドで次の領域を読んでおく
+// (マップしているファイルは該当ページをメモリに読み込ませておく)
+enum { RA_IDLE, RA_QUEUED, RA_BUSY, RA_READY };
+
+typedef struct {
+  int state;
+  off_t pos;                  // 先読みした領域
+  size_t len;
+  uint8_t *buf;               // 先読みバッファ (CONFIG_READAHEADバイト)
+  struct hostfd *next;        // 先読み要求キュー
+} readahead_t;
+
+// 遅延書き込みモードでは書き込み・切り詰め・日時設定をファイル毎のキューに入れて
+// すぐに応答を返し、書き込みスレッドが順番に実行する
+// キューに操作が残っているファイルは実fdを閉じない
+enum { WB_WRITE, WB_TRUNCATE, WB_FILEDATE };
+
+typedef struct wbop {
+  int type;
+  off_t pos;                  // 書き込み位置または切り詰めるサイズ
+  size_t len;
+  uint16_t time;
+  uint16_t date;
+  struct wbop *next;
+  uint8_t data[];
+} wbop_t;
+
+typedef struct {
+  wbop_t *head;               // 未実行の操作
+  wbop_t *tail;
+  bool queued;                // 書き込みスレッドのキューに入っている
+  bool busy;                  // 書き込みスレッドが実行中
+  int err;                    // 実行時に発生したエラー (次の操作で返す)
+  struct hostfd *next;        // 書き込み要求キュー
+} writebehind_t;
+
+typedef struct hostfd {
+  char *path;                 // 再オープン用のパス名
+  int flags;                  // 再オープン用のフラグ
+  TYPE_FD fd;                 // 実fd (FD_BADFDなら閉じている)
+  off_t pos;                  // 実fdのファイルポインタ位置
+  bool closed;                // クライアントからはクローズ済み (再利用待ち)
+  TYPE_STAT st;               // 再利用時にファイルが変わっていないか確認するための情報
+  hostmap_t *map;             // ファイルのマッピング (NULLならマップしていない)
+  readahead_t ra;             // 先読み状態 (hf_lockで保護する)
+  writebehind_t wb;           // 遅延書き込み状態 (hf_lockで保護する)
+  struct hostfd *prev;        // 実fdを持つファイルのLRUリスト
+  struct hostfd *next;
+} hostfd_t;
+
+extern bool hf_writebehind;
+
+hostfd_t *hf_open(int *err, const char *path, int flags);
+int hf_close(int *err, hostfd_t *hf);
+void hf_closeall(void);
+void hf_invalidate(const char *path);
+ssize_t hf_read(int *err, hostfd_t *hf, void *buf, size_t count, off_t pos, const void **data);
+ssize_t hf_write(int *err, hostfd_t *hf, const void *buf, size_t count, off_t pos);
+int hf_ftruncate(int *err, hostfd_t *hf, off_t length);
+int hf_fstat(int *err, hostfd_t *hf, TYPE_STAT *st);
+int hf_filedate(int *err, hostfd_t *hf, uint16_t time, uint16_t date);
+void hf_prefetch(hostfd_t *hf, off_t pos);
+bool hf_mapped(hostfd_t *hf);
+void hf_stats(void);
+
+#endif /* _HOSTFD_H_ */
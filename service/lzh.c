@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) 2023 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lzh.h"
+
+//****************************************************************************
+// Local functions
+//****************************************************************************
+
+#define THRESHOLD   3           // 一致長の最小値
+#define CBIT        9
+#define TBIT        5
+
+// nビットを捨ててビットバッファに補充する
+static void fillbuf(lzh_t *d, int n)
+{
+  while (n > d->bitcount) {
+    n -= d->bitcount;
+    d->bitbuf = (d->bitbuf << d->bitcount) + (d->subbitbuf >> (8 - d->bitcount));
+    d->subbitbuf = d->srcpos < d->srclen ? d->src[d->srcpos++] : 0;
+    d->bitcount = 8;
+  }
+  d->bitcount -= n;
+  d->bitbuf = (d->bitbuf << n) + (d->subbitbuf >> (8 - n));
+  d->subbitbuf <<= n;
+}
+
+static unsigned getbits(lzh_t *d, int n)
+{
+  unsigned x = d->bitbuf >> (16 - n);
+  fillbuf(d, n);
+  return x;
+}
+
+// 符号長の表から復号テーブルを作る
+static int make_table(lzh_t *d, int nchar, uint8_t *bitlen, int tablebits, uint16_t *table)
+{
+  uint32_t count[17], weight[17], start[18];
+  int avail = nchar;
+
+  memset(count, 0, sizeof(count));
+  for (int i = 0; i < nchar; i++) {
+    if (bitlen[i] > 16)
+      return -1;
+    count[bitlen[i]]++;
+  }
+  start[1] = 0;
+  for (int i = 1; i <= 16; i++)
+    start[i + 1] = start[i] + (count[i] << (16 - i));
+  if (start[17] != (1 << 16))
+    return -1;
+
+  int jutbits = 16 - tablebits;
+  for (int i = 1; i <= tablebits; i++) {
+    start[i] >>= jutbits;
+    weight[i] = 1 << (tablebits - i);
+  }
+  for (int i = tablebits + 1; i <= 16; i++)
+    weight[i] = 1 << (16 - i);
+  for (int i = start[tablebits + 1] >> jutbits; i < (1 << tablebits); i++)
+    table[i] = 0;
+
+  uint32_t mask = 1 << (15 - tablebits);
+  for (int ch = 0; ch < nchar; ch++) {
+    int len = bitlen[ch];
+    if (len == 0)
+      continue;
+    uint32_t k = start[len];
+    uint32_t nextcode = k + weight[len];
+    if (len <= tablebits) {
+      for (uint32_t i = k; i < nextcode; i++)
+        table[i] = ch;
+    } else {
+      uint16_t *p = &table[k >> jutbits];
+      for (int i = len - tablebits; i > 0; i--) {
+        if (*p == 0) {
+          if (avail >= 2 * LZH_NC - 1)
+            return -1;
+          d->right[avail] = d->left[avail] = 0;
+          *p = avail++;
+        }
+        p = (k & mask) ? &d->right[*p] : &d->left[*p];
+        k <<= 1;
+      }
+      *p = ch;
+    }
+    start[len] = nextcode;
+  }
+  return 0;
+}
+
+static int read_pt_len(lzh_t *d, int nn, int nbit, int i_special)
+{
+  int n = getbits(d, nbit);
+  if (n == 0) {
+    int c = getbits(d, nbit);
+    memset(d->pt_len, 0, nn);
+    for (int i = 0; i < 256; i++)
+      d->pt_table[i] = c;
+    return 0;
+  }
+  if (n > nn)
+    return -1;
+  int i = 0;
+  while (i < n) {
+    int c = d->bitbuf >> (16 - 3);
+    if (c == 7) {
+      for (unsigned mask = 1 << (16 - 4); d->bitbuf & mask; mask >>= 1)
+        c++;
+    }
+    fillbuf(d, c < 7 ? 3 : c - 3);
+    d->pt_len[i++] = c;
+    if (i == i_special) {
+      c = getbits(d, 2);
+      while (--c >= 0 && i < nn)
+        d->pt_len[i++] = 0;
+    }
+  }
+  while (i < nn)
+    d->pt_len[i++] = 0;
+  return make_table(d, nn, d->pt_len, 8, d->pt_table);
+}
+
+static int read_c_len(lzh_t *d)
+{
+  int n = getbits(d, CBIT);
+  if (n == 0) {
+    int c = getbits(d, CBIT);
+    memset(d->c_len, 0, LZH_NC);
+    for (int i = 0; i < 4096; i++)
+      d->c_table[i] = c;
+    return 0;
+  }
+  if (n > LZH_NC)
+    return -1;
+  int i = 0;
+  while (i < n) {
+    int c = d->pt_table[d->bitbuf >> (16 - 8)];
+    if (c >= LZH_NT) {
+      unsigned mask = 1 << (16 - 9);
+      do {
+        c = (d->bitbuf & mask) ? d->right[c] : d->left[c];
+        mask >>= 1;
+      } while (c >= LZH_NT && mask);
+      if (c >= LZH_NT)
+        return -1;
+    }
+    fillbuf(d, d->pt_len[c]);
+    if (c <= 2) {
+      if (c == 0)
+        c = 1;
+      else if (c == 1)
+        c = getbits(d, 4) + 3;
+      else
+        c = getbits(d, CBIT) + 20;
+      while (--c >= 0 && i < LZH_NC)
+        d->c_len[i++] = 0;
+    } else {
+      d->c_len[i++] = c - 2;
+    }
+  }
+  while (i < LZH_NC)
+    d->c_len[i++] = 0;
+  return make_table(d, LZH_NC, d->c_len, 12, d->c_table);
+}
+
+static int decode_c(lzh_t *d)
+{
+  if (d->blocksize == 0) {
+    d->blocksize = getbits(d, 16);
+    if (d->blocksize == 0 ||
+        read_pt_len(d, LZH_NT, TBIT, 3) < 0 ||
+        read_c_len(d) < 0 ||
+        read_pt_len(d, d->np, d->pbit, -1) < 0)
+      return -1;
+  }
+  d->blocksize--;
+  int j = d->c_table[d->bitbuf >> 4];
+  if (j < LZH_NC) {
+    fillbuf(d, d->c_len[j]);
+  } else {
+    fillbuf(d, 12);
+    unsigned mask = 1 << (16 - 1);
+    do {
+      j = (d->bitbuf & mask) ? d->right[j] : d->left[j];
+      mask >>= 1;
+    } while (j >= LZH_NC && mask);
+    if (j >= LZH_NC)
+      return -1;
+    fillbuf(d, d->c_len[j] - 12);
+  }
+  return j;
+}
+
+static int decode_p(lzh_t *d)
+{
+  int j = d->pt_table[d->bitbuf >> (16 - 8)];
+  if (j < d->np) {
+    fillbuf(d, d->pt_len[j]);
+  } else {
+    fillbuf(d, 8);
+    unsigned mask = 1 << (16 - 1);
+    do {
+      j = (d->bitbuf & mask) ? d->right[j] : d->left[j];
+      mask >>= 1;
+    } while (j >= d->np && mask);
+    if (j >= d->np)
+      return -1;
+    fillbuf(d, d->pt_len[j] - 8);
+  }
+  if (j != 0)
+    j = (1 << (j - 1)) + getbits(d, j - 1);
+  return j;
+}
+
+//****************************************************************************
+// Decoder
+//****************************************************************************
+
+// methodは"-lh5-"などの圧縮形式名
+int lzh_init(lzh_t *d, const char *method, const void *src, size_t srclen)
+{
+  memset(d, 0, sizeof(*d));
+  switch (method[3]) {
+  case '5':
+    d->dicbit = 13;
+    break;
+  case '6':
+    d->dicbit = 15;
+    break;
+  case '7':
+    d->dicbit = 16;
+    break;
+  default:
+    return -1;
+  }
+  d->np = d->dicbit + 1;
+  d->pbit = d->dicbit <= 13 ? 4 : 5;
+  d->src = src;
+  d->srclen = srclen;
+  d->dic = calloc(1, 1 << d->dicbit);
+  if (d->dic == NULL)
+    return -1;
+  fillbuf(d, 16);
+  return 0;
+}
+
+void lzh_free(lzh_t *d)
+{
+  free(d->dic);
+  d->dic = NULL;
+}
+
+// lenバイト展開してbufに格納する (lenは展開後サイズの残りを越えないこと)
+// 展開したバイト数を返す (圧縮データが壊れていたら-1)
+ssize_t lzh_decode(lzh_t *d, void *buf, size_t len)
+{
+  uint8_t *out = buf;
+  uint32_t dicmask = (1 << d->dicbit) - 1;
+  size_t n = 0;
+
+  if (d->error)
+    return -1;
+  while (n < len) {
+    if (d->matchlen > 0) {
+      // 一致の残りを辞書からコピーする
+      while (d->matchlen > 0 && n < len) {
+        uint8_t c = d->dic[d->matchpos++ & dicmask];
+        d->dic[d->dicpos++ & dicmask] = c;
+        out[n++] = c;
+        d->matchlen--;
+      }
+      continue;
+    }
+    int c = decode_c(d);
+    if (c < 0) {
+      d->error = 1;
+      return -1;
+    }
+    if (c < 256) {
+      d->dic[d->dicpos++ & dicmask] = c;
+      out[n++] = c;
+    } else {
+      int p = decode_p(d);
+      if (p < 0) {
+        d->error = 1;
+        return -1;
+      }
+      d->matchlen = c - (256 - THRESHOLD);
+      d->matchpos = d->dicpos - p - 1;
+    }
+  }
+  return n;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2023 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef _LZH_H_
+#define _LZH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+//****************************************************************************
+// LHA (-lh5-/-lh6-/-lh7-) decoder
+//****************************************************************************
+
+// 静的ハフマン+スライド辞書形式の圧縮データを少しずつ展開する
+// 展開状態を保持しているので、続きの展開は途中から再開できる
+
+#define LZH_NC      510         // 文字・一致長の符号の種類数
+#define LZH_NT      19
+#define LZH_NPMAX   17
+
+typedef struct {
+  const uint8_t *src;           // 圧縮データ
+  size_t srclen;
+  size_t srcpos;
+  int dicbit;                   // 辞書サイズのビット数 (13/15/16)
+  int np;                       // 一致位置の符号の種類数
+  int pbit;
+
+  uint16_t bitbuf;
+  uint8_t subbitbuf;
+  int bitcount;
+  int blocksize;                // 現在のブロックの残り符号数
+
+  uint8_t *dic;                 // スライド辞書
+  uint32_t dicpos;
+  int matchlen;                 // 出力途中の一致の残り長
+  uint32_t matchpos;
+  int error;
+
+  uint8_t c_len[LZH_NC];
+  uint8_t pt_len[LZH_NPMAX > LZH_NT ? LZH_NPMAX : LZH_NT];
+  uint16_t c_table[4096];
+  uint16_t pt_table[256];
+  uint16_t left[2 * LZH_NC - 1];
+  uint16_t right[2 * LZH_NC - 1];
+} lzh_t;
+
+int lzh_init(lzh_t *d, const char *method, const void *src, size_t srclen);
+void lzh_free(lzh_t *d);
+ssize_t lzh_decode(lzh_t *d, void *buf, size_t len);
+
+#endif /* _LZH_H_ */
@@ -35,6 +35,10 @@
 #include <fileop.h>
 #include <x68kremote.h>
 #include "remoteserv.h"
+#include "hashtbl.h"
+#include "hostfd.h"
+#include "vfs.h"
+#include "fcache.h"
 
 //****************************************************************************
 // Global type and variables
@@ -48,6 +52,7 @@ typedef char hostpath_t[256];
 
 static void dl_freeall(void);
 static void fi_freeall(void);
+static void dh_reset(void);
 
 //****************************************************************************
 // Utility functions
@@ -72,7 +77,7 @@ static int conv_namebuf(int id, dos_namebuf *ns, bool full, hostpath_t *path)
   uint8_t bb[88];   // SJISでのパス名
   int k = 0;
 
-  if (rootpath[id] == NULL) { // ホストパスが割り当てられていない
+  if (vfs_root[id].ops == NULL) { // ユニットが割り当てられていない
     return -1;
   }
 
@@ -106,11 +111,12 @@ static int conv_namebuf(int id, dos_namebuf *ns, bool full, hostpath_t *path)
       ;
   }
 
+  const char *base = vfs_root[id].base;
   char *dst_buf = (char *)path;
-  strncpy(dst_buf, rootpath[id], sizeof(*path) - 1);
-  dst_buf += strlen(rootpath[id]);    //マウント先パス名を前置
+  strncpy(dst_buf, base, sizeof(*path) - 1);
+  dst_buf += strlen(base);    //マウント先パス名を前置
   // SJIS -> UTF-8に変換
-  size_t dst_len = sizeof(*path) - 1 - strlen(rootpath[id]);  //パス名バッファ残りサイズ
+  size_t dst_len = sizeof(*path) - 1 - strlen(base);  //パス名バッファ残りサイズ
   char *src_buf = bb;
   size_t src_len = k;
   if (FUNC_ICONV_S2U(&src_buf, &src_len, &dst_buf, &dst_len) < 0) {
@@ -173,6 +179,27 @@ static int conv_errno(int err)
   }
 }
 
+// ファイルの識別子を得る (ドライバ側でクローズ後もキャッシュを使い続けるために使う)
+// パス名とinode番号のハッシュ値で、conv_mtime()の値・サイズと合わせて同じ内容のファイルかを判断する
+// inode番号のないファイルシステム (MinGWなど) では同じファイルか判断できないので0を返す
+static uint32_t conv_ident(int id, const char *path, TYPE_STAT *st)
+{
+  if (st->st_ino == 0)
+    return 0;
+  uint32_t h = 2166136261u ^ id;
+  while (*path)
+    h = (h ^ (uint8_t)*path++) * 16777619u;
+  h ^= (uint32_t)st->st_ino * 2654435761u;
+  return h ? h : 1;
+}
+
+// ファイルの更新日時を識別子と組み合わせる値に変換する
+// (秒単位では同じ秒のうちに書き換えられたことがわからないのでナノ秒も混ぜる)
+static uint32_t conv_mtime(TYPE_STAT *st)
+{
+  return (uint32_t)STAT_MTIME(st) ^ ((uint32_t)STAT_MTIME_NSEC(st) * 2246822519u);
+}
+
 //****************************************************************************
 // Filesystem operations
 //****************************************************************************
@@ -182,11 +209,14 @@ int op_init(int id, uint8_t *cbuf, uint8_t *rbuf)
   struct cmd_init *cmd = (struct cmd_init *)cbuf;
   struct res_init *res = (struct res_init *)rbuf;
 
+  res->res = 0;
+  DPRINTF1("INIT:\n");
+  remote_stats();
+
   dl_freeall();
   fi_freeall();
+  dh_reset();
 
-  res->res = 0;
-  DPRINTF1("INIT:\n");
   return sizeof(*res);
 }
 
@@ -195,10 +225,12 @@ int op_init(int id, uint8_t *cbuf, uint8_t *rbuf)
 int op_chdir(int id, uint8_t *cbuf, uint8_t *rbuf)
 {
   struct cmd_dirop *cmd = (struct cmd_dirop *)cbuf;
-  struct res_dirop *res = (struct res_dirop *)rbuf;
+  struct res_chdir *res = (struct res_chdir *)rbuf;
+  vfs_t *v = &vfs_root[id];
   hostpath_t path;
 
   res->res = 0;
+  res->lease = CONFIG_LEASE;
 
   if (conv_namebuf(id, &cmd->path, false, &path) < 0) {
     res->res = _DOSE_NODIR;
@@ -206,7 +238,7 @@ int op_chdir(int id, uint8_t *cbuf, uint8_t *rbuf)
   }
 
   TYPE_STAT st;
-  int r = FUNC_STAT(NULL, path, &st);
+  int r = v->ops->stat(v, NULL, path, &st);
   if (r != 0 || !STAT_ISDIR(&st)) {
     res->res = _DOSE_NODIR;
   }
@@ -221,6 +253,7 @@ int op_mkdir(int id, uint8_t *cbuf, uint8_t *rbuf)
 {
   struct cmd_dirop *cmd = (struct cmd_dirop *)cbuf;
   struct res_dirop *res = (struct res_dirop *)rbuf;
+  vfs_t *v = &vfs_root[id];
   hostpath_t path;
 
   res->res = 0;
@@ -231,7 +264,7 @@ int op_mkdir(int id, uint8_t *cbuf, uint8_t *rbuf)
   }
 
   int err;
-  if (FUNC_MKDIR(&err, path) < 0) {
+  if (v->ops->mkdir(v, &err, path) < 0) {
     switch (err) {
     case EEXIST:
       res->res = _DOSE_EXISTDIR;
@@ -252,6 +285,7 @@ int op_rmdir(int id, uint8_t *cbuf, uint8_t *rbuf)
 {
   struct cmd_dirop *cmd = (struct cmd_dirop *)cbuf;
   struct res_dirop *res = (struct res_dirop *)rbuf;
+  vfs_t *v = &vfs_root[id];
   hostpath_t path;
 
   res->res = 0;
@@ -262,7 +296,7 @@ int op_rmdir(int id, uint8_t *cbuf, uint8_t *rbuf)
   }
 
   int err;
-  if (FUNC_RMDIR(&err, path) < 0) {
+  if (v->ops->rmdir(v, &err, path) < 0) {
     switch (err) {
     case EINVAL:
       res->res = _DOSE_ISCURDIR;
@@ -283,6 +317,7 @@ int op_rename(int id, uint8_t *cbuf, uint8_t *rbuf)
 {
   struct cmd_rename *cmd = (struct cmd_rename *)cbuf;
   struct res_rename *res = (struct res_rename *)rbuf;
+  vfs_t *v = &vfs_root[id];
   hostpath_t pathold;
   hostpath_t pathnew;
 
@@ -298,7 +333,9 @@ int op_rename(int id, uint8_t *cbuf, uint8_t *rbuf)
   }
 
   int err;
-  if (FUNC_RENAME(&err, pathold, pathnew) < 0) {
+  fc_invalidate(v, pathold);
+  fc_invalidate(v, pathnew);
+  if (v->ops->rename(v, &err, pathold, pathnew) < 0) {
     switch (err) {
     case ENOTEMPTY:
       res->res = _DOSE_CANTREN;
@@ -319,6 +356,7 @@ int op_delete(int id, uint8_t *cbuf, uint8_t *rbuf)
 {
   struct cmd_dirop *cmd = (struct cmd_dirop *)cbuf;
   struct res_dirop *res = (struct res_dirop *)rbuf;
+  vfs_t *v = &vfs_root[id];
   hostpath_t path;
 
   res->res = 0;
@@ -329,7 +367,8 @@ int op_delete(int id, uint8_t *cbuf, uint8_t *rbuf)
   }
 
   int err;
-  if (FUNC_UNLINK(&err, path) < 0) {
+  fc_invalidate(v, path);
+  if (v->ops->unlink(v, &err, path) < 0) {
     res->res = conv_errno(err);
   }
 errout:
@@ -343,10 +382,12 @@ int op_chmod(int id, uint8_t *cbuf, uint8_t *rbuf)
 {
   struct cmd_chmod *cmd = (struct cmd_chmod *)cbuf;
   struct res_chmod *res = (struct res_chmod *)rbuf;
+  vfs_t *v = &vfs_root[id];
   hostpath_t path;
   TYPE_STAT st;
 
   res->res = 0;
+  res->lease = cmd->attr == 0xff ? CONFIG_LEASE : 0;
 
   if (conv_namebuf(id, &cmd->path, true, &path) < 0) {
     res->res = _DOSE_NODIR;
@@ -354,13 +395,13 @@ int op_chmod(int id, uint8_t *cbuf, uint8_t *rbuf)
   }
 
   int err;
-  if (FUNC_STAT(&err, path, &st) < 0) {
+  if (v->ops->stat(v, &err, path, &st) < 0) {
     res->res = conv_errno(err);
   } else {
     res->res = FUNC_FILEMODE_ATTR(&st);
   }
   if (cmd->attr != 0xff) {
-    if (FUNC_CHMOD(&err, path, FUNC_ATTR_FILEMODE(cmd->attr, &st)) < 0) {
+    if (v->ops->chmod(v, &err, path, FUNC_ATTR_FILEMODE(cmd->attr, &st)) < 0) {
       res->res = conv_errno(err);
     } else {
       res->res = 0;
@@ -380,117 +421,199 @@ errout:
 
 // directory list management structure
 // Human68kから渡されるFILBUFのアドレスをキーとしてディレクトリリストを管理する
-typedef struct {
+// リストのメモリ使用量が上限を越えたら最近使われていないものから内容を追い出し、
+// 追い出されたリストにNFILESが来たら保存しておいた検索条件で再生成する
+// ドライバは受け取ったエントリを返し終える前に自分のキャッシュから追い出すことがあるので、
+// 最後に返した応答の先頭位置を覚えておき、取り直しが来たらそこから探して再開する
+typedef struct dirlist {
   uint32_t files;
   struct dos_filesinfo *dirbuf;
   int buflen;
   int bufcnt;
+  int sent;                   // 最後に返した応答の先頭位置 (これより前はドライバが返し終えている)
+  int id;                     // 検索条件 (再生成用)
+  uint8_t attr;
+  dos_namebuf path;
+  char next[23];              // 追い出した時点で次に返すファイル名
+  struct dirlist *prev;       // LRUリスト
+  struct dirlist *lnext;
 } dirlist_t;
 
-static dirlist_t *dl_store;
-static int dl_size = 0;
+static hashtbl_t dl_table = HT_INITIALIZER(dirlist_t);
+static dirlist_t dl_lru = { .prev = &dl_lru, .lnext = &dl_lru };  // 先頭ほど最近使ったもの
+static size_t dl_mem = 0;           // ファイル名リストのメモリ使用量
+static size_t dl_mempeak = 0;
+static unsigned long dl_nevict = 0;
+static unsigned long dl_nregen = 0;
+
+// LRUリストの先頭につなぐ
+static void dl_touch(dirlist_t *dl)
+{
+  if (dl->prev) {
+    dl->prev->lnext = dl->lnext;
+    dl->lnext->prev = dl->prev;
+  }
+  dl->prev = &dl_lru;
+  dl->lnext = dl_lru.lnext;
+  dl_lru.lnext->prev = dl;
+  dl_lru.lnext = dl;
+}
+
+// ファイル名リストを解放する
+static void dl_release(dirlist_t *dl)
+{
+  if (dl->dirbuf)
+    dl_mem -= sizeof(struct dos_filesinfo) * dl->buflen;
+  free(dl->dirbuf);
+  dl->dirbuf = NULL;
+  dl->buflen = 0;
+  dl->bufcnt = 0;
+  dl->sent = 0;
+}
 
 // FILBUFに対応するバッファを探す
 static dirlist_t *dl_alloc(uint32_t files, bool create)
 {
-  for (int i = 0; i < dl_size; i++) {
-    dirlist_t *dl = &dl_store[i];
-    if (dl->files == files) {
-      if (create) {         // 新規作成で同じFILBUFを見つけたらバッファを再利用
-        free(dl->dirbuf);
-        dl->dirbuf = NULL;
-        dl->buflen = 0;
-        dl->bufcnt = 0;
-      }
-      return dl;
-    }
+  dirlist_t *dl;
+  if (!create) {
+    if (dl = ht_find(&dl_table, files))
+      dl_touch(dl);
+    return dl;
   }
-  if (!create)
-    return NULL;
 
-  for (int i = 0; i < dl_size; i++) {
-    dirlist_t *dl = &dl_store[i];
-    if (dl->files == 0) {   // 新規作成で未使用のバッファを見つけた
-      dl->files = files;
-      return dl;
-    }
+  dl = ht_alloc(&dl_table, files, NULL);
+  if (dl->files == files) {   // 新規作成で同じFILBUFを見つけたらバッファを再利用
+    dl_release(dl);
   }
-  dl_size++;                // バッファが不足しているので拡張する
-  dl_store = realloc(dl_store, sizeof(dirlist_t) * dl_size);
-  dirlist_t *dl = &dl_store[dl_size - 1];
   dl->files = files;
-  dl->dirbuf = NULL;
-  dl->buflen = 0;
-  dl->bufcnt = 0;
+  dl_touch(dl);
   return dl;
 }
 
 // 不要になったバッファを解放する
 static void dl_free(uint32_t files)
 {
-  for (int i = 0; i < dl_size; i++) {
-    dirlist_t *dl = &dl_store[i];
-    if (dl->files == files) {
-      dl->files = 0;
-      free(dl->dirbuf);
-      dl->dirbuf = NULL;
-      dl->buflen = 0;
-      dl->bufcnt = 0;
-      return;
-    }
+  dirlist_t *dl = ht_find(&dl_table, files);
+  if (dl) {
+    dl_release(dl);
+    dl->prev->lnext = dl->lnext;
+    dl->lnext->prev = dl->prev;
+    ht_free(&dl_table, files);
   }
 }
 
 static void dl_freeall(void)
 {
-  for (int i = 0; i < dl_size; i++) {
-    dirlist_t *dl = &dl_store[i];
+  for (int i = 0; i < dl_table.size; i++) {
+    dirlist_t *dl = ht_entry(&dl_table, i);
+    if (dl)
+      free(dl->dirbuf);
+  }
+  ht_clear(&dl_table);
+  dl_lru.prev = dl_lru.lnext = &dl_lru;
+  dl_mem = 0;
+}
+
+// メモリ使用量が上限を越えていたら最近使われていないリストの内容を追い出す
+// (検索条件と位置は残しておく)
+// 保持している検索の数が上限を越えていたら検索自体を破棄する
+static void dl_evict(dirlist_t *cur)
+{
+  for (dirlist_t *dl = dl_lru.prev; dl != &dl_lru && dl_mem > CONFIG_DIRMEM_LIMIT; dl = dl->prev) {
+    if (dl == cur || dl->dirbuf == NULL)
+      continue;
+#ifdef CONFIG_DIRREVERSE
+    int next = dl->sent - 1;
+#else
+    int next = dl->sent;
+#endif
+    if (next >= 0 && next < dl->buflen)
+      strcpy(dl->next, dl->dirbuf[next].name);
+    else
+      dl->next[0] = '\0';        // ドライバがすべて返し終えている
+    dl_mem -= sizeof(struct dos_filesinfo) * dl->buflen;
     free(dl->dirbuf);
+    dl->dirbuf = NULL;            // buflen, bufcnt, sentはそのまま残す
+    dl_nevict++;
+    DPRINTF2("dirlist evicted: 0x%08x (%d/%d)\n", dl->files, dl->bufcnt, dl->buflen);
+  }
+  while (dl_table.used > CONFIG_DIRLIST_MAX && dl_lru.prev != cur) {
+    DPRINTF2("dirlist dropped: 0x%08x\n", dl_lru.prev->files);
+    dl_free(dl_lru.prev->files);
   }
-  free(dl_store);
-  dl_store = NULL;
-  dl_size = 0;
 }
 
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+// ファイル情報をまとめて取得して、属性が条件に合うものをファイル名リストに追加する
+static void dl_addstat(dirlist_t *dl, struct dos_filesinfo *fi, hostpath_t *path, int n)
+{
+  vfs_t *v = &vfs_root[dl->id];
+  const char *p[CONFIG_STATBATCH];
+  TYPE_STAT st[CONFIG_STATBATCH];
+  int res[CONFIG_STATBATCH];
+
+  for (int i = 0; i < n; i++)
+    p[i] = path[i];
+  if (v->ops->statv) {
+    v->ops->statv(v, p, st, res, n);
+  } else {
+    for (int i = 0; i < n; i++) {
+      int err;
+      res[i] = v->ops->stat(v, &err, p[i], &st[i]) < 0 ? -err : 0;
+    }
+  }
 
-int op_files(int id, uint8_t *cbuf, uint8_t *rbuf)
+  for (int i = 0; i < n; i++) {
+    if (res[i] < 0) {  // ファイル情報を取得できなかった
+      continue;
+    }
+    if (0xffffffffL < STAT_SIZE(&st[i])) {  //4GB以上のファイルは検索できないことにする
+      continue;
+    }
+    conv_statinfo(&st[i], &fi[i]);
+    if ((fi[i].atr & dl->attr) == 0) {  //属性がマッチしない
+      continue;
+    }
+
+    //ファイル名リストに追加する
+    dl->dirbuf = realloc(dl->dirbuf, sizeof(struct dos_filesinfo) * (dl->buflen + 1));
+    memcpy(&dl->dirbuf[dl->buflen], &fi[i], sizeof(struct dos_filesinfo));
+    dl->buflen++;
+  }
+}
+
+// 保存されている検索条件でディレクトリを検索してファイル名リストを作る
+static int dl_scan(dirlist_t *dl, hostpath_t *ppath)
 {
-  struct cmd_files *cmd = (struct cmd_files *)cbuf;
-  struct res_files *res = (struct res_files *)rbuf;
-  hostpath_t path;
-  TYPE_DIR dir;
-  TYPE_DIRENT *d;
-  dirlist_t *dl;
+  vfs_t *v = &vfs_root[dl->id];
+  char *path = *ppath;
+  vfs_dir_t *dir;
+  const char *childName;
   bool isroot;
+  struct dos_filesinfo bfi[CONFIG_STATBATCH];
+  hostpath_t bpath[CONFIG_STATBATCH];
+  int nbatch = 0;
 
-  res->res = _DOSE_NOMORE;
-#if CONFIG_NFILEINFO > 1
-  res->num = 0;
-#endif
+  dl_release(dl);
 
-  dl = dl_alloc(cmd->filep, true);
-
-  if (conv_namebuf(id, &cmd->path, false, &path) < 0) {
-    res->res = _DOSE_NODIR;
-    goto errout;
+  if (conv_namebuf(dl->id, &dl->path, false, ppath) < 0) {
+    return _DOSE_NODIR;
   }
-  isroot = strcmp(cmd->path.path, "\t") == 0;
+  isroot = strcmp(dl->path.path, "\t") == 0;
 
   // (derived from HFS.java by Makoto Kamada)
   //検索するファイル名の順序を入れ替える
   //  主ファイル名1の末尾が'?'で主ファイル名2の先頭が'\0'のときは主ファイル名2を'?'で充填する
   uint8_t w[21] = { 0 };
-  memcpy(&w[0], cmd->path.name1, 8);    //主ファイル名1
-  if (cmd->path.name1[7] == '?' && cmd->path.name2[0] == '\0') {  //主ファイル名1の末尾が'?'で主ファイル名2の先頭が'\0'
+  memcpy(&w[0], dl->path.name1, 8);    //主ファイル名1
+  if (dl->path.name1[7] == '?' && dl->path.name2[0] == '\0') {  //主ファイル名1の末尾が'?'で主ファイル名2の先頭が'\0'
     memset(&w[8], '?', 10);           //主ファイル名2
   } else {
-    memcpy(&w[8], cmd->path.name2, 10); //主ファイル名2
+    memcpy(&w[8], dl->path.name2, 10); //主ファイル名2
   }
   for (int i = 17; i >= 0 && (w[i] == '\0' || w[i] == ' '); i--) {  //主ファイル名1+主ファイル名2の空き
     w[i] = '\0';
   }
-  memcpy(&w[18], cmd->path.ext, 3);     //拡張子
+  memcpy(&w[18], dl->path.ext, 3);     //拡張子
   for (int i = 20; i >= 18 && (w[i] == ' '); i--) { //拡張子の空き
     w[i] = '\0';
   }
@@ -506,20 +629,17 @@ int op_files(int id, uint8_t *cbuf, uint8_t *rbuf)
 
   //検索するディレクトリの一覧を取得する
   int err;
-  if ((dir = FUNC_OPENDIR(&err, path)) == DIR_BADDIR) {
+  if ((dir = v->ops->opendir(v, &err, path)) == NULL) {
     switch (err) {
     case ENOENT:
-      res->res = _DOSE_NODIR;    //ディレクトリが存在しない場合に_DOSE_NOENTを返すと正常動作しない
-      break;
+      return _DOSE_NODIR;    //ディレクトリが存在しない場合に_DOSE_NOENTを返すと正常動作しない
     default:
-      res->res = conv_errno(err);
-      break;
+      return conv_errno(err);
     }
-    goto errout;
   }
 
   //ルートディレクトリかつボリューム名が必要な場合
-  if (isroot && (cmd->attr & 0x08) != 0 &&
+  if (isroot && (dl->attr & 0x08) != 0 &&
       w[0] == '?' && w[18] == '?') {    //検索するファイル名が*.*のとき
     //ボリューム名を作る
     dl->dirbuf = malloc(sizeof(struct dos_filesinfo));
@@ -537,8 +657,8 @@ int op_files(int id, uint8_t *cbuf, uint8_t *rbuf)
   }
 
   //ディレクトリの一覧から属性とファイル名の条件に合うものを選ぶ
-  while (d = FUNC_READDIR(NULL, dir)) {
-    char *childName = DIRENT_NAME(d);
+  while (childName = v->ops->readdir(v, dir)) {
+    struct dos_filesinfo *fi = &bfi[nbatch];
 
     if (isroot) {  //ルートディレクトリのとき
       if (strcmp(childName, ".") == 0 || strcmp(childName, "..") == 0) {  //.と..を除く
@@ -547,17 +667,17 @@ int op_files(int id, uint8_t *cbuf, uint8_t *rbuf)
     }
 
     // ファイル名をSJISに変換する
-    char *dst_buf = res->file[0].name;
-    size_t dst_len = sizeof(res->file[0].name) - 1;
-    char *src_buf = childName;
+    char *dst_buf = fi->name;
+    size_t dst_len = sizeof(fi->name) - 1;
+    char *src_buf = (char *)childName;
     size_t src_len = strlen(childName);
     if (FUNC_ICONV_U2S(&src_buf, &src_len, &dst_buf, &dst_len) < 0) {
       continue;
     }
     *dst_buf = '\0';
     uint8_t c;
-    for (int i = 0; i < sizeof(res->file[0].name); i++) {
-      if (!(c = res->file[0].name[i]))
+    for (int i = 0; i < sizeof(fi->name); i++) {
+      if (!(c = fi->name[i]))
         break;
       if (0x81 <= c && c <= 0x9f || 0xe0 <= c && c <= 0xef) {  //SJISの1バイト目
         i++;
@@ -574,7 +694,7 @@ int op_files(int id, uint8_t *cbuf, uint8_t *rbuf)
     }
 
     //ファイル名を分解する
-    char *b = res->file[0].name;
+    char *b = fi->name;
     int k = strlen(b);
     int m = (b[k - 1] == '.' ? k :  //name.
              k >= 3 && b[k - 2] == '.' ? k - 2 :  //name.e
@@ -610,31 +730,24 @@ int op_files(int id, uint8_t *cbuf, uint8_t *rbuf)
       }
     }
 
-    //属性、時刻、日付、ファイルサイズを取得する
-    hostpath_t fullpath;
+    //属性、時刻、日付、ファイルサイズはCONFIG_STATBATCH個ずつまとめて取得する
+    char *fullpath = bpath[nbatch];
     strcpy(fullpath, path);
     if (strcmp(fullpath, "/") != 0)
-      strncat(fullpath, "/", sizeof(fullpath) - 1);
-    strncat(fullpath, childName, sizeof(fullpath) - 1);
-    TYPE_STAT st;
-    if (FUNC_STAT(NULL, fullpath, &st) < 0) {  // ファイル情報を取得できなかった
-      continue;
+      strncat(fullpath, "/", sizeof(hostpath_t) - 1);
+    strncat(fullpath, childName, sizeof(hostpath_t) - 1);
+    if (++nbatch == CONFIG_STATBATCH) {
+      dl_addstat(dl, bfi, bpath, nbatch);
+      nbatch = 0;
     }
-    if (0xffffffffL < STAT_SIZE(&st)) {  //4GB以上のファイルは検索できないことにする
-      continue;
-    }
-    conv_statinfo(&st, &res->file[0]);
-    if ((res->file[0].atr & cmd->attr) == 0) {  //属性がマッチしない
-      continue;
-    }
-
-    //ファイル名リストに追加する
-    dl->dirbuf = realloc(dl->dirbuf, sizeof(struct dos_filesinfo) * (dl->buflen + 1));
-    memcpy(&dl->dirbuf[dl->buflen], &res->file[0], sizeof(struct dos_filesinfo));
-    dl->buflen++;
   }
+  dl_addstat(dl, bfi, bpath, nbatch);
 
-  FUNC_CLOSEDIR(NULL, dir);
+  v->ops->closedir(v, dir);
+
+  dl_mem += sizeof(struct dos_filesinfo) * dl->buflen;
+  if (dl_mem > dl_mempeak)
+    dl_mempeak = dl_mem;
 
 #ifdef CONFIG_DIRREVERSE
   dl->bufcnt = dl->buflen;
@@ -643,129 +756,228 @@ int op_files(int id, uint8_t *cbuf, uint8_t *rbuf)
   for (int i = 0; i < dl->buflen; i++) {
     DPRINTF2("%d %s\n", i, dl->dirbuf[i].name);
   }
+  return 0;
+}
 
-  //ファイル名リストの最初のエントリを返す
-#if CONFIG_NFILEINFO > 1
-  int n = sizeof(res->file) / sizeof(res->file[0]);
-  n = n > cmd->num ? cmd->num : n;
-  for (int i = 0; i < n; i++) {
+// 追い出されたファイル名リストを再生成して、追い出す前の位置から再開できるようにする
+static int dl_regen(dirlist_t *dl)
+{
+  hostpath_t path;
+  int bufcnt = dl->bufcnt;
+  int sent = dl->sent;
+  int r;
+
+  if ((r = dl_scan(dl, &path)) < 0)
+    return r;
+  dl_nregen++;
+
+  //最後に返した応答の先頭のファイルを探す (見つからなければ元の位置から続ける)
+  for (int i = 0; i < dl->buflen; i++) {
+    if (strcmp(dl->dirbuf[i].name, dl->next) == 0) {
 #ifdef CONFIG_DIRREVERSE
-    if (dl->bufcnt > 0) {
-      memcpy(&res->file[i], &dl->dirbuf[--dl->bufcnt], sizeof(res->file));
-      res->num++;
-      res->res = 0;
-    }
+      bufcnt += i + 1 - sent;
+      sent = i + 1;
 #else
-    if (dl->bufcnt < dl->buflen) {
-      memcpy(&res->file[i], &dl->dirbuf[dl->bufcnt++], sizeof(res->file));
-      res->num++;
-      res->res = 0;
-    }
+      bufcnt += i - sent;
+      sent = i;
 #endif
-      else {
       break;
     }
   }
+  dl->bufcnt = bufcnt < 0 ? 0 : bufcnt > dl->buflen ? dl->buflen : bufcnt;
+  dl->sent = sent < 0 ? 0 : sent > dl->buflen ? dl->buflen : sent;
+  DPRINTF2("dirlist regenerated: 0x%08x %s (%d/%d)\n", dl->files, path, dl->bufcnt, dl->buflen);
+  dl_evict(dl);
+  return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// ファイル名リストが空になったか
+static bool dl_empty(dirlist_t *dl)
+{
+#ifdef CONFIG_DIRREVERSE
+  return dl->bufcnt <= 0;
 #else
+  return dl->bufcnt >= dl->buflen;
+#endif
+}
+
+// ドライバが追い出した応答を取り直すときに、最後に返した応答の中からnameのエントリを
+// 探してその次から返すようにする (見つからなければ続きから返す)
+static void dl_resume(dirlist_t *dl, const char *name)
+{
 #ifdef CONFIG_DIRREVERSE
-  if (dl->bufcnt > 0) {
-    memcpy(&res->file[0], &dl->dirbuf[--dl->bufcnt], sizeof(res->file[0]));
-    res->res = 0;
+  for (int i = dl->sent - 1; i >= dl->bufcnt; i--) {
+    if (strncmp(dl->dirbuf[i].name, name, sizeof(dl->dirbuf[i].name)) == 0) {
+      dl->bufcnt = i;
+      break;
+    }
   }
 #else
-  if (dl->bufcnt < dl->buflen) {
-    memcpy(&res->file[0], &dl->dirbuf[dl->bufcnt++], sizeof(res->file[0]));
-    res->res = 0;
+  for (int i = dl->sent; i < dl->bufcnt; i++) {
+    if (strncmp(dl->dirbuf[i].name, name, sizeof(dl->dirbuf[i].name)) == 0) {
+      dl->bufcnt = i + 1;
+      break;
+    }
   }
 #endif
+  DPRINTF2("dirlist resumed: 0x%08x %s (%d/%d)\n", dl->files, name, dl->bufcnt, dl->buflen);
+}
+
+// エントリを応答の可変長形式でpに書いて次の位置を返す (endまでに入らなければNULL)
+// *time,*dateは直前のエントリの時刻と日付 (ビッグエンディアンのまま比べる)
+static uint8_t *fe_encode(uint8_t *p, uint8_t *end, struct dos_filesinfo *f,
+                          uint16_t *time, uint16_t *date)
+{
+  int len = strnlen(f->name, sizeof(f->name));
+  uint32_t size = be32toh(f->filelen);
+  uint8_t sz[5];
+  int n = 0;
+  do {
+    sz[n++] = size & 0x7f;
+    size >>= 7;
+  } while (size);
+
+  int flag = len << 2;
+  if (f->time != *time)
+    flag |= FILESENT_TIME;
+  if (f->date != *date)
+    flag |= FILESENT_DATE;
+  if (p + 2 + ((flag & FILESENT_TIME) ? 2 : 0) + ((flag & FILESENT_DATE) ? 2 : 0) + n + len > end)
+    return NULL;
+
+  *p++ = flag;
+  *p++ = f->atr;
+  if (flag & FILESENT_TIME) {
+    memcpy(p, &f->time, 2);
+    p += 2;
+    *time = f->time;
+  }
+  if (flag & FILESENT_DATE) {
+    memcpy(p, &f->date, 2);
+    p += 2;
+    *date = f->date;
+  }
+  while (n > 1)
+    *p++ = sz[--n] | 0x80;
+  *p++ = sz[0];
+  memcpy(p, f->name, len);
+  return p + len;
+}
+
+// ファイル名リストの残りのエントリからnum個(応答に入る数まで)をresに詰めて応答サイズを返す
+static int dl_fill(dirlist_t *dl, struct res_files *res, int num)
+{
+  uint8_t *p = res->data;
+  uint16_t time = 0;
+  uint16_t date = 0;
+  num = num < 1 ? 1 : num;
+  dl->sent = dl->bufcnt;
+
+  while (res->num < num && !dl_empty(dl)) {
+#ifdef CONFIG_DIRREVERSE
+    uint8_t *q = fe_encode(p, res->data + sizeof(res->data), &dl->dirbuf[dl->bufcnt - 1], &time, &date);
+#else
+    uint8_t *q = fe_encode(p, res->data + sizeof(res->data), &dl->dirbuf[dl->bufcnt], &time, &date);
+#endif
+    if (q == NULL)
+      break;
+#ifdef CONFIG_DIRREVERSE
+    dl->bufcnt--;
+#else
+    dl->bufcnt++;
 #endif
+    p = q;
+    res->num++;
+    res->res = 0;
+  }
+  res->eof = dl_empty(dl);
+  return p - (uint8_t *)res;
+}
+
+int op_files(int id, uint8_t *cbuf, uint8_t *rbuf)
+{
+  struct cmd_files *cmd = (struct cmd_files *)cbuf;
+  struct res_files *res = (struct res_files *)rbuf;
+  hostpath_t path;
+  dirlist_t *dl;
+  int rsize = offsetof(struct res_files, data);
+
+  res->res = _DOSE_NOMORE;
+  res->num = 0;
+  res->eof = 1;
+
+  dl = dl_alloc(cmd->filep, true);
+  dl->id = id;
+  dl->attr = cmd->attr;
+  memcpy(&dl->path, &cmd->path, sizeof(dl->path));
+
+  int r;
+  if ((r = dl_scan(dl, &path)) < 0) {
+    res->res = r;
+    goto errout;
+  }
+  dl_evict(dl);
+
+  //ファイル名リストの先頭からエントリを返す
+  rsize = dl_fill(dl, res, cmd->num);
 
 errout:
-#if CONFIG_NFILEINFO > 1
   DPRINTF1("FILES: 0x%08x 0x%02x %d %s -> ", cmd->filep, cmd->attr, cmd->num, path);
-#else
-  DPRINTF1("FILES: 0x%08x 0x%02x %s -> ", cmd->filep, cmd->attr, path);
-#endif
   if (res->res)
     DPRINTF1("%d\n", res->res);
   else
-    DPRINTF1("(%d/%d) %s\n", dl->bufcnt, dl->buflen, res->file[0].name);
+    DPRINTF1("(%d/%d) %d %d bytes\n", dl->bufcnt, dl->buflen, res->num, rsize);
 
-#ifdef CONFIG_DIRREVERSE
-  if (dl->bufcnt <= 0)   //ファイル名リストが空
-#else
-  if (dl->bufcnt == dl->buflen)   //ファイル名リストが空
-#endif
+  //ファイル名リストが空 (エントリを返した場合はドライバが取り直すことがあるので残しておく)
+  if (res->num == 0)
   {
     dl_free(cmd->filep);
   }
-  return sizeof(*res);
+  return rsize;
 }
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-int op_nfiles(int id, uint8_t *cbuf, uint8_t *rbuf)
+int op_nfiles(int id, uint8_t *cbuf, int csize, uint8_t *rbuf)
 {
   struct cmd_nfiles *cmd = (struct cmd_nfiles *)cbuf;
   struct res_nfiles *res = (struct res_nfiles *)rbuf;
   dirlist_t *dl;
+  int rsize = offsetof(struct res_nfiles, data);
 
   res->res = _DOSE_NOMORE;
-#if CONFIG_NFILEINFO > 1
   res->num = 0;
-#endif
+  res->eof = 1;
 
-#if CONFIG_NFILEINFO > 1
   DPRINTF1("NFILES: 0x%08x %d -> ", cmd->filep, cmd->num);
-#else
-  DPRINTF1("NFILES: 0x%08x -> ", cmd->filep);
-#endif
 
-  if (dl = dl_alloc(cmd->filep, false)) {
-#if CONFIG_NFILEINFO > 1
-    int n = sizeof(res->file) / sizeof(res->file[0]);
-    n = n > cmd->num ? cmd->num : n;
-    for (int i = 0; i < n; i++) {
-#ifdef CONFIG_DIRREVERSE
-      memcpy(&res->file[i], &dl->dirbuf[--dl->bufcnt], sizeof(res->file));
-#else
-      memcpy(&res->file[i], &dl->dirbuf[dl->bufcnt++], sizeof(res->file));
-#endif
-      res->num++;
-      res->res = 0;
-      DPRINTF1("(%d/%d) %s\n", dl->bufcnt, dl->buflen, res->file[i].name);
-#ifdef CONFIG_DIRREVERSE
-      if (dl->bufcnt <= 0)   //もう残っているファイルがない
-#else
-      if (dl->bufcnt == dl->buflen)   //もう残っているファイルがない
-#endif
-      {
-        dl_free(cmd->filep);
-        break;
-      }
-    }
-#else
-#ifdef CONFIG_DIRREVERSE
-    memcpy(&res->file[0], &dl->dirbuf[--dl->bufcnt], sizeof(res->file[0]));
-#else
-    memcpy(&res->file[0], &dl->dirbuf[dl->bufcnt++], sizeof(res->file[0]));
-#endif
-    res->res = 0;
-    DPRINTF1("(%d/%d) %s\n", dl->bufcnt, dl->buflen, res->file[0].name);
-#ifdef CONFIG_DIRREVERSE
-    if (dl->bufcnt <= 0)   //もう残っているファイルがない
-#else
-    if (dl->bufcnt == dl->buflen)   //もう残っているファイルがない
-#endif
-    {
+  if ((dl = dl_alloc(cmd->filep, false)) && dl->dirbuf == NULL) {
+    //ファイル名リストが追い出されていたら再生成する
+    if (dl_regen(dl) < 0) {
       dl_free(cmd->filep);
+      dl = NULL;
     }
-#endif
+  }
+  if (dl && csize >= sizeof(*cmd)) {
+    //ドライバが追い出した応答の取り直し
+    cmd->name[sizeof(cmd->name) - 1] = '\0';
+    dl_resume(dl, (char *)cmd->name);
+  }
+  if (dl && dl_empty(dl)) {  //もう残っているファイルがない
+    dl_free(cmd->filep);
+    dl = NULL;
+  }
+
+  if (dl) {
+    rsize = dl_fill(dl, (struct res_files *)res, cmd->num);
+    DPRINTF1("(%d/%d) %d %d bytes\n", dl->bufcnt, dl->buflen, res->num, rsize);
   } else {
     DPRINTF1("%d\n", res->res);
   }
 
-  return sizeof(*res);
+  return rsize;
 }
 
 //****************************************************************************
@@ -773,65 +985,95 @@ int op_nfiles(int id, uint8_t *cbuf, uint8_t *rbuf)
 //****************************************************************************
 
 // file descriptor management structure
-// Human68kから渡されるFCBのアドレスをキーとしてfdを管理する
+// Human68kから渡されるFCBのアドレスをキーとしてファイルを管理する
+// オープン後の操作ではエントリ番号から作ったファイルハンドルで直接エントリを引く
+// ファイルハンドルは下位FI_INDEXBITSビットがエントリ番号+1、上位ビットがオープン毎に変わる
+// 世代番号で、クローズ後に再利用されたエントリを古いハンドルで操作しないようにする
+#define FI_INDEXBITS  10
+#define FI_INDEXMASK  ((1 << FI_INDEXBITS) - 1)
+
 typedef struct {
   uint32_t fcb;
-  TYPE_FD fd;
-  off_t pos;
+  uint16_t gen;         // 世代番号
+  vfs_t *vfs;           // ファイルをオープンしたユニットのバックエンド
+  vfs_file_t *fh;
+  uint32_t rdnext;      // 前回読み込んだ位置の次 (順次読み込みの検出用)
+  fcent_t *fc;          // キャッシュしたファイル内容 (NULLならバックエンドから読む)
+  char *wpath;          // 書き込み可能でオープンしたファイルのパス名 (書き込み時にキャッシュを無効化する)
 } fdinfo_t;
 
-static fdinfo_t *fi_store;
-static int fi_size = 0;
+static hashtbl_t fi_table = HT_INITIALIZER(fdinfo_t);
+static uint16_t fi_gen;
 
 // FCBに対応するバッファを探す
 static fdinfo_t *fi_alloc(uint32_t fcb, bool alloc)
 {
-  for (int i = 0; i < fi_size; i++) {
-    if (fi_store[i].fcb == fcb) {
-      if (alloc) {              // 新規作成で同じFCBを見つけたらバッファを再利用
-        FUNC_CLOSE(NULL, fi_store[i].fd);
-        fi_store[i].fd = FD_BADFD;
-      }
-      return &fi_store[i];
-    }
-  }
+  fdinfo_t *fi;
   if (!alloc)
+    return ht_find(&fi_table, fcb);
+
+  fi = ht_alloc(&fi_table, fcb, NULL);
+  if (fi->fcb == fcb && fi->fh) { // 新規作成で同じFCBを見つけたらバッファを再利用
+    fi->vfs->ops->close(fi->vfs, NULL, fi->fh);
+    if (fi->fc)
+      fc_close(fi->fc);
+    free(fi->wpath);
+  }
+  fi->fcb = fcb;
+  fi->gen = ++fi_gen & (0xffff >> FI_INDEXBITS);
+  fi->vfs = NULL;
+  fi->fh = NULL;
+  fi->rdnext = 0;
+  fi->fc = NULL;
+  fi->wpath = NULL;
+  return fi;
+}
+
+// open/createで返したファイルハンドルに対応するバッファを返す
+// (世代番号が合わなければクローズ済みのハンドルなのでNULLを返す)
+static fdinfo_t *fi_get(uint16_t fd)
+{
+  fdinfo_t *fi = ht_entry(&fi_table, (fd & FI_INDEXMASK) - 1);
+  if (fi && fi->gen != fd >> FI_INDEXBITS)
     return NULL;
+  return fi;
+}
 
-  for (int i = 0; i < fi_size; i++) {
-    if (fi_store[i].fcb == 0) { // 新規作成で未使用のバッファを見つけた
-      fi_store[i].fcb = fcb;
-      return &fi_store[i];
-    }
-  }
-  fi_size++;                    // バッファが不足しているので拡張する
-  fi_store = realloc(fi_store, sizeof(fdinfo_t) * fi_size);
-  fi_store[fi_size - 1].fcb = fcb;
-  fi_store[fi_size - 1].fd = FD_BADFD;
-  return &fi_store[fi_size - 1];
+// バッファのファイルハンドルを返す (エントリ番号がハンドルに収まらなければFILEHANDLE_NONE)
+static uint16_t fi_handle(fdinfo_t *fi)
+{
+  int index = ht_index(&fi_table, fi) + 1;
+  if (index > FI_INDEXMASK)
+    return FILEHANDLE_NONE;
+  return (fi->gen << FI_INDEXBITS) | index;
 }
 
 // 不要になったバッファを解放する
 static void fi_free(uint32_t fcb)
 {
-  for (int i = 0; i < fi_size; i++) {
-    if (fi_store[i].fcb == fcb) {
-      fi_store[i].fcb = 0;
-      fi_store[i].fd = FD_BADFD;
-      return;
-    }
-  }
+  fdinfo_t *fi = ht_find(&fi_table, fcb);
+  if (fi)
+    free(fi->wpath);
+  ht_free(&fi_table, fcb);
 }
 
 static void fi_freeall(void)
 {
-  for (int i = 0; i < fi_size; i++) {
-    if (fi_store[i].fd != FD_BADFD)
-      FUNC_CLOSE(NULL, fi_store[i].fd);
+  for (int i = 0; i < fi_table.size; i++) {
+    fdinfo_t *fi = ht_entry(&fi_table, i);
+    if (fi && fi->fh)
+      fi->vfs->ops->close(fi->vfs, NULL, fi->fh);
+    if (fi && fi->fc)
+      fc_close(fi->fc);
+    if (fi)
+      free(fi->wpath);
+  }
+  ht_clear(&fi_table);
+  for (int i = 0; i < 8; i++) {
+    vfs_t *v = &vfs_root[i];
+    if (v->ops && v->ops->closeall)
+      v->ops->closeall(v);
   }
-  free(fi_store);
-  fi_store = NULL;
-  fi_size = 0;
 }
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -840,10 +1082,11 @@ int op_create(int id, uint8_t *cbuf, uint8_t *rbuf)
 {
   struct cmd_create *cmd = (struct cmd_create *)cbuf;
   struct res_create *res = (struct res_create *)rbuf;
+  vfs_t *v = &vfs_root[id];
   hostpath_t path;
-  TYPE_FD filefd;
+  vfs_file_t *fh;
 
-  res->res = 0;
+  memset(res, 0, sizeof(*res));
 
   if (conv_namebuf(id, &cmd->path, true, &path) < 0) {
     res->res = _DOSE_NODIR;
@@ -853,7 +1096,8 @@ int op_create(int id, uint8_t *cbuf, uint8_t *rbuf)
   int mode = O_CREAT|O_RDWR|O_TRUNC|O_BINARY;
   mode |= cmd->mode ? 0 : O_EXCL;
   int err;
-  if ((filefd = FUNC_OPEN(&err, path, mode)) == FD_BADFD) {
+  fc_invalidate(v, path);
+  if ((fh = v->ops->open(v, &err, path, mode)) == NULL) {
     switch (err) {
     case ENOSPC:
       res->res = _DOSE_DIRFULL;
@@ -864,8 +1108,20 @@ int op_create(int id, uint8_t *cbuf, uint8_t *rbuf)
     }
   } else {
     fdinfo_t *fi = fi_alloc(cmd->fcb, true);
-    fi->fd = filefd;
-    fi->pos = 0;
+    fi->vfs = v;
+    fi->fh = fh;
+    uint16_t fd = fi_handle(fi);
+    if (fd == FILEHANDLE_NONE) {
+      v->ops->close(v, NULL, fh);
+      fi_free(cmd->fcb);
+      res->res = _DOSE_MFILE;
+      goto errout;
+    }
+    res->fd = htobe16(fd);
+    fi->wpath = strdup(path);
+    TYPE_STAT st;
+    if (v->ops->fstat(v, NULL, fh, &st) == 0)
+      res->ident = htobe32(conv_ident(id, path, &st));
   }
 errout:
   DPRINTF1("CREATE: fcb=0x%08x attr=0x%02x mode=%d %s -> %d\n", cmd->fcb, cmd->attr, cmd->mode, path, res->res);
@@ -878,11 +1134,12 @@ int op_open(int id, uint8_t *cbuf, uint8_t *rbuf)
 {
   struct cmd_open *cmd = (struct cmd_open *)cbuf;
   struct res_open *res = (struct res_open *)rbuf;
+  vfs_t *v = &vfs_root[id];
   hostpath_t path;
   int mode;
-  TYPE_FD filefd;
+  vfs_file_t *fh;
 
-  res->res = 0;
+  memset(res, 0, sizeof(*res));
 
   if (conv_namebuf(id, &cmd->path, true, &path) < 0) {
     res->res = _DOSE_NODIR;
@@ -905,7 +1162,9 @@ int op_open(int id, uint8_t *cbuf, uint8_t *rbuf)
   }
 
   int err;
-  if ((filefd = FUNC_OPEN(&err, path, mode)) == FD_BADFD) {
+  if (cmd->mode != 0)
+    fc_invalidate(v, path);
+  if ((fh = v->ops->open(v, &err, path, mode)) == NULL) {
     switch (err) {
     case EINVAL:
       res->res = _DOSE_ILGARG;
@@ -916,10 +1175,27 @@ int op_open(int id, uint8_t *cbuf, uint8_t *rbuf)
     }
   } else {
     fdinfo_t *fi = fi_alloc(cmd->fcb, true);
-    fi->fd = filefd;
-    fi->pos = 0;
-    uint32_t len = FUNC_LSEEK(NULL, filefd, 0, SEEK_END);
-    FUNC_LSEEK(NULL, filefd, 0, SEEK_SET);
+    fi->vfs = v;
+    fi->fh = fh;
+    uint16_t fd = fi_handle(fi);
+    if (fd == FILEHANDLE_NONE) {
+      v->ops->close(v, NULL, fh);
+      fi_free(cmd->fcb);
+      res->res = _DOSE_MFILE;
+      goto errout;
+    }
+    res->fd = htobe16(fd);
+    if (cmd->mode != 0)
+      fi->wpath = strdup(path);
+    TYPE_STAT st;
+    uint32_t len = 0;
+    if (v->ops->fstat(v, NULL, fh, &st) == 0) {
+      len = STAT_SIZE(&st);
+      res->ident = htobe32(conv_ident(id, path, &st));
+      res->mtime = htobe32(conv_mtime(&st));
+      if (cmd->mode == 0)
+        fi->fc = fc_open(v, fh, path, &st);
+    }
     res->size = htobe32(len);
   }
 errout:
@@ -933,7 +1209,7 @@ int op_close(int id, uint8_t *cbuf, uint8_t *rbuf)
 {
   struct cmd_close *cmd = (struct cmd_close *)cbuf;
   struct res_close *res = (struct res_close *)rbuf;
-  fdinfo_t *fi = fi_alloc(cmd->fcb, false);
+  fdinfo_t *fi = fi_get(be16toh(cmd->fd));
   res->res = 0;
 
   if (!fi) {
@@ -942,94 +1218,107 @@ int op_close(int id, uint8_t *cbuf, uint8_t *rbuf)
   }
 
   int err;
-  if (FUNC_CLOSE(&err, fi->fd) < 0) {
+  if (fi->vfs->ops->close(fi->vfs, &err, fi->fh) < 0) {
     res->res = conv_errno(err);
   }
+  if (fi->fc)
+    fc_close(fi->fc);
 
+  fi_free(fi->fcb);
 errout:
-  fi_free(cmd->fcb);
-  DPRINTF1("CLOSE: fcb=0x%08x\n", cmd->fcb);
+  DPRINTF1("CLOSE: fd=%d\n", be16toh(cmd->fd));
   return sizeof(*res);
 }
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-int op_read(int id, uint8_t *cbuf, uint8_t *rbuf)
+int op_read(int id, uint8_t *cbuf, uint8_t *rbuf, rdata_t *ext)
 {
   struct cmd_read *cmd = (struct cmd_read *)cbuf;
   struct res_read *res = (struct res_read *)rbuf;
-  fdinfo_t *fi = fi_alloc(cmd->fcb, false);
+  fdinfo_t *fi = fi_get(be16toh(cmd->fd));
   uint32_t pos = be32toh(cmd->pos);
   size_t len = be16toh(cmd->len);
   ssize_t bytes = 0;
 
   if (!fi) {
-    res->len = _DOSE_BADF;
+    res->len = htobe16(_DOSE_BADF);
     goto errout;
   }
 
   int err;
-  if (fi->pos != pos) {
-    if (FUNC_LSEEK(&err, fi->fd, pos, SEEK_SET) < 0) {
-      res->len = htobe32(conv_errno(err));
-      goto errout;
-    }
+  const void *data;
+  if (fi->fc && fc_stale(fi->fc)) {
+    // オープン後に他のハンドルから書き換えられたのでバックエンドから読む
+    fc_close(fi->fc);
+    fi->fc = NULL;
   }
-  bytes = FUNC_READ(&err, fi->fd, res->data, len);
+  if (fi->fc)                 // キャッシュしたファイル内容から直接送信する
+    bytes = fc_read(fi->fc, res->data, len, pos, &data);
+  else
+    bytes = fi->vfs->ops->read(fi->vfs, &err, fi->fh, res->data, len, pos, &data);
   if (bytes < 0) {
     res->len = htobe16(conv_errno(err));
     bytes = 0;
   } else {
     res->len = htobe16(bytes);
-    fi->pos += bytes;
+    // 順次読み込みなら応答を送信している間に次の領域を先読みしておく
+    if (pos == fi->rdnext && bytes == len && !fi->fc && fi->vfs->ops->prefetch)
+      fi->vfs->ops->prefetch(fi->vfs, fi->fh, pos + bytes);
+    fi->rdnext = pos + bytes;
+    if (data != res->data) {  // キャッシュやアーカイブから直接送信する
+      ext->buf = data;
+      ext->len = bytes;
+      DPRINTF1("READ: fd=%d %d %d -> %d (direct)\n", be16toh(cmd->fd), pos, len, bytes);
+      return offsetof(struct res_read, data);
+    }
   }
 
 errout:
-  DPRINTF1("READ: fcb=0x%08x %d %d -> %d\n", cmd->fcb, pos, len, bytes);
+  DPRINTF1("READ: fd=%d %d %d -> %d\n", be16toh(cmd->fd), pos, len, bytes);
   return offsetof(struct res_read, data) + bytes;
 }
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-int op_write(int id, uint8_t *cbuf, uint8_t *rbuf)
+int op_write(int id, uint8_t *cbuf, size_t csize, uint8_t *rbuf)
 {
   struct cmd_write *cmd = (struct cmd_write *)cbuf;
   struct res_write *res = (struct res_write *)rbuf;
-  fdinfo_t *fi = fi_alloc(cmd->fcb, false);
+  fdinfo_t *fi = fi_get(be16toh(cmd->fd));
   uint32_t pos = be32toh(cmd->pos);
   size_t len = be16toh(cmd->len);
-  ssize_t bytes;
+  ssize_t bytes = 0;
 
+  if (len > sizeof(cmd->data) || offsetof(struct cmd_write, data) + len > csize) {
+    res->len = htobe16(_DOSE_ILGPARM);  // 受信したデータより長い
+    goto errout;
+  }
   if (!fi) {
-    res->len = _DOSE_BADF;
+    res->len = htobe16(_DOSE_BADF);
     goto errout;
   }
 
   int err;
+  if (fi->wpath)      // 同じファイルを読み込み専用で開いているハンドルにキャッシュを使わせない
+    fc_invalidate(fi->vfs, fi->wpath);
   if (len == 0) {     // 0バイトのwriteはファイル長を切り詰める
-    if (FUNC_FTRUNCATE(&err, fi->fd, pos) < 0) {
+    if (fi->vfs->ops->ftruncate(fi->vfs, &err, fi->fh, pos) < 0) {
       res->len = htobe16(conv_errno(err));
     } else {
       res->len = 0;
     }
   } else {
-    if (fi->pos != pos) {
-      if (FUNC_LSEEK(&err, fi->fd, pos, SEEK_SET) < 0) {
-        res->len = htobe32(conv_errno(err));
-        goto errout;
-      }
-    }
-    bytes = FUNC_WRITE(&err, fi->fd, cmd->data, len);
+    bytes = fi->vfs->ops->write(fi->vfs, &err, fi->fh, cmd->data, len, pos);
     if (bytes < 0) {
       res->len = htobe16(conv_errno(err));
     } else {
       res->len = htobe16(bytes);
-      fi->pos += bytes;
     }
   }
 
 errout:
-  DPRINTF1("WRITE: fcb=0x%08x %d %d -> %d\n", cmd->fcb, pos, len, bytes);
+  DPRINTF1("WRITE: fd=%d %d %d -> %d\n", be16toh(cmd->fd), pos, len, bytes);
   return sizeof(*res);
 }
 
@@ -1039,20 +1328,20 @@ int op_filedate(int id, uint8_t *cbuf, uint8_t *rbuf)
 {
   struct cmd_filedate *cmd = (struct cmd_filedate *)cbuf;
   struct res_filedate *res = (struct res_filedate *)rbuf;
-  fdinfo_t *fi = fi_alloc(cmd->fcb, false);
+  fdinfo_t *fi = fi_get(be16toh(cmd->fd));
 
   if (!fi) {
     res->date = 0xffff;
-    res->time = _DOSE_BADF;
+    res->time = htobe16(_DOSE_BADF);
     goto errout;
   }
 
   int err;
   if (cmd->time == 0 && cmd->date == 0) {   // 更新日時取得
     TYPE_STAT st;
-    if (FUNC_FSTAT(&err, fi->fd, &st) < 0) {
+    if (fi->vfs->ops->fstat(fi->vfs, &err, fi->fh, &st) < 0) {
       res->date = 0xffff;
-      res->time = htobe32(conv_errno(err));
+      res->time = htobe16(conv_errno(err));
     } else {
       struct dos_filesinfo fi;
       conv_statinfo(&st, &fi);
@@ -1062,9 +1351,9 @@ int op_filedate(int id, uint8_t *cbuf, uint8_t *rbuf)
   } else {                                  // 更新日時設定
     uint16_t time = be16toh(cmd->time);
     uint16_t date = be16toh(cmd->date);
-    if (FUNC_FILEDATE(&err, fi->fd, time, date) < 0) {
+    if (fi->vfs->ops->filedate(fi->vfs, &err, fi->fh, time, date) < 0) {
       res->date = 0xffff;
-      res->time = htobe32(conv_errno(err));
+      res->time = htobe16(conv_errno(err));
     } else {
       res->date = 0;
       res->time = 0;
@@ -1072,7 +1361,7 @@ int op_filedate(int id, uint8_t *cbuf, uint8_t *rbuf)
   }
 
 errout:
-  DPRINTF1("FILEDATE: fcb=0x%08x 0x%04x 0x%04x -> 0x%04x 0x%04x\n", cmd->fcb, be16toh(cmd->date), be16toh(cmd->time), be16toh(res->date), be16toh(res->time));
+  DPRINTF1("FILEDATE: fd=%d 0x%04x 0x%04x -> 0x%04x 0x%04x\n", be16toh(cmd->fd), be16toh(cmd->date), be16toh(cmd->time), be16toh(res->date), be16toh(res->time));
   return sizeof(*res);
 }
 
@@ -1084,14 +1373,15 @@ int op_dskfre(int id, uint8_t *cbuf, uint8_t *rbuf)
 {
   struct cmd_dskfre *cmd = (struct cmd_dskfre *)cbuf;
   struct res_dskfre *res = (struct res_dskfre *)rbuf;
+  vfs_t *v = &vfs_root[id];
   uint64_t total;
   uint64_t free;
 
   res->freeclu = res->totalclu = res->clusect = res->sectsize = 0;
   res->res = 0;
+  res->lease = CONFIG_LEASE;
 
-  if (rootpath[id] != NULL) {
-    FUNC_STATFS(NULL, rootpath[id], &total, &free);
+  if (v->ops != NULL && v->ops->statfs(v, NULL, &total, &free) == 0) {
     total = total > 0x7fffffff ? 0x7fffffff : total;
     free = free > 0x7fffffff ? 0x7fffffff : free;
     res->freeclu = htobe16(free / 32768);
@@ -1105,16 +1395,364 @@ int op_dskfre(int id, uint8_t *cbuf, uint8_t *rbuf)
   return sizeof(*res);
 }
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+int op_openread(int id, uint8_t *cbuf, uint8_t *rbuf, rdata_t *ext)
+{
+  struct cmd_openread *cmd = (struct cmd_openread *)cbuf;
+  struct res_openread *res = (struct res_openread *)rbuf;
+  int rsize = offsetof(struct res_openread, data);
+
+  // 先頭部分はopenと同じ形式
+  op_open(id, cbuf, rbuf);
+  res->attr = 0;
+  res->time = 0;
+  res->date = 0;
+  res->len = 0;
+  if (res->res != 0)
+    goto errout;
+
+  fdinfo_t *fi = fi_get(be16toh(res->fd));
+  TYPE_STAT st;
+  if (fi->vfs->ops->fstat(fi->vfs, NULL, fi->fh, &st) == 0) {
+    struct dos_filesinfo f;
+    conv_statinfo(&st, &f);
+    res->attr = f.atr;
+    res->time = f.time;
+    res->date = f.date;
+  }
+
+  // ドライバのキャッシュにある内容と同じならデータは送らない
+  if (res->ident && cmd->ident == res->ident && cmd->mtime == res->mtime && cmd->size == res->size) {
+    DPRINTF1("OPENREAD: fcb=0x%08x cached\n", cmd->fcb);
+    goto errout;
+  }
+
+  // 応答のlen以降はreadと同じ形式
+  struct cmd_read rcmd = {
+    .command = cmd->command, .fd = res->fd, .pos = 0, .len = cmd->len
+  };
+  rsize = offsetof(struct res_openread, len) + op_read(id, (uint8_t *)&rcmd, (uint8_t *)&res->len, ext);
+errout:
+  return rsize;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+int op_createwrite(int id, uint8_t *cbuf, size_t csize, uint8_t *rbuf)
+{
+  struct cmd_createwrite *cmd = (struct cmd_createwrite *)cbuf;
+  struct res_createwrite *res = (struct res_createwrite *)rbuf;
+  size_t len = be16toh(cmd->len);
+
+  res->len = 0;
+  if (len > sizeof(cmd->data) || offsetof(struct cmd_createwrite, data) + len > csize) {
+    // 受信したデータより長いのでファイルを作らずにエラーを返す
+    DPRINTF1("CREATEWRITE: invalid length %d (frame %d)\n", len, csize);
+    res->res = _DOSE_ILGPARM;
+    res->ident = 0;
+    res->fd = 0;
+    return sizeof(*res);
+  }
+
+  // 先頭部分はcreateと同じ形式
+  op_create(id, cbuf, rbuf);
+  res->len = 0;
+  if (res->res == 0 && len > 0) {
+    struct cmd_write wcmd = {
+      .command = cmd->command, .fd = res->fd, .pos = 0, .len = cmd->len
+    };
+    memcpy(wcmd.data, cmd->data, len);
+    op_write(id, (uint8_t *)&wcmd, sizeof(wcmd), (uint8_t *)&res->len);
+  }
+  return sizeof(*res);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+int op_compound(uint8_t *cbuf, size_t csize, uint8_t *rbuf, rdata_t *ext)
+{
+  struct cmd_compound *cmd = (struct cmd_compound *)cbuf;
+  uint8_t *end = cbuf + csize;
+  uint8_t *p = cmd->data;
+  uint8_t head[COMPOUND_MAX];
+  int n = cmd->count;
+  int rsize = -1;
+
+  if (csize < offsetof(struct cmd_compound, data) || n == 0 || n > COMPOUND_MAX) {
+    DPRINTF1("COMPOUND: invalid count %d\n", n);
+    rbuf[0] = (uint8_t)_DOSE_ILGPARM;
+    return 1;
+  }
+
+  // 実行する前に、全てのコマンドが受信したフレームに収まっていることを確かめる
+  for (int i = 0; i < n; i++) {
+    if (p + 2 > end)
+      goto errout;
+    size_t len = (p[0] << 8) | p[1];
+    p += 2;
+    if (len == 0 || p + len > end || ((p[0] & 0x1f) | 0x40) == 0x5b)
+      goto errout;
+    p += len;
+  }
+
+  DPRINTF2("COMPOUND: %d commands\n", n);
+  p = cmd->data;
+  for (int i = 0; i < n; i++) {
+    size_t len = (p[0] << 8) | p[1];
+    p += 2;
+    // 応答はrbufの先頭に書かせ、最後以外は先頭1バイトの結果だけを残す
+    rsize = remote_serv(p, len, rbuf, ext);
+    if (i < n - 1)
+      head[i] = rsize > 0 ? rbuf[0] : (uint8_t)-1;
+    p += len;
+  }
+  if (rsize < 0)
+    return rsize;
+  if (n - 1 + rsize + ext->len > sizeof(struct res_compound)) {
+    // ドライバが受け取れる大きさを越えた (ドライバはこのようなコマンドをまとめない)
+    DPRINTF1("COMPOUND: response too large %d\n", rsize);
+    ext->buf = NULL;
+    ext->len = 0;
+    goto errout;
+  }
+  // i番目の応答をrbuf+iに置く
+  memmove(rbuf + n - 1, rbuf, rsize);
+  memcpy(rbuf, head, n - 1);
+  return n - 1 + rsize;
+
+errout:
+  DPRINTF1("COMPOUND: invalid frame\n");
+  memset(rbuf, (uint8_t)_DOSE_ILGPARM, n);
+  return n;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// サーバが割り当てたディレクトリハンドル (ユニット毎)
+// 直接指定されたディレクトリは空きか最も長く使われていないハンドルに登録し、
+// 割り当てたハンドル番号を応答でドライバに知らせる
+static struct {
+  bool valid;
+  uint8_t len;
+  uint8_t path[65];
+  uint32_t lru;
+} dh_table[8][DIRHANDLE_MAX];
+static uint32_t dh_clock;
+
+static void dh_reset(void)
+{
+  memset(dh_table, 0, sizeof(dh_table));
+}
+
+// pathを登録してハンドル番号を返す (登録済みならそのハンドルを返す)
+static int dh_register(int id, const uint8_t *path, int len)
+{
+  int h = -1;
+  for (int i = 0; i < DIRHANDLE_MAX; i++) {
+    if (dh_table[id][i].valid && dh_table[id][i].len == len &&
+        memcmp(dh_table[id][i].path, path, len) == 0) {
+      h = i;
+      break;
+    }
+  }
+  if (h < 0) {
+    for (int i = 0; i < DIRHANDLE_MAX; i++) {
+      if (!dh_table[id][i].valid) {
+        h = i;
+        break;
+      }
+      if (h < 0 || (int32_t)(dh_table[id][i].lru - dh_table[id][h].lru) < 0)
+        h = i;
+    }
+    dh_table[id][h].valid = true;
+    dh_table[id][h].len = len;
+    memcpy(dh_table[id][h].path, path, len);
+  }
+  dh_table[id][h].lru = ++dh_clock;
+  return h;
+}
+
+// 符号化したパス名をnsに展開して次の位置を返す (endを越える場合や不正な値ならNULLを返す)
+// *handleには参照または登録したハンドル番号を返す (無効なハンドルを参照していたら
+// DIRHANDLE_NONEを返す。続くパス名を読めるように、その場合もファイル名部分は読み飛ばす)
+static uint8_t *dh_decode(int id, uint8_t *p, uint8_t *end, dos_namebuf *ns, int *handle)
+{
+  if (end - p < 3)
+    return NULL;
+  ns->flag = *p++;
+  ns->drive = *p++;
+
+  uint8_t c = *p++;
+  if (c & 0x80) {
+    int h = c & 0x7f;
+    if (h >= DIRHANDLE_MAX || !dh_table[id][h].valid) {
+      DPRINTF1("COMPACT: unknown directory handle %d\n", h);
+      c = 0;
+      *handle = DIRHANDLE_NONE;
+    } else {
+      c = dh_table[id][h].len;
+      memcpy(ns->path, dh_table[id][h].path, c);
+      dh_table[id][h].lru = ++dh_clock;
+      *handle = h;
+    }
+  } else {
+    if (c > sizeof(ns->path) || end - p < c)
+      return NULL;
+    memcpy(ns->path, p, c);
+    p += c;
+    *handle = dh_register(id, ns->path, c);
+  }
+  memset(ns->path + c, 0x00, sizeof(ns->path) - c);
+
+  if (end - p < 2)
+    return NULL;
+  int n1 = *p & 0xf;
+  int ne = *p++ >> 4;
+  int n2 = *p++;
+  if (n1 > sizeof(ns->name1) || ne > sizeof(ns->ext) || n2 > sizeof(ns->name2) ||
+      end - p < n1 + ne + n2)
+    return NULL;
+  memcpy(ns->name1, p, n1);
+  memset(ns->name1 + n1, 0x20, sizeof(ns->name1) - n1);
+  p += n1;
+  memcpy(ns->ext, p, ne);
+  memset(ns->ext + ne, 0x20, sizeof(ns->ext) - ne);
+  p += ne;
+  memcpy(ns->name2, p, n2);
+  memset(ns->name2 + n2, 0x00, sizeof(ns->name2) - n2);
+  p += n2;
+  return p;
+}
+
+int op_compact(uint8_t *cbuf, size_t csize, uint8_t *rbuf, rdata_t *ext)
+{
+  static uint8_t xbuf[sizeof(struct cmd_createwrite)];  // 元に戻したコマンド
+  struct res_compact *res = (struct res_compact *)rbuf;
+  int id = cbuf[0] >> 5;
+  uint8_t *end = cbuf + csize;
+  uint8_t *p = cbuf + 1;
+  uint8_t *d = xbuf;
+  size_t len;
+  int n = 0;
+
+  // 前のコマンドの内容が残っていると、短いコマンドで送られなかったフィールドに見えてしまう
+  memset(xbuf, 0, sizeof(xbuf));
+  memset(res->handle, DIRHANDLE_NONE, sizeof(res->handle));
+  res->res = _DOSE_ILGPARM;
+
+  if (csize < 3)
+    goto errout;
+  *d++ = *p++;
+  n = *p++;
+  if (n > sizeof(res->handle) || ((xbuf[0] & 0x1f) | 0x40) == 0x5b || ((xbuf[0] & 0x1f) | 0x40) == 0x5c) {
+    n = 0;
+    goto errout;
+  }
+  for (int i = 0; i < n; i++) {
+    int h;
+    if (p >= end)
+      goto errout;
+    len = *p++;
+    if (end - p < len || d + len + sizeof(dos_namebuf) > xbuf + sizeof(xbuf))
+      goto errout;
+    memcpy(d, p, len);
+    d += len;
+    p += len;
+    if ((p = dh_decode(id, p, end, (dos_namebuf *)d, &h)) == NULL)
+      goto errout;
+    if (h == DIRHANDLE_NONE)
+      res->res = COMPACT_UNKNOWN;
+    res->handle[i] = h;
+    d += sizeof(dos_namebuf);
+  }
+  if (res->res == COMPACT_UNKNOWN) {
+    // 実行せずに返し、ドライバにパス名を直接指定して送り直させる
+    DPRINTF1("COMPACT: unknown directory handle\n");
+    return offsetof(struct res_compact, handle) + n;
+  }
+  if (end - p < 2)
+    goto errout;
+  len = (p[0] << 8) | p[1];
+  p += 2;
+  if (end - p < len || d + len > xbuf + sizeof(xbuf))
+    goto errout;
+  memcpy(d, p, len);
+
+  int rsize = remote_serv(xbuf, d + len - xbuf, rbuf + offsetof(struct res_compact, handle) + n, ext);
+  if (rsize < 0)
+    goto errout;
+  res->res = 0;
+  return offsetof(struct res_compact, handle) + n + rsize;
+
+errout:
+  DPRINTF1("COMPACT: invalid command\n");
+  // 無効なハンドルがあった場合は、パス名を直接指定して送り直させる
+  if (res->res != COMPACT_UNKNOWN)
+    res->res = _DOSE_ILGPARM;
+  return offsetof(struct res_compact, handle) + n;
+}
+
+//****************************************************************************
+// Statistics
+//****************************************************************************
+
+void remote_stats(void)
+{
+  ht_stats(&dl_table, "dirlist");
+  DPRINTF1("dirlist: mem=%lu peak=%lu limit=%lu evicted=%lu regenerated=%lu\n",
+           (unsigned long)dl_mem, (unsigned long)dl_mempeak,
+           (unsigned long)CONFIG_DIRMEM_LIMIT, dl_nevict, dl_nregen);
+  ht_stats(&fi_table, "fdinfo");
+  hf_stats();
+  fc_stats();
+#ifdef CONFIG_IOURING
+  uring_stats();
+#endif
+  pipe_stats();
+}
+
 //****************************************************************************
 // main
 //****************************************************************************
 
-int remote_serv(uint8_t *cbuf, uint8_t *rbuf)
+// ユニット毎の世代 (ドライバが覚えているCHDIR/CHMOD/DSKFREの結果を捨てさせるのに使う)
+static uint8_t unit_gen[8];
+
+// ユニットの内容を変える操作か
+static bool cmd_modify(uint8_t *cbuf)
+{
+  switch ((cbuf[0] & 0x1f) | 0x40) {
+  case 0x42: /* mkdir */
+  case 0x43: /* rmdir */
+  case 0x44: /* rename */
+  case 0x45: /* remove */
+  case 0x49: /* create */
+  case 0x4d: /* write */
+  case 0x5a: /* createwrite */
+    return true;
+  case 0x46: /* chmod */
+    return ((struct cmd_chmod *)cbuf)->attr != 0xff;
+  case 0x4f: /* filedate */
+  {
+    struct cmd_filedate *cmd = (struct cmd_filedate *)cbuf;
+    return cmd->time != 0 || cmd->date != 0;
+  }
+  default:
+    return false;
+  }
+}
+
+int remote_serv(uint8_t *cbuf, size_t csize, uint8_t *rbuf, rdata_t *ext)
 {
   DPRINTF2("----Command: 0x%02x\n", cbuf[0]);
   int rsize = -1;
   int id = cbuf[0] >> 5;
 
+  ext->buf = NULL;
+  ext->len = 0;
+
   switch ((cbuf[0] & 0x1f) | 0x40) {
   case 0x40: /* init */
     rsize = op_init(id, cbuf, rbuf);
@@ -1141,7 +1779,7 @@ int remote_serv(uint8_t *cbuf, uint8_t *rbuf)
     rsize = op_files(id, cbuf, rbuf);
     break;
   case 0x48: /* nfiles */
-    rsize = op_nfiles(id, cbuf, rbuf);
+    rsize = op_nfiles(id, cbuf, csize, rbuf);
     break;
   case 0x49: /* create */
     rsize = op_create(id, cbuf, rbuf);
@@ -1153,10 +1791,10 @@ int remote_serv(uint8_t *cbuf, uint8_t *rbuf)
     rsize = op_close(id, cbuf, rbuf);
     break;
   case 0x4c: /* read */
-    rsize = op_read(id, cbuf, rbuf);
+    rsize = op_read(id, cbuf, rbuf, ext);
     break;
   case 0x4d: /* write */
-    rsize = op_write(id, cbuf, rbuf);
+    rsize = op_write(id, cbuf, csize, rbuf);
     break;
   case 0x4f: /* filedate */
     rsize = op_filedate(id, cbuf, rbuf);
@@ -1164,6 +1802,18 @@ int remote_serv(uint8_t *cbuf, uint8_t *rbuf)
   case 0x50: /* dskfre */
     rsize = op_dskfre(id, cbuf, rbuf);
     break;
+  case 0x59: /* openread */
+    rsize = op_openread(id, cbuf, rbuf, ext);
+    break;
+  case 0x5a: /* createwrite */
+    rsize = op_createwrite(id, cbuf, csize, rbuf);
+    break;
+  case 0x5b: /* compound */
+    rsize = op_compound(cbuf, csize, rbuf, ext);
+    break;
+  case 0x5c: /* compact */
+    rsize = op_compact(cbuf, csize, rbuf, ext);
+    break;
 
   case 0x51: /* drvctrl */
   case 0x52: /* getdbp */
@@ -1177,5 +1827,8 @@ int remote_serv(uint8_t *cbuf, uint8_t *rbuf)
     DPRINTF1("error: %02x\n", cbuf[0]);
   }
 
+  if (cmd_modify(cbuf))
+    unit_gen[id]++;
+  ext->gen = unit_gen[id];
   return rsize;
 }
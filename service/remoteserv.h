@@ -33,6 +33,7 @@
 #define DPRINTF2(...)  DPRINTF(2, __VA_ARGS__)
 #define DPRINTF3(...)  DPRINTF(3, __VA_ARGS__)
 void DPRINTF(int level, char *fmt, ...);
+void pipe_stats(void);
 
 #ifndef O_BINARY
 #define O_BINARY 0
@@ -40,6 +41,15 @@ void DPRINTF(int level, char *fmt, ...);
 
 extern const char *rootpath[8];
 
-int remote_serv(uint8_t *wbuf, uint8_t *rbuf);
+// rbufに続けて送信する応答データ
+// (ファイルのマッピングなどからrbufにコピーせずに直接送信する場合に使う)
+typedef struct {
+  const void *buf;
+  size_t len;
+  uint8_t gen;          // 応答フレームに付けるユニットの世代
+} rdata_t;
+
+int remote_serv(uint8_t *wbuf, size_t wsize, uint8_t *rbuf, rdata_t *ext);
+void remote_stats(void);
 
 #endif /* _REMOTESERV_H_ */
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2023 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _SPSCQ_H_
+#define _SPSCQ_H_
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+//****************************************************************************
+// Single-producer single-consumer queue
+//****************************************************************************
+
+// 1つのスレッドが追加し、別の1つのスレッドが取り出すキュー
+// 追加・取り出しはロックを使わずに行い、キューが空で取り出し側が待っている
+// 場合だけ条件変数で起こす
+// 要素数はSPSCQ_SIZEを越えないように使う側で管理する
+
+#define SPSCQ_SIZE    16      // 2のべき乗
+
+typedef struct {
+  atomic_uint head;           // 次に取り出す位置 (取り出し側だけが更新する)
+  atomic_uint tail;           // 次に追加する位置 (追加側だけが更新する)
+  atomic_bool waiting;        // 取り出し側が待っている
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  void *item[SPSCQ_SIZE];
+} spscq_t;
+
+#define SPSCQ_INITIALIZER \
+  { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER }
+
+static inline void spscq_push(spscq_t *q, void *item)
+{
+  unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  q->item[tail % SPSCQ_SIZE] = item;
+  atomic_store(&q->tail, tail + 1);
+  if (atomic_load(&q->waiting)) {
+    pthread_mutex_lock(&q->lock);
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+  }
+}
+
+static inline void *spscq_pop(spscq_t *q)
+{
+  unsigned head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  if (atomic_load(&q->tail) == head) {
+    // キューが空なら追加されるまで待つ
+    pthread_mutex_lock(&q->lock);
+    atomic_store(&q->waiting, true);
+    while (atomic_load(&q->tail) == head)
+      pthread_cond_wait(&q->cond, &q->lock);
+    atomic_store(&q->waiting, false);
+    pthread_mutex_unlock(&q->lock);
+  }
+  void *item = q->item[head % SPSCQ_SIZE];
+  atomic_store_explicit(&q->head, head + 1, memory_order_release);
+  return item;
+}
+
+#endif /* _SPSCQ_H_ */
@@ -0,0 +1,366 @@
+/*
+ * Copyright (c) 2023 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
+
+#include <config.h>
+#include "remoteserv.h"
+#include "uring.h"
+
+//****************************************************************************
+// Global variables
+//****************************************************************************
+
+typedef struct {
+  int fd;
+  unsigned entries;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  uint64_t ops;               // 使える操作 (1 << IORING_OP_xxx)
+} ring_t;
+
+static __thread ring_t *ring_cur = NULL;    // このスレッドのリング
+static __thread bool ring_failed = false;   // リングが作成できなかった
+
+// statistics
+static atomic_ulong u_nring;
+static atomic_ulong u_nop;
+static atomic_ulong u_nenter;
+static atomic_ulong u_nbatch;
+static atomic_ulong u_nfallback;
+
+//****************************************************************************
+// Local functions
+//****************************************************************************
+
+// リングで使える操作を調べる
+// IORING_REGISTER_PROBEはカーネル5.6以降なので、失敗したら5.1からあるFSYNCだけを使う
+// (OPENAT/READ/WRITE/CLOSE/STATXも5.6以降で、それより前のカーネルでは-EINVALで完了する)
+static uint64_t ring_probe(int fd)
+{
+  struct io_uring_probe *probe = calloc(1, sizeof(*probe) + 64 * sizeof(struct io_uring_probe_op));
+  uint64_t ops = 1ULL << IORING_OP_FSYNC;
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 64) >= 0) {
+    ops = 0;
+    for (int i = 0; i < probe->ops_len && i < 64; i++) {
+      if (probe->ops[i].flags & IO_URING_OP_SUPPORTED)
+        ops |= 1ULL << probe->ops[i].op;
+    }
+  }
+  free(probe);
+  return ops;
+}
+
+// このスレッドのリングを取得する (最初に呼ばれたときに作成する)
+// リングが使えないか、opcodeの操作に対応していなければNULLを返す
+static ring_t *ring_get(int opcode)
+{
+  if (ring_cur || ring_failed)
+    return ring_cur && (ring_cur->ops & (1ULL << opcode)) ? ring_cur : NULL;
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = syscall(__NR_io_uring_setup, CONFIG_IOURING_ENTRIES, &p);
+  if (fd < 0) {
+    DPRINTF1("io_uring: setup failed (%d)\n", errno);
+    ring_failed = true;
+    return NULL;
+  }
+
+  size_t sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    sqsize = cqsize = sqsize > cqsize ? sqsize : cqsize;
+  uint8_t *sq = mmap(NULL, sqsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                     fd, IORING_OFF_SQ_RING);
+  uint8_t *cq = sq;
+  if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+    cq = mmap(NULL, cqsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+              fd, IORING_OFF_CQ_RING);
+  void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+    DPRINTF1("io_uring: mmap failed\n");
+    close(fd);
+    ring_failed = true;
+    return NULL;
+  }
+
+  ring_t *r = malloc(sizeof(*r));
+  r->fd = fd;
+  r->entries = p.sq_entries;
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->sqes = sqes;
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  r->ops = ring_probe(fd);
+  DPRINTF1("io_uring: %u entries ops=%llx\n", r->entries, (unsigned long long)r->ops);
+  u_nring++;
+  ring_cur = r;
+  return r->ops & (1ULL << opcode) ? r : NULL;
+}
+
+// 送信キューの空きエントリを取得する (user_dataには結果を格納する番号を入れる)
+static struct io_uring_sqe *ring_sqe(ring_t *r, int opcode, int fd, int index)
+{
+  unsigned tail = *r->sq_tail;
+  unsigned i = tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[i];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->user_data = index;
+  r->sq_array[i] = i;
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+// 用意したn個の操作を発行して、すべて完了するまで待つ
+// 各操作の結果(-errnoまたは戻り値)をres[user_data]に格納する
+static void ring_run(ring_t *r, int n, int *res)
+{
+  int submit = n;
+  int done = 0;
+  while (done < n) {
+    int e = syscall(__NR_io_uring_enter, r->fd, submit, n - done, IORING_ENTER_GETEVENTS, NULL, 0);
+    u_nenter++;
+    if (e < 0 && errno != EINTR) {
+      // 発行できなかった操作はエラーにする
+      for (int i = done; i < n; i++)
+        res[i] = -errno;
+      return;
+    }
+    if (e > 0)
+      submit -= e;
+
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+      res[cqe->user_data] = cqe->res;
+      done++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  }
+  u_nop += n;
+}
+
+// 1つの操作を実行して結果を返す
+static int ring_run1(ring_t *r, int *err)
+{
+  int res;
+  ring_run(r, 1, &res);
+  if (res < 0) {
+    if (err)
+      *err = -res;
+    return -1;
+  }
+  return res;
+}
+
+static void statx_conv(struct statx *stx, struct stat *st)
+{
+  memset(st, 0, sizeof(*st));
+  st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+  st->st_ino = stx->stx_ino;
+  st->st_mode = stx->stx_mode;
+  st->st_nlink = stx->stx_nlink;
+  st->st_uid = stx->stx_uid;
+  st->st_gid = stx->stx_gid;
+  st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+  st->st_size = stx->stx_size;
+  st->st_blksize = stx->stx_blksize;
+  st->st_blocks = stx->stx_blocks;
+  st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+  st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+  st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+  st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+  st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+  st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+static int ring_statx(ring_t *r, int *err, int dirfd, const char *path, int flags, struct stat *st)
+{
+  struct statx stx;
+  struct io_uring_sqe *sqe = ring_sqe(r, IORING_OP_STATX, dirfd, 0);
+  sqe->addr = (uintptr_t)path;
+  sqe->len = STATX_BASIC_STATS;
+  sqe->off = (uintptr_t)&stx;
+  sqe->statx_flags = flags;
+  if (ring_run1(r, err) < 0)
+    return -1;
+  statx_conv(&stx, st);
+  return 0;
+}
+
+// リングが使えないか操作に対応していない場合は通常のシステムコールで処理する
+static int fallback(int *err, int r)
+{
+  u_nfallback++;
+  if (r < 0 && err)
+    *err = errno;
+  return r;
+}
+
+//****************************************************************************
+// File operations
+//****************************************************************************
+
+int uring_open(int *err, const char *path, int flags, mode_t mode)
+{
+  ring_t *r = ring_get(IORING_OP_OPENAT);
+  if (!r)
+    return fallback(err, open(path, flags, mode));
+  struct io_uring_sqe *sqe = ring_sqe(r, IORING_OP_OPENAT, AT_FDCWD, 0);
+  sqe->addr = (uintptr_t)path;
+  sqe->len = mode;
+  sqe->open_flags = flags;
+  return ring_run1(r, err);
+}
+
+int uring_close(int *err, int fd)
+{
+  ring_t *r = ring_get(IORING_OP_CLOSE);
+  if (!r)
+    return fallback(err, close(fd));
+  ring_sqe(r, IORING_OP_CLOSE, fd, 0);
+  return ring_run1(r, err) < 0 ? -1 : 0;
+}
+
+// offsetが-1ならファイルポインタの位置から読み込む
+ssize_t uring_read(int *err, int fd, void *buf, size_t count, off_t offset)
+{
+  ring_t *r = ring_get(IORING_OP_READ);
+  if (!r)
+    return fallback(err, offset < 0 ? read(fd, buf, count) : pread(fd, buf, count, offset));
+  struct io_uring_sqe *sqe = ring_sqe(r, IORING_OP_READ, fd, 0);
+  sqe->addr = (uintptr_t)buf;
+  sqe->len = count;
+  sqe->off = offset;
+  return ring_run1(r, err);
+}
+
+ssize_t uring_write(int *err, int fd, const void *buf, size_t count, off_t offset)
+{
+  ring_t *r = ring_get(IORING_OP_WRITE);
+  if (!r)
+    return fallback(err, offset < 0 ? write(fd, buf, count) : pwrite(fd, buf, count, offset));
+  struct io_uring_sqe *sqe = ring_sqe(r, IORING_OP_WRITE, fd, 0);
+  sqe->addr = (uintptr_t)buf;
+  sqe->len = count;
+  sqe->off = offset;
+  return ring_run1(r, err);
+}
+
+int uring_fsync(int *err, int fd)
+{
+  ring_t *r = ring_get(IORING_OP_FSYNC);
+  if (!r)
+    return fallback(err, fsync(fd));
+  ring_sqe(r, IORING_OP_FSYNC, fd, 0);
+  return ring_run1(r, err) < 0 ? -1 : 0;
+}
+
+int uring_stat(int *err, const char *path, struct stat *st)
+{
+  ring_t *r = ring_get(IORING_OP_STATX);
+  if (!r)
+    return fallback(err, stat(path, st));
+  return ring_statx(r, err, AT_FDCWD, path, 0, st);
+}
+
+int uring_fstat(int *err, int fd, struct stat *st)
+{
+  ring_t *r = ring_get(IORING_OP_STATX);
+  if (!r)
+    return fallback(err, fstat(fd, st));
+  return ring_statx(r, err, fd, "", AT_EMPTY_PATH, st);
+}
+
+// n個のファイルのstatをまとめて発行する
+// 各ファイルの結果は成功なら0、失敗なら-errnoをres[]に格納する
+int uring_statv(const char **path, struct stat *st, int *res, int n)
+{
+  ring_t *r = ring_get(IORING_OP_STATX);
+  if (!r) {
+    for (int i = 0; i < n; i++)
+      res[i] = fallback(NULL, stat(path[i], &st[i])) < 0 ? -errno : 0;
+    return 0;
+  }
+
+  struct statx *stx = malloc(sizeof(struct statx) * r->entries);
+  for (int base = 0; base < n; base += r->entries) {
+    int m = n - base < r->entries ? n - base : r->entries;
+    for (int i = 0; i < m; i++) {
+      struct io_uring_sqe *sqe = ring_sqe(r, IORING_OP_STATX, AT_FDCWD, i);
+      sqe->addr = (uintptr_t)path[base + i];
+      sqe->len = STATX_BASIC_STATS;
+      sqe->off = (uintptr_t)&stx[i];
+    }
+    ring_run(r, m, &res[base]);
+    for (int i = 0; i < m; i++) {
+      if (res[base + i] == 0)
+        statx_conv(&stx[i], &st[base + i]);
+    }
+    u_nbatch++;
+  }
+  free(stx);
+  return 0;
+}
+
+//****************************************************************************
+// Statistics
+//****************************************************************************
+
+void uring_stats(void)
+{
+  unsigned long nop = u_nop, nenter = u_nenter;
+  DPRINTF1("io_uring: rings=%lu ops=%lu enters=%lu ops/enter=%.2f statbatches=%lu fallbacks=%lu\n",
+           (unsigned long)u_nring, nop, nenter, nenter ? (double)nop / nenter : 0.0,
+           (unsigned long)u_nbatch, (unsigned long)u_nfallback);
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2023 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+//****************************************************************************
+// io_uring file operation backend (Linux)
+//****************************************************************************
+
+// CONFIG_IOURINGを定義してビルドすると、fileop.hのファイル操作をio_uring経由で行う
+// スレッド毎にリングを作成するので、先読み・遅延書き込みスレッドからも使える
+// リングが作成できない環境や、カーネルが対応していない操作は通常のシステムコールで処理する
+
+int uring_open(int *err, const char *path, int flags, mode_t mode);
+int uring_close(int *err, int fd);
+ssize_t uring_read(int *err, int fd, void *buf, size_t count, off_t offset);
+ssize_t uring_write(int *err, int fd, const void *buf, size_t count, off_t offset);
+int uring_fsync(int *err, int fd);
+int uring_stat(int *err, const char *path, struct stat *st);
+int uring_fstat(int *err, int fd, struct stat *st);
+int uring_statv(const char **path, struct stat *st, int *res, int n);
+void uring_stats(void);
+
+#endif /* _URING_H_ */
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2023 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include <config.h>
+#include "remoteserv.h"
+#include "vfs.h"
+
+//****************************************************************************
+// Global variables
+//****************************************************************************
+
+vfs_t vfs_root[8];
+
+// ルートディレクトリ指定のプレフィクスとバックエンドの対応
+// (ドライブレターと区別するため、プレフィクスは2文字以上にする)
+static const struct {
+  const char *prefix;
+  const vfs_ops_t *ops;
+} vfs_types[] = {
+  { "ram", &vfs_ram_ops },
+  { "arc", &vfs_arc_ops },
+  { "img", &vfs_img_ops },
+  { "pack", &vfs_pack_ops },
+  { NULL, NULL },
+};
+
+//****************************************************************************
+// Mount
+//****************************************************************************
+
+// ユニットidにルートディレクトリspecを割り当てる
+int vfs_mount(int id, const char *spec)
+{
+  vfs_t *v = &vfs_root[id];
+  const vfs_ops_t *ops = &vfs_host_ops;
+
+  for (int i = 0; vfs_types[i].prefix; i++) {
+    size_t l = strlen(vfs_types[i].prefix);
+    if (strncmp(spec, vfs_types[i].prefix, l) == 0 && spec[l] == ':') {
+      ops = vfs_types[i].ops;
+      spec += l + 1;
+      break;
+    }
+  }
+
+  memset(v, 0, sizeof(*v));
+  v->ops = ops;
+  if (ops->mount(v, spec) < 0) {
+    v->ops = NULL;
+    return -1;
+  }
+  DPRINTF1("unit %d: %s %s\n", id, ops->name, spec);
+  return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2023 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _VFS_H_
+#define _VFS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <fileop.h>
+
+//****************************************************************************
+// Virtual filesystem interface
+//****************************************************************************
+
+// ユニット毎にファイル操作を行うバックエンドを選択する
+// ルートディレクトリの指定が "<種類>:<指定>" の形ならその種類のバックエンドを、
+// それ以外ならホストのディレクトリを使う
+// 各操作にはvfs_t.baseを先頭に付けたUTF-8のパス名が渡される
+// エラー時は-1(またはNULL)を返して*err(NULLでなければ)にerrnoの値を格納する
+
+typedef struct vfs vfs_t;
+typedef void vfs_file_t;    // バックエンド毎のオープン中のファイル
+typedef void vfs_dir_t;     // バックエンド毎のディレクトリ読み出し状態
+
+typedef struct {
+  const char *name;
+  int (*mount)(vfs_t *v, const char *spec);
+
+  // Filesystem operations
+  int (*stat)(vfs_t *v, int *err, const char *path, TYPE_STAT *st);
+  void (*statv)(vfs_t *v, const char **path, TYPE_STAT *st, int *res, int n);  // NULLならstatを使う
+  int (*mkdir)(vfs_t *v, int *err, const char *path);
+  int (*rmdir)(vfs_t *v, int *err, const char *path);
+  int (*rename)(vfs_t *v, int *err, const char *pathold, const char *pathnew);
+  int (*unlink)(vfs_t *v, int *err, const char *path);
+  int (*chmod)(vfs_t *v, int *err, const char *path, int mode);
+
+  // Directory operations
+  vfs_dir_t *(*opendir)(vfs_t *v, int *err, const char *path);
+  const char *(*readdir)(vfs_t *v, vfs_dir_t *dir);
+  void (*closedir)(vfs_t *v, vfs_dir_t *dir);
+
+  // File operations
+  vfs_file_t *(*open)(vfs_t *v, int *err, const char *path, int flags);
+  int (*close)(vfs_t *v, int *err, vfs_file_t *f);
+  ssize_t (*read)(vfs_t *v, int *err, vfs_file_t *f, void *buf, size_t count, off_t pos,
+                  const void **data);
+  ssize_t (*write)(vfs_t *v, int *err, vfs_file_t *f, const void *buf, size_t count, off_t pos);
+  int (*ftruncate)(vfs_t *v, int *err, vfs_file_t *f, off_t length);
+  int (*fstat)(vfs_t *v, int *err, vfs_file_t *f, TYPE_STAT *st);
+  int (*filedate)(vfs_t *v, int *err, vfs_file_t *f, uint16_t time, uint16_t date);
+  void (*prefetch)(vfs_t *v, vfs_file_t *f, off_t pos);     // NULL可
+  bool (*mapped)(vfs_t *v, vfs_file_t *f);                  // NULL可 (内容をメモリにマップしているか)
+  void (*closeall)(vfs_t *v);                               // NULL可
+
+  // Misc functions
+  int (*statfs)(vfs_t *v, int *err, uint64_t *total, uint64_t *free);
+} vfs_ops_t;
+
+struct vfs {
+  const vfs_ops_t *ops;       // NULLならユニットが割り当てられていない
+  const char *base;           // パス名の先頭に付ける文字列
+  void *priv;                 // バックエンド毎のデータ
+};
+
+extern vfs_t vfs_root[8];
+
+int vfs_mount(int id, const char *spec);
+
+extern const vfs_ops_t vfs_host_ops;
+extern const vfs_ops_t vfs_ram_ops;
+extern const vfs_ops_t vfs_arc_ops;
+extern const vfs_ops_t vfs_img_ops;
+extern const vfs_ops_t vfs_pack_ops;
+
+#endif /* _VFS_H_ */
@@ -0,0 +1,953 @@
+/*
+ * Copyright (c) 2023 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <zlib.h>
+
+#include <config.h>
+#include <fileop.h>
+#include "remoteserv.h"
+#include "vfs.h"
+#include "lzh.h"
+
+//****************************************************************************
+// Archive backend
+//****************************************************************************
+
+// ZIP/LZH/tar書庫の内容を読み込み専用のルートにするバックエンド
+// ルートディレクトリの指定は "arc:<書庫ファイル名>" (書庫の形式は内容から判別する)
+// マウント時に書庫全体をメモリにマップしてディレクトリツリーを作り、
+// 以後のファイル検索・読み込みはマップした書庫から直接行う
+// 圧縮されたファイルはCONFIG_ARCBLOCK単位で展開した結果をキャッシュしておき、
+// 順次読み込みでは展開を途中から続ける
+
+enum {
+  ARC_STORED,                 // 無圧縮
+  ARC_DEFLATE,                // ZIPのdeflate
+  ARC_LH5,                    // LHAの-lh5-/-lh6-/-lh7-
+  ARC_LH6,
+  ARC_LH7,
+};
+
+typedef struct arcblk arcblk_t;
+
+typedef struct arcnode {
+  char *name;
+  int mode;                   // st_modeと同じ形式
+  time_t mtime;
+  uint32_t ino;
+  int method;
+  const uint8_t *data;        // 圧縮データ (マップした書庫内)
+  size_t csize;
+  size_t size;                // 展開後のサイズ
+  arcblk_t **blk;             // 展開済みブロック (未展開ならNULL)
+  struct arcnode *parent;
+  struct arcnode *child;      // ディレクトリ内のファイル
+  struct arcnode *last;       // ディレクトリ内の最後のファイル
+  struct arcnode *next;
+  struct arcnode *hnext;      // ハッシュチェーン
+} arcnode_t;
+
+struct arcblk {
+  arcnode_t *node;
+  uint32_t index;
+  uint8_t *data;
+  size_t len;
+  arcblk_t *prev;             // LRUリスト
+  arcblk_t *next;
+};
+
+typedef struct {
+  arcnode_t root;
+  uint8_t *map;               // 書庫全体をマップした領域
+  size_t mapsize;
+  uint32_t ino;
+  arcnode_t **bucket;         // (親ディレクトリ,名前)をキーにしたハッシュ表
+  int nbucket;
+  int nnode;
+  arcblk_t lru;               // 展開済みブロックのLRUリスト (先頭が最新)
+  size_t cached;
+  // statistics
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long restarts;
+  uint64_t inflated;
+} arcfs_t;
+
+typedef struct {
+  arcnode_t *node;
+  bool active;                // 展開中
+  off_t outpos;               // 展開済みのサイズ
+  z_stream z;
+  lzh_t *lzh;
+} arcfile_t;
+
+typedef struct {
+  arcnode_t *cur;
+  int dots;                   // "."と".."を返した数
+} arcdir_t;
+
+//****************************************************************************
+// Local functions
+//****************************************************************************
+
+static inline uint16_t le16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+static inline uint32_t le32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static time_t dos2time(uint16_t time, uint16_t date)
+{
+  struct tm tm;
+  tm.tm_sec = (time << 1) & 0x3f;
+  tm.tm_min = (time >> 5) & 0x3f;
+  tm.tm_hour = (time >> 11) & 0x1f;
+  tm.tm_mday = date & 0x1f;
+  tm.tm_mon = ((date >> 5) & 0xf) - 1;
+  tm.tm_year = ((date >> 9) & 0x7f) + 80;
+  tm.tm_isdst = -1;
+  return mktime(&tm);
+}
+
+static unsigned arc_hash(arcfs_t *fs, arcnode_t *dir, const char *name, size_t len)
+{
+  uint32_t h = 2166136261u ^ dir->ino;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ tolower((uint8_t)name[i])) * 16777619u;
+  return h & (fs->nbucket - 1);
+}
+
+// ディレクトリdir内の名前nameのノードを探す
+static arcnode_t *arc_find(arcfs_t *fs, arcnode_t *dir, const char *name, size_t len)
+{
+  if (fs->nbucket == 0)
+    return NULL;
+  for (arcnode_t *n = fs->bucket[arc_hash(fs, dir, name, len)]; n; n = n->hnext) {
+    if (n->parent == dir && strncasecmp(n->name, name, len) == 0 && n->name[len] == '\0')
+      return n;
+  }
+  return NULL;
+}
+
+static void arc_rehash(arcfs_t *fs, arcnode_t *n)
+{
+  if (n != &fs->root) {
+    unsigned h = arc_hash(fs, n->parent, n->name, strlen(n->name));
+    n->hnext = fs->bucket[h];
+    fs->bucket[h] = n;
+  }
+  for (arcnode_t *c = n->child; c; c = c->next)
+    arc_rehash(fs, c);
+}
+
+static arcnode_t *arc_newnode(arcfs_t *fs, arcnode_t *dir, const char *name, size_t len, int mode)
+{
+  if (fs->nnode >= fs->nbucket) {   // 負荷率が1を越えたらバケットを増やす
+    free(fs->bucket);
+    fs->nbucket = fs->nbucket ? fs->nbucket * 2 : 256;
+    fs->bucket = calloc(fs->nbucket, sizeof(arcnode_t *));
+    arc_rehash(fs, &fs->root);
+  }
+  arcnode_t *n = calloc(1, sizeof(*n));
+  n->name = strndup(name, len);
+  n->mode = mode;
+  n->mtime = fs->root.mtime;
+  n->ino = ++fs->ino;
+  n->parent = dir;
+  if (dir->last)
+    dir->last->next = n;
+  else
+    dir->child = n;
+  dir->last = n;
+  unsigned h = arc_hash(fs, dir, name, len);
+  n->hnext = fs->bucket[h];
+  fs->bucket[h] = n;
+  fs->nnode++;
+  return n;
+}
+
+// 書庫内のエントリをツリーに登録する
+// nameはUTF-8に変換済みで'/'区切りのパス名 (途中のディレクトリがなければ作る)
+static void arc_add(arcfs_t *fs, const char *name, bool isdir, time_t mtime,
+                    int method, const uint8_t *data, size_t csize, size_t size)
+{
+  arcnode_t *dir = &fs->root;
+  arcnode_t *n = NULL;
+
+  while (*name) {
+    size_t l = strcspn(name, "/");
+    const char *elem = name;
+    name += l;
+    name += strspn(name, "/");
+    if (l == 0 || (l == 1 && elem[0] == '.') || (l == 2 && elem[0] == '.' && elem[1] == '.'))
+      continue;
+    if (n) {
+      if (!S_ISDIR(n->mode))
+        return;               // ファイルの下にはエントリを作らない
+      dir = n;
+    }
+    n = arc_find(fs, dir, elem, l);
+    if (n == NULL) {
+      bool last = (*name == '\0');
+      n = arc_newnode(fs, dir, elem, l, (last && !isdir) ? S_IFREG|0444 : S_IFDIR|0555);
+    }
+  }
+  if (n == NULL || S_ISDIR(n->mode) != isdir)
+    return;
+  n->mtime = mtime;
+  if (!isdir) {               // 同じ名前のエントリが複数あれば後のものを使う
+    n->method = method;
+    n->data = data;
+    n->csize = csize;
+    n->size = size;
+  }
+}
+
+// 書庫内のファイル名をUTF-8に変換して登録する
+// ZIPのUTF-8フラグが立っていなければSJISとして扱う
+// sepが0でなければSJISの2バイト目を避けてsepを'/'に置き換える (LZHの'\\')
+static void arc_addname(arcfs_t *fs, const uint8_t *name, size_t len, bool utf8, int sep,
+                        bool isdir, time_t mtime, int method,
+                        const uint8_t *data, size_t csize, size_t size)
+{
+  char sname[1024];
+  char uname[1024 * 3 / 2];
+
+  if (len >= sizeof(sname))
+    return;
+  for (size_t i = 0; i < len; i++) {
+    uint8_t c = name[i];
+    sname[i] = (sep && c == sep) ? '/' : c;
+    if (!utf8 && ((c >= 0x81 && c <= 0x9f) || (c >= 0xe0 && c <= 0xfc)) && i + 1 < len) {
+      i++;
+      sname[i] = name[i];
+    }
+  }
+  sname[len] = '\0';
+
+  if (!utf8) {
+    char *src = sname;
+    char *dst = uname;
+    size_t srclen = len;
+    size_t dstlen = sizeof(uname) - 1;
+    if (FUNC_ICONV_S2U(&src, &srclen, &dst, &dstlen) >= 0) {
+      *dst = '\0';
+      arc_add(fs, uname, isdir, mtime, method, data, csize, size);
+      return;
+    }
+  }
+  arc_add(fs, sname, isdir, mtime, method, data, csize, size);
+}
+
+//****************************************************************************
+// Archive index
+//****************************************************************************
+
+// ZIP: 末尾の中央ディレクトリから全エントリを登録する
+static int arc_index_zip(arcfs_t *fs)
+{
+  const uint8_t *map = fs->map;
+  size_t size = fs->mapsize;
+  const uint8_t *eocd = NULL;
+
+  // 終端レコードの後には最大64KBのコメントがある
+  size_t min = size > 22 + 0xffff ? size - 22 - 0xffff : 0;
+  for (size_t i = size - 22; ; i--) {
+    if (le32(&map[i]) == 0x06054b50) {
+      eocd = &map[i];
+      break;
+    }
+    if (i == min)
+      break;
+  }
+  if (eocd == NULL)
+    return -1;
+
+  int nent = le16(eocd + 10);
+  size_t pos = le32(eocd + 16);
+  if (pos == 0xffffffff) {
+    DPRINTF1("ARC: ZIP64 is not supported\n");
+    return -1;
+  }
+  for (int i = 0; i < nent; i++) {
+    if (pos + 46 > size || le32(&map[pos]) != 0x02014b50)
+      return -1;
+    const uint8_t *cd = &map[pos];
+    int flags = le16(cd + 8);
+    int method = le16(cd + 10);
+    size_t csize = le32(cd + 20);
+    size_t usize = le32(cd + 24);
+    int namelen = le16(cd + 28);
+    size_t lofs = le32(cd + 42);
+    const uint8_t *name = cd + 46;
+    pos += 46 + namelen + le16(cd + 30) + le16(cd + 32);
+    if (pos > size)
+      return -1;
+
+    bool isdir = (namelen > 0 && name[namelen - 1] == '/') ||
+                 (cd[5] == 0 && (cd[38] & 0x10));   // MS-DOSで作られた書庫のディレクトリ属性
+    if (lofs + 30 > size || le32(&map[lofs]) != 0x04034b50)
+      continue;
+    const uint8_t *data = &map[lofs + 30 + le16(&map[lofs + 26]) + le16(&map[lofs + 28])];
+    if (!isdir) {
+      if ((flags & 1) || (method != 0 && method != 8) ||
+          data + csize > map + size || (method == 0 && csize != usize)) {
+        DPRINTF1("ARC: unsupported entry %.*s (method=%d flags=0x%x)\n",
+                 namelen, name, method, flags);
+        continue;
+      }
+    }
+    arc_addname(fs, name, namelen, flags & 0x800, 0, isdir,
+                dos2time(le16(cd + 12), le16(cd + 14)),
+                method == 8 ? ARC_DEFLATE : ARC_STORED, data, csize, usize);
+  }
+  return 0;
+}
+
+// UTF-8として正しいバイト列か
+static bool utf8_valid(const uint8_t *p, size_t len)
+{
+  for (size_t i = 0; i < len; ) {
+    int n = p[i] < 0x80 ? 0 : (p[i] & 0xe0) == 0xc0 ? 1 :
+            (p[i] & 0xf0) == 0xe0 ? 2 : (p[i] & 0xf8) == 0xf0 ? 3 : -1;
+    if (n < 0 || i + n >= len)
+      return false;
+    for (i++; n > 0; n--, i++) {
+      if ((p[i] & 0xc0) != 0x80)
+        return false;
+    }
+  }
+  return true;
+}
+
+static size_t octal(const uint8_t *p, int len)
+{
+  size_t v = 0;
+  for (; len > 0 && *p == ' '; p++, len--)
+    ;
+  for (int i = 0; i < len && p[i] >= '0' && p[i] <= '7'; i++)
+    v = v * 8 + p[i] - '0';
+  return v;
+}
+
+// tar: 512バイト単位のヘッダを順にたどって登録する
+// ファイル名がUTF-8として正しくなければSJISとして扱う
+static int arc_index_tar(arcfs_t *fs)
+{
+  const uint8_t *map = fs->map;
+  size_t size = fs->mapsize;
+  const uint8_t *longname = NULL;
+  size_t longlen = 0;
+
+  for (size_t pos = 0; pos + 512 <= size; ) {
+    const uint8_t *h = &map[pos];
+    if (h[0] == '\0')
+      break;                  // 終端
+    size_t fsize = octal(h + 124, 12);
+    const uint8_t *data = h + 512;
+    pos += 512 + ((fsize + 511) & ~511);
+    if (data + fsize > map + size)
+      return -1;
+
+    int type = h[156];
+    if (type == 'L') {        // GNU形式の長いファイル名
+      longname = data;
+      longlen = strnlen((const char *)data, fsize);
+      continue;
+    }
+    char name[256 + 1 + 100 + 1];
+    const uint8_t *np = (const uint8_t *)name;
+    size_t nl;
+    if (longname) {
+      np = longname;
+      nl = longlen;
+      longname = NULL;
+    } else if (memcmp(h + 257, "ustar", 5) == 0 && h[345]) {
+      nl = snprintf(name, sizeof(name), "%.155s/%.100s", h + 345, h);
+    } else {
+      nl = snprintf(name, sizeof(name), "%.100s", h);
+    }
+    if (type != '0' && type != '\0' && type != '7' && type != '5')
+      continue;               // リンクや特殊ファイルは登録しない
+    arc_addname(fs, np, nl, utf8_valid(np, nl), 0, type == '5', octal(h + 136, 12),
+                ARC_STORED, data, fsize, fsize);
+  }
+  return 0;
+}
+
+// LZH: レベル0/1/2のヘッダを順にたどって登録する
+static int arc_index_lzh(arcfs_t *fs)
+{
+  const uint8_t *map = fs->map;
+  size_t size = fs->mapsize;
+
+  for (size_t pos = 0; pos + 22 <= size; ) {
+    const uint8_t *h = &map[pos];
+    int level = h[20];
+    if (h[0] == 0 && level != 2)
+      break;                  // 終端
+    if (h[2] != '-' || h[3] != 'l' || h[6] != '-')
+      return -1;
+
+    size_t csize = le32(h + 7);
+    size_t usize = le32(h + 11);
+    time_t mtime;
+    char name[1024];
+    size_t nl = 0;
+    char dir[1024];
+    size_t dl = 0;
+    size_t hsize;             // 基本ヘッダと拡張ヘッダのサイズ
+    size_t next;              // 最初の拡張ヘッダのサイズ
+    const uint8_t *ext;
+
+    switch (level) {
+    case 0:
+    case 1:
+      hsize = h[0] + 2;
+      if (pos + hsize > size || h[21] + 22 > hsize)
+        return -1;
+      nl = h[21];
+      memcpy(name, h + 22, nl);
+      mtime = dos2time(le16(h + 15), le16(h + 17));
+      ext = h + hsize;
+      next = level == 1 ? le16(h + hsize - 2) : 0;
+      break;
+    case 2:
+      hsize = le16(h);
+      if (pos + hsize > size || hsize < 26)
+        return -1;
+      mtime = le32(h + 15);
+      ext = h + 26;
+      next = le16(h + 24);
+      break;
+    default:
+      return -1;
+    }
+    // 拡張ヘッダからファイル名とディレクトリ名を取り出す
+    while (next >= 3) {
+      if (ext + next > map + size)
+        return -1;
+      size_t l = next - 3;
+      if (ext[0] == 0x01 && l < sizeof(name)) {
+        memcpy(name, ext + 1, l);
+        nl = l;
+      } else if (ext[0] == 0x02 && l < sizeof(dir)) {
+        memcpy(dir, ext + 1, l);
+        dl = l;
+      }
+      if (level == 1) {       // レベル1では拡張ヘッダが圧縮サイズに含まれる
+        hsize += next;
+        csize -= next;
+      }
+      ext += next;
+      next = le16(ext - 2);
+    }
+    const uint8_t *data = h + hsize;
+    pos += hsize + csize;
+    if (pos > size)
+      return -1;
+
+    char path[2048];
+    if (dl > 0 && dir[dl - 1] != (char)0xff)
+      dir[dl++] = (char)0xff;
+    memcpy(path, dir, dl);
+    memcpy(path + dl, name, nl);
+
+    int method;
+    switch (h[5]) {
+    case '0': method = ARC_STORED; break;
+    case '5': method = ARC_LH5; break;
+    case '6': method = ARC_LH6; break;
+    case '7': method = ARC_LH7; break;
+    case 'd': method = -1; break;     // ディレクトリ
+    default:
+      DPRINTF1("ARC: unsupported method %.5s %.*s\n", h + 2, (int)nl, name);
+      continue;
+    }
+    if (method == ARC_STORED && csize != usize)
+      continue;
+    // ディレクトリ区切りは0xffまたは'\\'
+    for (size_t i = 0; i < dl + nl; i++) {
+      if (path[i] == (char)0xff)
+        path[i] = '/';
+    }
+    arc_addname(fs, (uint8_t *)path, dl + nl, false, '\\', method < 0, mtime,
+                method, data, csize, usize);
+  }
+  return 0;
+}
+
+//****************************************************************************
+// Decompressed block cache
+//****************************************************************************
+
+static void lru_unlink(arcblk_t *b)
+{
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+}
+
+static void lru_push(arcfs_t *fs, arcblk_t *b)
+{
+  b->prev = &fs->lru;
+  b->next = fs->lru.next;
+  b->next->prev = b;
+  fs->lru.next = b;
+}
+
+// 展開済みブロックを登録し、キャッシュサイズを越えたら古いものから捨てる
+static void blk_insert(arcfs_t *fs, arcnode_t *n, uint32_t index, uint8_t *data, size_t len)
+{
+  while (fs->cached + len > CONFIG_ARCCACHE && fs->lru.prev != &fs->lru) {
+    arcblk_t *b = fs->lru.prev;
+    lru_unlink(b);
+    b->node->blk[b->index] = NULL;
+    fs->cached -= b->len;
+    free(b->data);
+    free(b);
+  }
+  arcblk_t *b = malloc(sizeof(*b));
+  b->node = n;
+  b->index = index;
+  b->data = data;
+  b->len = len;
+  lru_push(fs, b);
+  n->blk[index] = b;
+  fs->cached += len;
+}
+
+// 展開を中止する
+static void arc_stop(arcfile_t *f)
+{
+  if (f->active) {
+    if (f->node->method == ARC_DEFLATE)
+      inflateEnd(&f->z);
+    else
+      lzh_free(f->lzh);
+  }
+  f->active = false;
+  f->outpos = 0;
+}
+
+// 展開を先頭からやり直す
+static int arc_restart(arcfs_t *fs, arcfile_t *f)
+{
+  arcnode_t *n = f->node;
+
+  if (f->active)
+    fs->restarts++;
+  arc_stop(f);
+
+  if (n->method == ARC_DEFLATE) {
+    memset(&f->z, 0, sizeof(f->z));
+    f->z.next_in = (Bytef *)n->data;
+    f->z.avail_in = n->csize;
+    if (inflateInit2(&f->z, -MAX_WBITS) != Z_OK)
+      return -1;
+  } else {
+    if (f->lzh == NULL)
+      f->lzh = malloc(sizeof(lzh_t));
+    static const char *methods[] = { [ARC_LH5] = "-lh5-", [ARC_LH6] = "-lh6-", [ARC_LH7] = "-lh7-" };
+    if (lzh_init(f->lzh, methods[n->method], n->data, n->csize) < 0)
+      return -1;
+  }
+  f->active = true;
+  return 0;
+}
+
+// 展開を続けてlenバイトを得る
+static int arc_inflate(arcfile_t *f, uint8_t *buf, size_t len)
+{
+  if (f->node->method == ARC_DEFLATE) {
+    f->z.next_out = buf;
+    f->z.avail_out = len;
+    while (f->z.avail_out > 0) {
+      int r = inflate(&f->z, Z_NO_FLUSH);
+      if (r == Z_STREAM_END)
+        break;
+      if (r != Z_OK)
+        return -1;
+    }
+    return f->z.avail_out == 0 ? 0 : -1;
+  } else {
+    return lzh_decode(f->lzh, buf, len) == len ? 0 : -1;
+  }
+}
+
+// ファイルのindex番目のブロックを得る
+// キャッシュになければ、そのブロックまで展開を進める
+static arcblk_t *arc_getblk(arcfs_t *fs, int *err, arcfile_t *f, uint32_t index)
+{
+  arcnode_t *n = f->node;
+  off_t target = (off_t)index * CONFIG_ARCBLOCK;
+
+  if (n->blk == NULL)
+    n->blk = calloc((n->size + CONFIG_ARCBLOCK - 1) / CONFIG_ARCBLOCK, sizeof(arcblk_t *));
+  if (n->blk[index]) {
+    fs->hits++;
+    lru_unlink(n->blk[index]);
+    lru_push(fs, n->blk[index]);
+    return n->blk[index];
+  }
+  fs->misses++;
+
+  if (!f->active || f->outpos > target) {
+    if (arc_restart(fs, f) < 0)
+      goto errout;
+  }
+  while (f->outpos <= target) {
+    size_t len = n->size - f->outpos < CONFIG_ARCBLOCK ? n->size - f->outpos : CONFIG_ARCBLOCK;
+    uint8_t *data = malloc(len);
+    if (arc_inflate(f, data, len) < 0) {
+      free(data);
+      arc_stop(f);            // 次の読み込みでは最初からやり直す
+      goto errout;
+    }
+    uint32_t i = f->outpos / CONFIG_ARCBLOCK;
+    f->outpos += len;
+    fs->inflated += len;
+    if (n->blk[i])            // 他のオープンで展開済み
+      free(data);
+    else
+      blk_insert(fs, n, i, data, len);
+  }
+  return n->blk[index];
+
+errout:
+  DPRINTF1("ARC: %s: broken data\n", n->name);
+  if (err)
+    *err = EIO;
+  return NULL;
+}
+
+//****************************************************************************
+// Filesystem operations
+//****************************************************************************
+
+static int arc_mount(vfs_t *v, const char *spec)
+{
+  int err;
+  TYPE_FD fd = FUNC_OPEN(&err, spec, O_RDONLY|O_BINARY);
+  if (fd == FD_BADFD)
+    return -1;
+  TYPE_STAT st;
+  if (FUNC_FSTAT(&err, fd, &st) < 0 || st.st_size < 22) {
+    FUNC_CLOSE(NULL, fd);
+    return -1;
+  }
+
+  arcfs_t *fs = calloc(1, sizeof(*fs));
+  fs->root.name = "";
+  fs->root.mode = S_IFDIR|0555;
+  fs->root.mtime = st.st_mtime;
+  fs->lru.prev = fs->lru.next = &fs->lru;
+  fs->mapsize = st.st_size;
+  fs->map = FUNC_MMAP(&err, fd, fs->mapsize);
+  FUNC_CLOSE(NULL, fd);       // マップした領域はクローズ後も使える
+  if (fs->map == NULL) {
+    free(fs);
+    return -1;
+  }
+
+  const uint8_t *m = fs->map;
+  int r;
+  if (fs->mapsize >= 512 && memcmp(m + 257, "ustar", 5) == 0)
+    r = arc_index_tar(fs);
+  else if (m[2] == '-' && m[3] == 'l' && m[6] == '-')
+    r = arc_index_lzh(fs);
+  else
+    r = arc_index_zip(fs);
+  if (r < 0) {
+    printf("%s: unknown or broken archive\n", spec);
+    FUNC_MUNMAP(fs->map, fs->mapsize);
+    free(fs);
+    return -1;
+  }
+  DPRINTF1("ARC: %s: %d entries\n", spec, fs->nnode);
+  v->base = "";
+  v->priv = fs;
+  return 0;
+}
+
+// パス名に対応するノードを探す
+static arcnode_t *arc_lookup(arcfs_t *fs, int *err, const char *path)
+{
+  arcnode_t *n = &fs->root;
+
+  while (*path) {
+    if (*path == '/') {
+      path++;
+      continue;
+    }
+    size_t l = strcspn(path, "/");
+    const char *elem = path;
+    path += l;
+    if (!S_ISDIR(n->mode)) {
+      if (err)
+        *err = ENOTDIR;
+      return NULL;
+    }
+    if (l == 1 && elem[0] == '.')
+      continue;
+    if (l == 2 && elem[0] == '.' && elem[1] == '.') {
+      n = n->parent ? n->parent : n;
+      continue;
+    }
+    if ((n = arc_find(fs, n, elem, l)) == NULL) {
+      if (err)
+        *err = ENOENT;
+      return NULL;
+    }
+  }
+  return n;
+}
+
+static void arc_fillstat(arcnode_t *n, TYPE_STAT *st)
+{
+  memset(st, 0, sizeof(*st));
+  st->st_mode = n->mode;
+  st->st_size = n->size;
+  st->st_mtime = n->mtime;
+  st->st_ino = n->ino;
+  st->st_nlink = 1;
+}
+
+static int arc_stat(vfs_t *v, int *err, const char *path, TYPE_STAT *st)
+{
+  arcnode_t *n = arc_lookup(v->priv, err, path);
+  if (n == NULL)
+    return -1;
+  arc_fillstat(n, st);
+  return 0;
+}
+
+// 書庫の内容は変更できない
+static int arc_rofs(int *err)
+{
+  if (err)
+    *err = EROFS;
+  return -1;
+}
+
+static int arc_mkdir(vfs_t *v, int *err, const char *path)
+{
+  return arc_rofs(err);
+}
+
+static int arc_rmdir(vfs_t *v, int *err, const char *path)
+{
+  return arc_rofs(err);
+}
+
+static int arc_rename(vfs_t *v, int *err, const char *pathold, const char *pathnew)
+{
+  return arc_rofs(err);
+}
+
+static int arc_unlink(vfs_t *v, int *err, const char *path)
+{
+  return arc_rofs(err);
+}
+
+static int arc_chmod(vfs_t *v, int *err, const char *path, int mode)
+{
+  return arc_rofs(err);
+}
+
+//****************************************************************************
+// Directory operations
+//****************************************************************************
+
+static vfs_dir_t *arc_opendir(vfs_t *v, int *err, const char *path)
+{
+  arcnode_t *n = arc_lookup(v->priv, err, path);
+  if (n == NULL)
+    return NULL;
+  if (!S_ISDIR(n->mode)) {
+    if (err)
+      *err = ENOTDIR;
+    return NULL;
+  }
+  arcdir_t *d = malloc(sizeof(*d));
+  d->cur = n->child;
+  d->dots = 0;
+  return d;
+}
+
+static const char *arc_readdir(vfs_t *v, vfs_dir_t *dir)
+{
+  arcdir_t *d = dir;
+  if (d->dots < 2)
+    return d->dots++ == 0 ? "." : "..";
+  arcnode_t *n = d->cur;
+  if (n == NULL)
+    return NULL;
+  d->cur = n->next;
+  return n->name;
+}
+
+static void arc_closedir(vfs_t *v, vfs_dir_t *dir)
+{
+  free(dir);
+}
+
+//****************************************************************************
+// File operations
+//****************************************************************************
+
+static vfs_file_t *arc_open(vfs_t *v, int *err, const char *path, int flags)
+{
+  if (flags & (O_WRONLY|O_RDWR|O_CREAT|O_TRUNC)) {
+    arc_rofs(err);
+    return NULL;
+  }
+  arcnode_t *n = arc_lookup(v->priv, err, path);
+  if (n == NULL)
+    return NULL;
+  if (S_ISDIR(n->mode)) {
+    if (err)
+      *err = EISDIR;
+    return NULL;
+  }
+  arcfile_t *f = calloc(1, sizeof(*f));
+  f->node = n;
+  return f;
+}
+
+static int arc_close(vfs_t *v, int *err, vfs_file_t *fh)
+{
+  arcfile_t *f = fh;
+  arc_stop(f);
+  free(f->lzh);
+  free(f);
+  return 0;
+}
+
+static ssize_t arc_read(vfs_t *v, int *err, vfs_file_t *fh, void *buf, size_t count, off_t pos,
+                        const void **data)
+{
+  arcfs_t *fs = v->priv;
+  arcfile_t *f = fh;
+  arcnode_t *n = f->node;
+
+  if (data)
+    *data = buf;
+  if (pos >= n->size)
+    return 0;
+  count = n->size - pos < count ? n->size - pos : count;
+
+  if (n->method == ARC_STORED) {
+    // 無圧縮ならマップした書庫から直接送信する
+    if (data)
+      *data = n->data + pos;
+    else
+      memcpy(buf, n->data + pos, count);
+    return count;
+  }
+
+  // 展開済みブロックは送信中に捨てられることがあるのでbufにコピーする
+  size_t done = 0;
+  while (done < count) {
+    off_t p = pos + done;
+    arcblk_t *b = arc_getblk(fs, err, f, p / CONFIG_ARCBLOCK);
+    if (b == NULL)
+      return done > 0 ? done : -1;
+    size_t off = p % CONFIG_ARCBLOCK;
+    size_t l = b->len - off < count - done ? b->len - off : count - done;
+    memcpy((uint8_t *)buf + done, b->data + off, l);
+    done += l;
+  }
+  return done;
+}
+
+static ssize_t arc_write(vfs_t *v, int *err, vfs_file_t *fh, const void *buf, size_t count, off_t pos)
+{
+  return arc_rofs(err);
+}
+
+static int arc_ftruncate(vfs_t *v, int *err, vfs_file_t *fh, off_t length)
+{
+  return arc_rofs(err);
+}
+
+static int arc_fstat(vfs_t *v, int *err, vfs_file_t *fh, TYPE_STAT *st)
+{
+  arc_fillstat(((arcfile_t *)fh)->node, st);
+  return 0;
+}
+
+static int arc_filedate(vfs_t *v, int *err, vfs_file_t *fh, uint16_t time, uint16_t date)
+{
+  return arc_rofs(err);
+}
+
+//****************************************************************************
+// Misc functions
+//****************************************************************************
+
+static int arc_statfs(vfs_t *v, int *err, uint64_t *total, uint64_t *free)
+{
+  arcfs_t *fs = v->priv;
+  *total = fs->mapsize;
+  *free = 0;
+  DPRINTF2("ARC: entries=%d cached=%lu hit=%lu miss=%lu restart=%lu inflated=%llu\n",
+           fs->nnode, (unsigned long)fs->cached, fs->hits, fs->misses, fs->restarts,
+           (unsigned long long)fs->inflated);
+  return 0;
+}
+
+const vfs_ops_t vfs_arc_ops = {
+  .name = "arc",
+  .mount = arc_mount,
+  .stat = arc_stat,
+  .mkdir = arc_mkdir,
+  .rmdir = arc_rmdir,
+  .rename = arc_rename,
+  .unlink = arc_unlink,
+  .chmod = arc_chmod,
+  .opendir = arc_opendir,
+  .readdir = arc_readdir,
+  .closedir = arc_closedir,
+  .open = arc_open,
+  .close = arc_close,
+  .read = arc_read,
+  .write = arc_write,
+  .ftruncate = arc_ftruncate,
+  .fstat = arc_fstat,
+  .filedate = arc_filedate,
+  .statfs = arc_statfs,
+};
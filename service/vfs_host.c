@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2023 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <config.h>
+#include <fileop.h>
+#include "remoteserv.h"
+#include "hostfd.h"
+#include "vfs.h"
+
+//****************************************************************************
+// Host filesystem backend
+//****************************************************************************
+
+// ホストのディレクトリをそのまま使うバックエンド
+// パス名はホストのディレクトリ名を先頭に付けたフルパスになる
+// オープン中のファイルはhostfd_tで管理する
+
+static int host_mount(vfs_t *v, const char *spec)
+{
+  v->base = spec;
+  return 0;
+}
+
+//****************************************************************************
+// Filesystem operations
+//****************************************************************************
+
+static int host_stat(vfs_t *v, int *err, const char *path, TYPE_STAT *st)
+{
+  return FUNC_STAT(err, path, st);
+}
+
+static void host_statv(vfs_t *v, const char **path, TYPE_STAT *st, int *res, int n)
+{
+  FUNC_STATV(path, st, res, n);
+}
+
+static int host_mkdir(vfs_t *v, int *err, const char *path)
+{
+  return FUNC_MKDIR(err, path);
+}
+
+static int host_rmdir(vfs_t *v, int *err, const char *path)
+{
+  return FUNC_RMDIR(err, path);
+}
+
+static int host_rename(vfs_t *v, int *err, const char *pathold, const char *pathnew)
+{
+  hf_invalidate(pathold);
+  hf_invalidate(pathnew);
+  return FUNC_RENAME(err, pathold, pathnew);
+}
+
+static int host_unlink(vfs_t *v, int *err, const char *path)
+{
+  hf_invalidate(path);
+  return FUNC_UNLINK(err, path);
+}
+
+static int host_chmod(vfs_t *v, int *err, const char *path, int mode)
+{
+  return FUNC_CHMOD(err, path, mode);
+}
+
+//****************************************************************************
+// Directory operations
+//****************************************************************************
+
+static vfs_dir_t *host_opendir(vfs_t *v, int *err, const char *path)
+{
+  return FUNC_OPENDIR(err, path);
+}
+
+static const char *host_readdir(vfs_t *v, vfs_dir_t *dir)
+{
+  TYPE_DIRENT *d = FUNC_READDIR(NULL, dir);
+  return d ? DIRENT_NAME(d) : NULL;
+}
+
+static void host_closedir(vfs_t *v, vfs_dir_t *dir)
+{
+  FUNC_CLOSEDIR(NULL, dir);
+}
+
+//****************************************************************************
+// File operations
+//****************************************************************************
+
+static vfs_file_t *host_open(vfs_t *v, int *err, const char *path, int flags)
+{
+  return hf_open(err, path, flags);
+}
+
+static int host_close(vfs_t *v, int *err, vfs_file_t *f)
+{
+  return hf_close(err, f);
+}
+
+static ssize_t host_read(vfs_t *v, int *err, vfs_file_t *f, void *buf, size_t count, off_t pos,
+                         const void **data)
+{
+  return hf_read(err, f, buf, count, pos, data);
+}
+
+static ssize_t host_write(vfs_t *v, int *err, vfs_file_t *f, const void *buf, size_t count, off_t pos)
+{
+  return hf_write(err, f, buf, count, pos);
+}
+
+static int host_ftruncate(vfs_t *v, int *err, vfs_file_t *f, off_t length)
+{
+  return hf_ftruncate(err, f, length);
+}
+
+static int host_fstat(vfs_t *v, int *err, vfs_file_t *f, TYPE_STAT *st)
+{
+  return hf_fstat(err, f, st);
+}
+
+static int host_filedate(vfs_t *v, int *err, vfs_file_t *f, uint16_t time, uint16_t date)
+{
+  return hf_filedate(err, f, time, date);
+}
+
+static void host_prefetch(vfs_t *v, vfs_file_t *f, off_t pos)
+{
+  hf_prefetch(f, pos);
+}
+
+static bool host_mapped(vfs_t *v, vfs_file_t *f)
+{
+  return hf_mapped(f);
+}
+
+static void host_closeall(vfs_t *v)
+{
+  hf_closeall();
+}
+
+//****************************************************************************
+// Misc functions
+//****************************************************************************
+
+static int host_statfs(vfs_t *v, int *err, uint64_t *total, uint64_t *free)
+{
+  return FUNC_STATFS(err, v->base, total, free);
+}
+
+const vfs_ops_t vfs_host_ops = {
+  .name = "host",
+  .mount = host_mount,
+  .stat = host_stat,
+  .statv = host_statv,
+  .mkdir = host_mkdir,
+  .rmdir = host_rmdir,
+  .rename = host_rename,
+  .unlink = host_unlink,
+  .chmod = host_chmod,
+  .opendir = host_opendir,
+  .readdir = host_readdir,
+  .closedir = host_closedir,
+  .open = host_open,
+  .close = host_close,
+  .read = host_read,
+  .write = host_write,
+  .ftruncate = host_ftruncate,
+  .fstat = host_fstat,
+  .filedate = host_filedate,
+  .prefetch = host_prefetch,
+  .mapped = host_mapped,
+  .closeall = host_closeall,
+  .statfs = host_statfs,
+};
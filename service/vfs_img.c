@@ -0,0 +1,1299 @@
+/*
+ * Copyright (c) 2023 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+
+#include <config.h>
+#include <fileop.h>
+#include "remoteserv.h"
+#include "vfs.h"
+
+//****************************************************************************
+// Disk image backend
+//****************************************************************************
+
+// XDF(フロッピーディスク)/HDS(SCSIハードディスク)イメージをルートにするバックエンド
+// ルートディレクトリの指定は "img:<イメージファイル名>"
+// マウント時にBPBとFATを読み込み、ディレクトリツリーを作っておく
+// ファイルの内容はイメージファイルを直接読み書きする
+// ディレクトリエントリの変更はすぐにイメージに書き込むが、FATの変更はメモリ上にためておき、
+// 書き込み中のファイルがなくなった時に変更のあったセクタだけを書き戻す
+//
+// イメージの形式は以下のように判別する (xdftool.pyのDiskFat/DiskDirと同じ構造)
+//  XDF: 先頭セクタの0x0bからリトルエンディアンのBPB (メディアバイトが0xf0未満なら2HDとみなす)
+//  HDS: 先頭が"X68SCSI1"ならSCSIディスクとして、0x800のパーティションテーブル("X68K")から
+//       最初のHuman68kパーティションを使う
+//       パーティション先頭の0x12からビッグエンディアンのBPB、FAT16もビッグエンディアンとする
+
+#define IMG_EOC       0xffff        // クラスタチェーンの終端 (fat_getが返す値)
+
+typedef struct imgnode {
+  char *name;                 // UTF-8のファイル名
+  uint8_t attr;
+  uint16_t time;
+  uint16_t date;
+  uint32_t cls;               // 先頭クラスタ (0なら未割り当て)
+  uint32_t size;
+  off_t entpos;               // ディレクトリエントリのイメージ内の位置 (ルートは-1)
+  int nopen;                  // オープン中の数
+  int gen;                    // クラスタチェーンを変更する度に増やす
+  struct imgnode *parent;
+  struct imgnode *child;      // ディレクトリ内のファイル
+  struct imgnode *next;
+} imgnode_t;
+
+typedef struct {
+  imgnode_t root;
+  TYPE_FD fd;
+  bool readonly;
+  int sectbytes;              // セクタサイズ
+  int nfat;                   // FATの数
+  int nrootdirent;            // ルートディレクトリのエントリ数
+  off_t fatpos;               // FATの位置
+  off_t rootpos;              // ルートディレクトリの位置
+  off_t datapos;              // データ領域の位置 (クラスタ2)
+  uint32_t clsbytes;          // クラスタサイズ
+  uint32_t maxcls;            // 最大クラスタ番号+1
+  bool fat16;
+  bool bigendian;             // FAT16がビッグエンディアン
+  uint8_t *fat;               // FATの内容
+  size_t fatbytes;
+  uint8_t *fatdirty;          // 変更したFATのセクタ
+  bool dirty;
+  int nwriter;                // 書き込みでオープン中のファイル数
+  uint32_t hint;              // 空きクラスタを探し始める位置
+  uint32_t nfree;
+  // statistics
+  unsigned long nflush;
+  unsigned long nsectflush;
+} imgfs_t;
+
+typedef struct {
+  imgnode_t *node;
+  int flags;
+  int gen;                    // curidx/curclsを求めた時のnode->gen
+  uint32_t curidx;            // 最後にアクセスしたクラスタのファイル内の番号
+  uint32_t curcls;
+} imgfile_t;
+
+typedef struct {
+  imgnode_t *cur;
+  int dots;                   // "."と".."を返した数
+} imgdir_t;
+
+//****************************************************************************
+// Local functions
+//****************************************************************************
+
+static inline uint16_t le16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+static inline uint32_t le32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+static inline uint16_t be16(const uint8_t *p)
+{
+  return (p[0] << 8) | p[1];
+}
+static inline uint32_t be32(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static time_t dos2time(uint16_t time, uint16_t date)
+{
+  struct tm tm;
+  tm.tm_sec = (time << 1) & 0x3f;
+  tm.tm_min = (time >> 5) & 0x3f;
+  tm.tm_hour = (time >> 11) & 0x1f;
+  tm.tm_mday = date & 0x1f;
+  tm.tm_mon = ((date >> 5) & 0xf) - 1;
+  tm.tm_year = ((date >> 9) & 0x7f) + 80;
+  tm.tm_isdst = -1;
+  return mktime(&tm);
+}
+
+static void img_touch(imgnode_t *n)
+{
+  time_t t = time(NULL);
+  struct tm *tm = localtime(&t);
+  n->time = (tm->tm_hour << 11) | (tm->tm_min << 5) | (tm->tm_sec >> 1);
+  n->date = ((tm->tm_year - 80) << 9) | ((tm->tm_mon + 1) << 5) | tm->tm_mday;
+}
+
+static inline off_t clspos(imgfs_t *fs, uint32_t cls)
+{
+  return fs->datapos + (off_t)(cls - 2) * fs->clsbytes;
+}
+
+static int img_pread(imgfs_t *fs, int *err, void *buf, size_t count, off_t pos)
+{
+  if (FUNC_PREAD(err, fs->fd, buf, count, pos) != count) {
+    if (err)
+      *err = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+static int img_pwrite(imgfs_t *fs, int *err, const void *buf, size_t count, off_t pos)
+{
+  if (FUNC_PWRITE(err, fs->fd, buf, count, pos) != count) {
+    if (err)
+      *err = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+//****************************************************************************
+// FAT
+//****************************************************************************
+
+// クラスタnのFATエントリを得る (終端ならIMG_EOC)
+static uint32_t fat_get(imgfs_t *fs, uint32_t n)
+{
+  uint32_t v;
+  if (fs->fat16) {
+    const uint8_t *p = &fs->fat[n * 2];
+    v = fs->bigendian ? be16(p) : le16(p);
+    return v >= 0xfff8 ? IMG_EOC : v;
+  } else {
+    const uint8_t *p = &fs->fat[n * 3 / 2];
+    v = (n & 1) ? (p[0] >> 4) | (p[1] << 4) : p[0] | ((p[1] & 0x0f) << 8);
+    return v >= 0xff8 ? IMG_EOC : v;
+  }
+}
+
+static void fat_set(imgfs_t *fs, uint32_t n, uint32_t v)
+{
+  size_t o;
+  if (fs->fat16) {
+    o = n * 2;
+    v &= 0xffff;
+    if (fs->bigendian) {
+      fs->fat[o] = v >> 8;
+      fs->fat[o + 1] = v;
+    } else {
+      fs->fat[o] = v;
+      fs->fat[o + 1] = v >> 8;
+    }
+  } else {
+    o = n * 3 / 2;
+    v &= 0xfff;
+    if (n & 1) {
+      fs->fat[o] = (fs->fat[o] & 0x0f) | (v << 4);
+      fs->fat[o + 1] = v >> 4;
+    } else {
+      fs->fat[o] = v;
+      fs->fat[o + 1] = (fs->fat[o + 1] & 0xf0) | (v >> 8);
+    }
+  }
+  // エントリが2セクタにまたがることがある
+  fs->fatdirty[o / fs->sectbytes] = 1;
+  fs->fatdirty[(o + 1) / fs->sectbytes] = 1;
+  fs->dirty = true;
+}
+
+// 空きクラスタを確保してprevの後につなぐ (prevが0なら新しいチェーン)
+static uint32_t fat_alloc(imgfs_t *fs, int *err, uint32_t prev)
+{
+  for (uint32_t i = 0; i < fs->maxcls - 2; i++) {
+    uint32_t c = fs->hint + i;
+    if (c >= fs->maxcls)
+      c -= fs->maxcls - 2;
+    if (fat_get(fs, c) == 0) {
+      fat_set(fs, c, IMG_EOC);
+      if (prev)
+        fat_set(fs, prev, c);
+      fs->hint = c + 1 < fs->maxcls ? c + 1 : 2;
+      fs->nfree--;
+      return c;
+    }
+  }
+  if (err)
+    *err = ENOSPC;
+  return 0;
+}
+
+// clsから始まるチェーンを解放する
+static void fat_free(imgfs_t *fs, uint32_t cls)
+{
+  for (uint32_t i = 0; cls >= 2 && cls < fs->maxcls && i < fs->maxcls; i++) {
+    uint32_t next = fat_get(fs, cls);
+    fat_set(fs, cls, 0);
+    fs->nfree++;
+    cls = next;
+  }
+}
+
+// 変更したFATのセクタを全てのFATに書き戻す
+static int fat_flush(imgfs_t *fs, int *err)
+{
+  if (!fs->dirty)
+    return 0;
+  size_t nsect = fs->fatbytes / fs->sectbytes;
+  for (size_t s = 0; s < nsect; s++) {
+    if (!fs->fatdirty[s])
+      continue;
+    size_t e = s;
+    while (e < nsect && fs->fatdirty[e])
+      e++;
+    for (int i = 0; i < fs->nfat; i++) {
+      if (img_pwrite(fs, err, &fs->fat[s * fs->sectbytes], (e - s) * fs->sectbytes,
+                     fs->fatpos + i * fs->fatbytes + s * fs->sectbytes) < 0)
+        return -1;
+    }
+    memset(&fs->fatdirty[s], 0, e - s);
+    fs->nsectflush += e - s;
+    s = e;
+  }
+  fs->dirty = false;
+  fs->nflush++;
+  return 0;
+}
+
+// ファイル内のidx番目のクラスタ番号を得る
+// allocがtrueならチェーンを延ばしてでも確保する
+static uint32_t img_cluster(imgfs_t *fs, int *err, imgfile_t *f, uint32_t idx, bool alloc)
+{
+  imgnode_t *n = f->node;
+  uint32_t i = 0;
+  uint32_t c = n->cls;
+
+  if (f->gen == n->gen && f->curcls && f->curidx <= idx) {
+    i = f->curidx;            // 前回の位置から続けてたどる
+    c = f->curcls;
+  }
+  if (c == 0) {
+    if (!alloc || (c = fat_alloc(fs, err, 0)) == 0)
+      goto errout;
+    n->cls = c;
+    n->gen++;
+    i = 0;
+  }
+  for (; i < idx; i++) {
+    uint32_t next = fat_get(fs, c);
+    if (next == IMG_EOC) {
+      if (!alloc || (next = fat_alloc(fs, err, c)) == 0)
+        goto errout;
+    } else if (next < 2 || next >= fs->maxcls) {
+      if (err)
+        *err = EIO;
+      goto errout;
+    }
+    c = next;
+  }
+  f->gen = n->gen;
+  f->curidx = idx;
+  f->curcls = c;
+  return c;
+
+errout:
+  if (err && !alloc)
+    *err = EIO;               // チェーンがファイルサイズより短い
+  return 0;
+}
+
+//****************************************************************************
+// Directory entries
+//****************************************************************************
+
+// ディレクトリの内容を読み込む
+// サブディレクトリの場合は各クラスタの番号を*clistに返す
+static uint8_t *dir_read(imgfs_t *fs, int *err, imgnode_t *dir, size_t *size, uint32_t **clist)
+{
+  uint8_t *data;
+  *clist = NULL;
+  if (dir == &fs->root) {
+    *size = fs->nrootdirent * 32;
+    data = malloc(*size);
+    if (img_pread(fs, err, data, *size, fs->rootpos) < 0) {
+      free(data);
+      return NULL;
+    }
+    return data;
+  }
+
+  size_t ncls = 0;
+  data = NULL;
+  for (uint32_t c = dir->cls; c != IMG_EOC; c = fat_get(fs, c)) {
+    if (c < 2 || c >= fs->maxcls || ncls >= fs->maxcls) {
+      if (err)
+        *err = EIO;
+      goto errout;
+    }
+    data = realloc(data, (ncls + 1) * fs->clsbytes);
+    *clist = realloc(*clist, (ncls + 1) * sizeof(uint32_t));
+    (*clist)[ncls] = c;
+    if (img_pread(fs, err, data + ncls * fs->clsbytes, fs->clsbytes, clspos(fs, c)) < 0)
+      goto errout;
+    ncls++;
+  }
+  *size = ncls * fs->clsbytes;
+  return data;
+
+errout:
+  free(data);
+  free(*clist);
+  *clist = NULL;
+  return NULL;
+}
+
+static inline off_t dir_entpos(imgfs_t *fs, imgnode_t *dir, uint32_t *clist, size_t off)
+{
+  if (dir == &fs->root)
+    return fs->rootpos + off;
+  return clspos(fs, clist[off / fs->clsbytes]) + off % fs->clsbytes;
+}
+
+// ディレクトリエントリのファイル名をUTF-8に変換する
+static void ent_getname(const uint8_t *ent, char *name, size_t len)
+{
+  char sname[8 + 10 + 1 + 3 + 1];
+  int l = 0;
+  memcpy(sname, ent, 8);
+  l = 8;
+  if (ent[12]) {
+    for (int i = 0; i < 10; i++)
+      sname[l++] = ent[12 + i] ? ent[12 + i] : ' ';
+  }
+  while (l > 0 && sname[l - 1] == ' ')
+    l--;
+  if (sname[0] == 0x05)
+    sname[0] = 0xe5;
+  if (memcmp(ent + 8, "   ", 3) != 0) {
+    sname[l++] = '.';
+    for (int i = 0; i < 3 && ent[8 + i] != ' '; i++)
+      sname[l++] = ent[8 + i];
+  }
+
+  char *src = sname;
+  char *dst = name;
+  size_t srclen = l;
+  size_t dstlen = len - 1;
+  if (FUNC_ICONV_S2U(&src, &srclen, &dst, &dstlen) < 0) {
+    memcpy(name, sname, l);     // 変換できなければそのまま使う
+    dst = name + l;
+  }
+  *dst = '\0';
+}
+
+// ファイル名をディレクトリエントリの形式にする
+static int ent_putname(uint8_t *ent, int *err, const char *name)
+{
+  char sname[256];
+  char *src = (char *)name;
+  char *dst = sname;
+  size_t srclen = strlen(name);
+  size_t dstlen = sizeof(sname) - 1;
+  if (FUNC_ICONV_U2S(&src, &srclen, &dst, &dstlen) < 0)
+    goto errout;
+  size_t l = dst - sname;
+  size_t bl = l;
+  size_t el = 0;
+  if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+    for (size_t i = l - 1; i > 0 && i + 4 >= l; i--) {
+      if (sname[i] == '.') {
+        bl = i;
+        el = l - i - 1;
+        break;
+      }
+    }
+  }
+  if (bl == 0 || bl > 18)
+    goto errout;
+
+  memset(ent, ' ', 11);
+  memset(ent + 12, 0, 10);
+  memcpy(ent, sname, bl < 8 ? bl : 8);
+  if (bl > 8)
+    memcpy(ent + 12, sname + 8, bl - 8);
+  memcpy(ent + 8, sname + bl + 1, el);
+  if (ent[0] == 0xe5)
+    ent[0] = 0x05;
+  return 0;
+
+errout:
+  if (err)
+    *err = ENAMETOOLONG;
+  return -1;
+}
+
+// ノードの内容をディレクトリエントリに書き込む
+static int ent_write(imgfs_t *fs, int *err, imgnode_t *n)
+{
+  uint8_t ent[32];
+  if (ent_putname(ent, err, n->name) < 0)
+    return -1;
+  ent[11] = n->attr;
+  ent[22] = n->time;
+  ent[23] = n->time >> 8;
+  ent[24] = n->date;
+  ent[25] = n->date >> 8;
+  ent[26] = n->cls;
+  ent[27] = n->cls >> 8;
+  ent[28] = n->size;
+  ent[29] = n->size >> 8;
+  ent[30] = n->size >> 16;
+  ent[31] = n->size >> 24;
+  return img_pwrite(fs, err, ent, sizeof(ent), n->entpos);
+}
+
+static int ent_delete(imgfs_t *fs, int *err, imgnode_t *n)
+{
+  uint8_t c = 0xe5;
+  return img_pwrite(fs, err, &c, 1, n->entpos);
+}
+
+// ディレクトリの空きエントリを探す (なければディレクトリを延ばす)
+static off_t ent_alloc(imgfs_t *fs, int *err, imgnode_t *dir)
+{
+  size_t size;
+  uint32_t *clist;
+  uint8_t *data = dir_read(fs, err, dir, &size, &clist);
+  if (data == NULL)
+    return -1;
+
+  off_t pos = -1;
+  for (size_t off = 0; off < size; off += 32) {
+    if (data[off] == 0x00 || data[off] == 0xe5) {
+      pos = dir_entpos(fs, dir, clist, off);
+      break;
+    }
+  }
+  if (pos < 0) {
+    if (dir == &fs->root) {
+      if (err)
+        *err = ENOSPC;      // ルートディレクトリは延ばせない
+    } else {
+      uint32_t c = fat_alloc(fs, err, clist[size / fs->clsbytes - 1]);
+      if (c) {
+        uint8_t *zero = calloc(1, fs->clsbytes);
+        if (img_pwrite(fs, err, zero, fs->clsbytes, clspos(fs, c)) == 0)
+          pos = clspos(fs, c);
+        free(zero);
+      }
+    }
+  }
+  free(data);
+  free(clist);
+  return pos;
+}
+
+//****************************************************************************
+// Directory tree
+//****************************************************************************
+
+static imgnode_t *img_newnode(imgnode_t *dir, const char *name)
+{
+  imgnode_t *n = calloc(1, sizeof(*n));
+  n->name = strdup(name);
+  n->parent = dir;
+  imgnode_t **p = &dir->child;  // ディレクトリエントリの順に並べる
+  while (*p)
+    p = &(*p)->next;
+  *p = n;
+  return n;
+}
+
+static void img_detach(imgnode_t *n)
+{
+  for (imgnode_t **p = &n->parent->child; *p; p = &(*p)->next) {
+    if (*p == n) {
+      *p = n->next;
+      break;
+    }
+  }
+  n->parent = NULL;
+  n->next = NULL;
+}
+
+// ツリーから外れていてオープンもされていないノードを解放する
+static void img_release(imgfs_t *fs, imgnode_t *n)
+{
+  if (n->parent || n->nopen > 0)
+    return;
+  fat_free(fs, n->cls);
+  free(n->name);
+  free(n);
+}
+
+// ディレクトリの内容を読み込んでツリーを作る
+static int img_loaddir(imgfs_t *fs, imgnode_t *dir, int depth)
+{
+  size_t size;
+  uint32_t *clist;
+  int err;
+  if (depth > 64)             // ループしているディレクトリ構造
+    return -1;
+  uint8_t *data = dir_read(fs, &err, dir, &size, &clist);
+  if (data == NULL)
+    return -1;
+
+  for (size_t off = 0; off < size && data[off] != 0x00; off += 32) {
+    uint8_t *ent = &data[off];
+    if (ent[0] == 0xe5 || (ent[11] & 0x08) ||
+        memcmp(ent, ".          ", 11) == 0 || memcmp(ent, "..         ", 11) == 0)
+      continue;               // 削除済み、ボリュームラベル、"."と".."
+    char name[256];
+    ent_getname(ent, name, sizeof(name));
+    imgnode_t *n = img_newnode(dir, name);
+    n->attr = ent[11];
+    n->time = le16(ent + 22);
+    n->date = le16(ent + 24);
+    n->cls = le16(ent + 26);
+    n->size = le32(ent + 28);
+    n->entpos = dir_entpos(fs, dir, clist, off);
+    if ((n->attr & 0x10) && n->cls >= 2 && n->cls < fs->maxcls)
+      img_loaddir(fs, n, depth + 1);
+  }
+  free(data);
+  free(clist);
+  return 0;
+}
+
+// パス名に対応するノードを探す
+// parentがNULLでなければ最後の要素を含むディレクトリと最後の要素名を返す
+// (この場合は最後の要素が存在しなくてもディレクトリがあればエラーにしない)
+static imgnode_t *img_lookup(imgfs_t *fs, int *err, const char *path,
+                             imgnode_t **parent, char *name)
+{
+  imgnode_t *dir = &fs->root;
+  imgnode_t *n = dir;
+  char elem[256];
+
+  if (parent)
+    *parent = NULL;
+  while (*path) {
+    if (*path == '/') {
+      path++;
+      continue;
+    }
+    int l = strcspn(path, "/");
+    if (l >= sizeof(elem)) {
+      if (err)
+        *err = ENAMETOOLONG;
+      return NULL;
+    }
+    memcpy(elem, path, l);
+    elem[l] = '\0';
+    path += l;
+
+    if (!(n->attr & 0x10)) {
+      if (err)
+        *err = ENOTDIR;
+      return NULL;
+    }
+    dir = n;
+    if (strcmp(elem, ".") == 0) {
+      continue;
+    } else if (strcmp(elem, "..") == 0) {
+      n = dir->parent ? dir->parent : dir;
+      continue;
+    }
+    for (n = dir->child; n; n = n->next) {
+      if (strcasecmp(n->name, elem) == 0)
+        break;
+    }
+    if (n == NULL) {
+      if (parent && path[strspn(path, "/")] == '\0') {
+        // 最後の要素が存在しない
+        *parent = dir;
+        strcpy(name, elem);
+        return NULL;
+      }
+      if (err)
+        *err = ENOENT;
+      return NULL;
+    }
+  }
+  if (parent && n != &fs->root) {
+    *parent = n->parent;
+    strcpy(name, elem);
+  }
+  return n;
+}
+
+// ディレクトリdirに新しいエントリを作る
+static imgnode_t *img_create(imgfs_t *fs, int *err, imgnode_t *dir, const char *name,
+                             int attr, uint32_t cls)
+{
+  uint8_t ent[32];
+  if (ent_putname(ent, err, name) < 0)
+    return NULL;
+  off_t pos = ent_alloc(fs, err, dir);
+  if (pos < 0)
+    return NULL;
+  imgnode_t *n = img_newnode(dir, name);
+  n->attr = attr;
+  n->cls = cls;
+  n->entpos = pos;
+  img_touch(n);
+  if (ent_write(fs, err, n) < 0) {
+    img_detach(n);
+    n->cls = 0;
+    img_release(fs, n);
+    return NULL;
+  }
+  return n;
+}
+
+static int img_rofs(imgfs_t *fs, int *err)
+{
+  if (!fs->readonly)
+    return 0;
+  if (err)
+    *err = EROFS;
+  return -1;
+}
+
+//****************************************************************************
+// Filesystem operations
+//****************************************************************************
+
+static int img_mount(vfs_t *v, const char *spec)
+{
+  int err;
+  imgfs_t *fs = calloc(1, sizeof(*fs));
+  uint8_t sect[0x400];
+  off_t base = 0;
+
+  fs->fd = FUNC_OPEN(&err, spec, O_RDWR|O_BINARY);
+  if (fs->fd == FD_BADFD) {
+    fs->fd = FUNC_OPEN(&err, spec, O_RDONLY|O_BINARY);
+    fs->readonly = true;
+  }
+  if (fs->fd == FD_BADFD)
+    goto errout_free;
+  if (img_pread(fs, &err, sect, sizeof(sect), 0) < 0)
+    goto errout;
+
+  int reserved;
+  uint32_t nsect;
+  int fatsize;
+  if (memcmp(sect, "X68SCSI1", 8) == 0) {
+    // HDS: 最初のHuman68kパーティションを探す
+    if (img_pread(fs, &err, sect, sizeof(sect), 0x800) < 0 || memcmp(sect, "X68K", 4) != 0)
+      goto errout;
+    int i;
+    for (i = 1; i < 16; i++) {
+      if (memcmp(&sect[i * 16], "Human68k", 8) == 0)
+        break;
+    }
+    if (i >= 16)
+      goto errout;
+    base = (off_t)(be32(&sect[i * 16 + 8]) & 0xffffff) * 1024;
+    if (img_pread(fs, &err, sect, sizeof(sect), base) < 0)
+      goto errout;
+    fs->sectbytes = be16(&sect[0x12]);
+    fs->clsbytes = fs->sectbytes * sect[0x14];
+    fs->nfat = sect[0x15];
+    reserved = be16(&sect[0x16]);
+    fs->nrootdirent = be16(&sect[0x18]);
+    nsect = be16(&sect[0x1a]);
+    fatsize = sect[0x1d];
+    if (nsect == 0)
+      nsect = be32(&sect[0x1e]);
+    fs->bigendian = true;
+  } else if (sect[0x15] >= 0xf0) {
+    // XDF: リトルエンディアンのBPB
+    fs->sectbytes = le16(&sect[0x0b]);
+    fs->clsbytes = fs->sectbytes * sect[0x0d];
+    reserved = le16(&sect[0x0e]);
+    fs->nfat = sect[0x10];
+    fs->nrootdirent = le16(&sect[0x11]);
+    nsect = le16(&sect[0x13]);
+    fatsize = le16(&sect[0x16]);
+  } else {
+    // BPBがなければ2HDとみなす
+    fs->sectbytes = 1024;
+    fs->clsbytes = 1024;
+    reserved = 1;
+    fs->nfat = 2;
+    fs->nrootdirent = 192;
+    nsect = 1232;
+    fatsize = 2;
+  }
+  if (fs->sectbytes < 128 || fs->clsbytes == 0 || fs->nfat == 0 || fatsize == 0)
+    goto errout;
+
+  fs->fatpos = base + (off_t)reserved * fs->sectbytes;
+  fs->fatbytes = (size_t)fatsize * fs->sectbytes;
+  fs->rootpos = fs->fatpos + (off_t)fs->nfat * fs->fatbytes;
+  fs->datapos = fs->rootpos + fs->nrootdirent * 32;
+  uint32_t sndata = reserved + fs->nfat * fatsize + (fs->nrootdirent * 32) / fs->sectbytes;
+  if (nsect <= sndata)
+    goto errout;
+  fs->maxcls = (nsect - sndata) / (fs->clsbytes / fs->sectbytes) + 2;
+  fs->fat16 = fs->maxcls > 4086;
+  // FATに入りきらないクラスタは使わない
+  uint32_t fatent = fs->fat16 ? fs->fatbytes / 2 : fs->fatbytes * 2 / 3;
+  if (fs->maxcls > fatent)
+    fs->maxcls = fatent;
+
+  fs->fat = malloc(fs->fatbytes);
+  fs->fatdirty = calloc(fatsize, 1);
+  if (img_pread(fs, &err, fs->fat, fs->fatbytes, fs->fatpos) < 0)
+    goto errout;
+  for (uint32_t c = 2; c < fs->maxcls; c++) {
+    if (fat_get(fs, c) == 0)
+      fs->nfree++;
+  }
+  fs->hint = 2;
+
+  fs->root.name = "";
+  fs->root.attr = 0x10;
+  fs->root.entpos = -1;
+  if (img_loaddir(fs, &fs->root, 0) < 0)
+    goto errout;
+
+  DPRINTF1("IMG: %s: %s FAT%d %u clusters (%u bytes) free=%u%s\n", spec,
+           base ? "HDS" : "XDF", fs->fat16 ? 16 : 12, fs->maxcls - 2, fs->clsbytes,
+           fs->nfree, fs->readonly ? " (read only)" : "");
+  v->base = "";
+  v->priv = fs;
+  return 0;
+
+errout:
+  printf("%s: unknown or broken disk image\n", spec);
+  FUNC_CLOSE(NULL, fs->fd);
+errout_free:
+  free(fs->fat);
+  free(fs->fatdirty);
+  free(fs);
+  return -1;
+}
+
+static void img_fillstat(imgnode_t *n, TYPE_STAT *st)
+{
+  memset(st, 0, sizeof(*st));
+  st->st_mode = (n->attr & 0x10) ? S_IFDIR|0777 : S_IFREG|0666;
+  if (n->attr & 0x01)
+    st->st_mode &= ~(S_IWUSR|S_IWGRP|S_IWOTH);
+  st->st_size = n->size;
+  st->st_mtime = n->parent ? dos2time(n->time, n->date) : 0;
+  st->st_ino = n->entpos;
+  st->st_nlink = 1;
+}
+
+static int img_stat(vfs_t *v, int *err, const char *path, TYPE_STAT *st)
+{
+  imgnode_t *n = img_lookup(v->priv, err, path, NULL, NULL);
+  if (n == NULL)
+    return -1;
+  img_fillstat(n, st);
+  return 0;
+}
+
+static int img_mkdir(vfs_t *v, int *err, const char *path)
+{
+  imgfs_t *fs = v->priv;
+  imgnode_t *dir;
+  char name[256];
+  if (img_rofs(fs, err) < 0)
+    return -1;
+  if (img_lookup(fs, err, path, &dir, name)) {
+    if (err)
+      *err = EEXIST;
+    return -1;
+  }
+  if (dir == NULL)
+    return -1;
+
+  uint32_t c = fat_alloc(fs, err, 0);
+  if (c == 0)
+    return -1;
+  imgnode_t *n = img_create(fs, err, dir, name, 0x10, c);
+  if (n == NULL) {
+    fat_free(fs, c);
+    return -1;
+  }
+  // "."と".."だけのディレクトリを作る
+  uint8_t *data = calloc(1, fs->clsbytes);
+  memset(data, ' ', 11);
+  memset(data + 32, ' ', 11);
+  data[0] = data[32] = data[33] = '.';
+  data[11] = data[32 + 11] = 0x10;
+  for (int i = 0; i < 2; i++) {
+    uint8_t *ent = data + i * 32;
+    uint32_t cls = i == 0 ? c : dir->cls;
+    ent[22] = n->time;
+    ent[23] = n->time >> 8;
+    ent[24] = n->date;
+    ent[25] = n->date >> 8;
+    ent[26] = cls;
+    ent[27] = cls >> 8;
+  }
+  int r = img_pwrite(fs, err, data, fs->clsbytes, clspos(fs, c));
+  free(data);
+  if (fs->nwriter == 0)
+    fat_flush(fs, NULL);
+  return r;
+}
+
+static int img_rmdir(vfs_t *v, int *err, const char *path)
+{
+  imgfs_t *fs = v->priv;
+  if (img_rofs(fs, err) < 0)
+    return -1;
+  imgnode_t *n = img_lookup(fs, err, path, NULL, NULL);
+  if (n == NULL)
+    return -1;
+  int e = !(n->attr & 0x10) ? ENOTDIR :
+          n == &fs->root ? EBUSY :
+          n->child ? ENOTEMPTY : 0;
+  if (e) {
+    if (err)
+      *err = e;
+    return -1;
+  }
+  if (ent_delete(fs, err, n) < 0)
+    return -1;
+  img_detach(n);
+  img_release(fs, n);
+  if (fs->nwriter == 0)
+    fat_flush(fs, NULL);
+  return 0;
+}
+
+static int img_rename(vfs_t *v, int *err, const char *pathold, const char *pathnew)
+{
+  imgfs_t *fs = v->priv;
+  if (img_rofs(fs, err) < 0)
+    return -1;
+  imgnode_t *n = img_lookup(fs, err, pathold, NULL, NULL);
+  if (n == NULL)
+    return -1;
+  if (n == &fs->root) {
+    if (err)
+      *err = EBUSY;
+    return -1;
+  }
+  imgnode_t *dir;
+  char name[256];
+  imgnode_t *t = img_lookup(fs, err, pathnew, &dir, name);
+  if (dir == NULL)
+    return -1;
+  if (t && t != n) {
+    if (err)
+      *err = EEXIST;
+    return -1;
+  }
+  for (imgnode_t *d = dir; d; d = d->parent) {
+    if (d == n) {             // 自分の下には移動できない
+      if (err)
+        *err = EINVAL;
+      return -1;
+    }
+  }
+
+  uint8_t ent[32];
+  if (ent_putname(ent, err, name) < 0)
+    return -1;
+  char *oldname = n->name;
+  n->name = strdup(name);
+  if (dir == n->parent) {     // 同じディレクトリ内ならエントリを書き換える
+    if (ent_write(fs, err, n) < 0)
+      goto errout;
+    free(oldname);
+    return 0;
+  }
+
+  // 移動先のディレクトリにエントリを作って元のエントリを消す
+  off_t oldpos = n->entpos;
+  off_t pos = ent_alloc(fs, err, dir);
+  if (pos < 0)
+    goto errout;
+  n->entpos = pos;
+  if (ent_write(fs, err, n) < 0) {
+    n->entpos = oldpos;
+    goto errout;
+  }
+  uint8_t c = 0xe5;
+  img_pwrite(fs, NULL, &c, 1, oldpos);
+  img_detach(n);
+  n->parent = dir;
+  imgnode_t **p = &dir->child;
+  while (*p)
+    p = &(*p)->next;
+  *p = n;
+  if ((n->attr & 0x10) && n->cls) {   // ".."の指すクラスタを変える
+    uint8_t cls[2] = { dir->cls, dir->cls >> 8 };
+    img_pwrite(fs, NULL, cls, 2, clspos(fs, n->cls) + 32 + 26);
+  }
+  free(oldname);
+  if (fs->nwriter == 0)
+    fat_flush(fs, NULL);
+  return 0;
+
+errout:
+  free(n->name);
+  n->name = oldname;
+  return -1;
+}
+
+static int img_unlink(vfs_t *v, int *err, const char *path)
+{
+  imgfs_t *fs = v->priv;
+  if (img_rofs(fs, err) < 0)
+    return -1;
+  imgnode_t *n = img_lookup(fs, err, path, NULL, NULL);
+  if (n == NULL)
+    return -1;
+  if (n->attr & 0x10) {
+    if (err)
+      *err = EISDIR;
+    return -1;
+  }
+  if (ent_delete(fs, err, n) < 0)
+    return -1;
+  img_detach(n);
+  img_release(fs, n);         // オープン中ならクローズ時に解放する
+  if (fs->nwriter == 0)
+    fat_flush(fs, NULL);
+  return 0;
+}
+
+static int img_chmod(vfs_t *v, int *err, const char *path, int mode)
+{
+  imgfs_t *fs = v->priv;
+  if (img_rofs(fs, err) < 0)
+    return -1;
+  imgnode_t *n = img_lookup(fs, err, path, NULL, NULL);
+  if (n == NULL)
+    return -1;
+  if (n == &fs->root)
+    return 0;
+  if (mode & S_IWUSR)
+    n->attr &= ~0x01;
+  else
+    n->attr |= 0x01;
+  return ent_write(fs, err, n);
+}
+
+//****************************************************************************
+// Directory operations
+//****************************************************************************
+
+static vfs_dir_t *img_opendir(vfs_t *v, int *err, const char *path)
+{
+  imgnode_t *n = img_lookup(v->priv, err, path, NULL, NULL);
+  if (n == NULL)
+    return NULL;
+  if (!(n->attr & 0x10)) {
+    if (err)
+      *err = ENOTDIR;
+    return NULL;
+  }
+  imgdir_t *d = malloc(sizeof(*d));
+  d->cur = n->child;
+  d->dots = 0;
+  return d;
+}
+
+static const char *img_readdir(vfs_t *v, vfs_dir_t *dir)
+{
+  imgdir_t *d = dir;
+  if (d->dots < 2)
+    return d->dots++ == 0 ? "." : "..";
+  imgnode_t *n = d->cur;
+  if (n == NULL)
+    return NULL;
+  d->cur = n->next;
+  return n->name;
+}
+
+static void img_closedir(vfs_t *v, vfs_dir_t *dir)
+{
+  free(dir);
+}
+
+//****************************************************************************
+// File operations
+//****************************************************************************
+
+// ファイルの長さをlengthにする (延ばした部分は0で埋める)
+static int img_resize(imgfs_t *fs, int *err, imgfile_t *f, uint32_t length)
+{
+  imgnode_t *n = f->node;
+  uint32_t ncls = (length + fs->clsbytes - 1) / fs->clsbytes;
+
+  if (length < n->size) {
+    if (ncls == 0) {
+      fat_free(fs, n->cls);
+      n->cls = 0;
+    } else {
+      uint32_t c = img_cluster(fs, err, f, ncls - 1, false);
+      if (c == 0)
+        return -1;
+      fat_free(fs, fat_get(fs, c));
+      fat_set(fs, c, IMG_EOC);
+    }
+    n->gen++;
+  } else if (length > n->size) {
+    uint8_t *zero = calloc(1, fs->clsbytes);
+    for (uint32_t pos = n->size; pos < length; ) {
+      uint32_t c = img_cluster(fs, err, f, pos / fs->clsbytes, true);
+      uint32_t off = pos % fs->clsbytes;
+      uint32_t l = fs->clsbytes - off < length - pos ? fs->clsbytes - off : length - pos;
+      if (c == 0 || img_pwrite(fs, err, zero, l, clspos(fs, c) + off) < 0) {
+        free(zero);
+        return -1;
+      }
+      pos += l;
+      n->size = pos;
+    }
+    free(zero);
+  }
+  n->size = length;
+  return 0;
+}
+
+static vfs_file_t *img_open(vfs_t *v, int *err, const char *path, int flags)
+{
+  imgfs_t *fs = v->priv;
+  imgnode_t *dir;
+  char name[256];
+  imgnode_t *n = img_lookup(fs, err, path, &dir, name);
+
+  if ((flags & (O_WRONLY|O_RDWR|O_CREAT|O_TRUNC)) && img_rofs(fs, err) < 0)
+    return NULL;
+  if (n && (flags & (O_CREAT|O_EXCL)) == (O_CREAT|O_EXCL)) {
+    if (err)
+      *err = EEXIST;
+    return NULL;
+  }
+  if (n == NULL) {
+    if (dir == NULL)
+      return NULL;
+    if (!(flags & O_CREAT)) {
+      if (err)
+        *err = ENOENT;
+      return NULL;
+    }
+    if ((n = img_create(fs, err, dir, name, 0x20, 0)) == NULL)
+      return NULL;
+  }
+  if (n->attr & 0x10) {
+    if (err)
+      *err = EISDIR;
+    return NULL;
+  }
+  if ((flags & (O_WRONLY|O_RDWR)) && (n->attr & 0x01)) {
+    if (err)
+      *err = EACCES;
+    return NULL;
+  }
+
+  imgfile_t *f = calloc(1, sizeof(*f));
+  f->node = n;
+  f->flags = flags;
+  if ((flags & O_TRUNC) && n->size > 0) {
+    img_resize(fs, NULL, f, 0);
+    img_touch(n);
+    ent_write(fs, NULL, n);
+  }
+  if (flags & (O_WRONLY|O_RDWR))
+    fs->nwriter++;
+  n->nopen++;
+  return f;
+}
+
+static int img_close(vfs_t *v, int *err, vfs_file_t *fh)
+{
+  imgfs_t *fs = v->priv;
+  imgfile_t *f = fh;
+  imgnode_t *n = f->node;
+  int r = 0;
+
+  if (f->flags & (O_WRONLY|O_RDWR)) {
+    if (n->parent)
+      r = ent_write(fs, err, n);
+    fs->nwriter--;
+  }
+  n->nopen--;
+  img_release(fs, n);
+  free(f);
+  // 書き込み中のファイルがなくなったらFATを書き戻す
+  if (fs->nwriter == 0 && fat_flush(fs, r < 0 ? NULL : err) < 0)
+    r = -1;
+  return r;
+}
+
+static ssize_t img_read(vfs_t *v, int *err, vfs_file_t *fh, void *buf, size_t count, off_t pos,
+                        const void **data)
+{
+  imgfs_t *fs = v->priv;
+  imgfile_t *f = fh;
+  imgnode_t *n = f->node;
+  if (data)
+    *data = buf;
+  if (f->flags & O_WRONLY) {
+    if (err)
+      *err = EBADF;
+    return -1;
+  }
+  if (pos >= n->size)
+    return 0;
+  count = n->size - pos < count ? n->size - pos : count;
+
+  size_t done = 0;
+  while (done < count) {
+    uint32_t p = pos + done;
+    uint32_t c = img_cluster(fs, err, f, p / fs->clsbytes, false);
+    if (c == 0)
+      return done > 0 ? done : -1;
+    // 連続したクラスタはまとめて読む
+    uint32_t c0 = c;
+    uint32_t off = p % fs->clsbytes;
+    size_t l = fs->clsbytes - off;
+    while (l < count - done && fat_get(fs, c) == c + 1) {
+      c = img_cluster(fs, NULL, f, f->curidx + 1, false);
+      l += fs->clsbytes;
+    }
+    l = l < count - done ? l : count - done;
+    if (img_pread(fs, err, (uint8_t *)buf + done, l, clspos(fs, c0) + off) < 0)
+      return done > 0 ? done : -1;
+    done += l;
+  }
+  return done;
+}
+
+static ssize_t img_write(vfs_t *v, int *err, vfs_file_t *fh, const void *buf, size_t count, off_t pos)
+{
+  imgfs_t *fs = v->priv;
+  imgfile_t *f = fh;
+  imgnode_t *n = f->node;
+  if (!(f->flags & (O_WRONLY|O_RDWR))) {
+    if (err)
+      *err = EBADF;
+    return -1;
+  }
+  if ((uint64_t)pos + count > 0xffffffff) {
+    if (err)
+      *err = EFBIG;
+    return -1;
+  }
+  if (pos > n->size && img_resize(fs, err, f, pos) < 0)
+    return -1;
+  img_touch(n);
+
+  size_t done = 0;
+  while (done < count) {
+    uint32_t p = pos + done;
+    uint32_t c = img_cluster(fs, err, f, p / fs->clsbytes, true);
+    if (c == 0)
+      break;
+    uint32_t off = p % fs->clsbytes;
+    size_t l = fs->clsbytes - off < count - done ? fs->clsbytes - off : count - done;
+    if (img_pwrite(fs, err, (const uint8_t *)buf + done, l, clspos(fs, c) + off) < 0)
+      break;
+    done += l;
+    if (p + l > n->size)
+      n->size = p + l;
+  }
+  return done > 0 || count == 0 ? done : -1;
+}
+
+static int img_ftruncate(vfs_t *v, int *err, vfs_file_t *fh, off_t length)
+{
+  imgfile_t *f = fh;
+  if (!(f->flags & (O_WRONLY|O_RDWR))) {
+    if (err)
+      *err = EBADF;
+    return -1;
+  }
+  img_touch(f->node);
+  return img_resize(v->priv, err, f, length);
+}
+
+static int img_fstat(vfs_t *v, int *err, vfs_file_t *fh, TYPE_STAT *st)
+{
+  img_fillstat(((imgfile_t *)fh)->node, st);
+  return 0;
+}
+
+static int img_filedate(vfs_t *v, int *err, vfs_file_t *fh, uint16_t time, uint16_t date)
+{
+  imgfs_t *fs = v->priv;
+  imgnode_t *n = ((imgfile_t *)fh)->node;
+  if (img_rofs(fs, err) < 0)
+    return -1;
+  n->time = time;
+  n->date = date;
+  return n->parent ? ent_write(fs, err, n) : 0;
+}
+
+static void img_closeall(vfs_t *v)
+{
+  fat_flush(v->priv, NULL);
+}
+
+//****************************************************************************
+// Misc functions
+//****************************************************************************
+
+static int img_statfs(vfs_t *v, int *err, uint64_t *total, uint64_t *free)
+{
+  imgfs_t *fs = v->priv;
+  *total = (uint64_t)(fs->maxcls - 2) * fs->clsbytes;
+  *free = (uint64_t)fs->nfree * fs->clsbytes;
+  DPRINTF2("IMG: free=%u/%u flush=%lu (%lu sectors)%s\n",
+           fs->nfree, fs->maxcls - 2, fs->nflush, fs->nsectflush, fs->dirty ? " dirty" : "");
+  return 0;
+}
+
+const vfs_ops_t vfs_img_ops = {
+  .name = "img",
+  .mount = img_mount,
+  .stat = img_stat,
+  .mkdir = img_mkdir,
+  .rmdir = img_rmdir,
+  .rename = img_rename,
+  .unlink = img_unlink,
+  .chmod = img_chmod,
+  .opendir = img_opendir,
+  .readdir = img_readdir,
+  .closedir = img_closedir,
+  .open = img_open,
+  .close = img_close,
+  .read = img_read,
+  .write = img_write,
+  .ftruncate = img_ftruncate,
+  .fstat = img_fstat,
+  .filedate = img_filedate,
+  .closeall = img_closeall,
+  .statfs = img_statfs,
+};
@@ -0,0 +1,562 @@
+/*
+ * Copyright (c) 2023 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <zlib.h>
+
+#include <config.h>
+#include <fileop.h>
+#include "remoteserv.h"
+#include "vfs.h"
+
+//****************************************************************************
+// Pack file backend
+//****************************************************************************
+
+// packtool.pyで作成したパックファイルを読み込み専用のルートにするバックエンド
+// ルートディレクトリの指定は "pack:<パックファイル名>"
+// パックファイル全体をメモリにマップし、エントリ表を二分探索してファイルを探す
+// ファイルの内容は独立に圧縮したブロック単位で格納されていて、
+// 無圧縮のブロックはマップした領域から直接送信する
+// 圧縮されたブロックは1ブロックだけ展開すればよいので、展開結果をキャッシュしておく
+// (パックファイルの形式はpacktool.pyを参照)
+
+#define PACK_MAGIC    "X68KPACK"
+#define PACK_VERSION  1
+#define PACK_NOPARENT 0xffffffff
+
+#define PACK_ATTR_RDONLY  0x01
+#define PACK_ATTR_DIR     0x10
+
+typedef struct __attribute__((packed)) {
+  char magic[8];
+  uint16_t version;
+  uint16_t flags;
+  uint32_t blocksize;
+  uint32_t nent;
+  uint32_t nblk;
+  uint32_t blkofs;            // ブロック表の位置
+  uint32_t nameofs;           // 名前表の位置
+} packhdr_t;
+
+typedef struct __attribute__((packed)) {
+  uint32_t name;              // 名前表内の位置
+  uint32_t parent;            // 親ディレクトリのエントリ番号
+  uint32_t mtime;
+  uint32_t size;              // ファイルサイズ (ディレクトリなら最初の子エントリの番号)
+  uint32_t block;             // 最初のブロック番号 (ディレクトリなら子エントリの数)
+  uint8_t attr;
+  uint8_t reserved[3];
+} packent_t;
+
+typedef struct __attribute__((packed)) {
+  uint32_t offset;
+  uint32_t csize;             // 圧縮後のサイズ (元のサイズと同じなら無圧縮)
+} packblk_t;
+
+typedef struct packcache {
+  uint32_t index;
+  uint8_t *data;
+  struct packcache *prev;     // LRUリスト
+  struct packcache *next;
+} packcache_t;
+
+typedef struct {
+  uint8_t *map;               // パックファイル全体をマップした領域
+  size_t mapsize;
+  const packent_t *ent;
+  const packblk_t *blk;
+  const char *names;
+  uint32_t nent;
+  uint32_t nblk;
+  uint32_t blocksize;
+  packcache_t **cache;        // ブロック毎の展開済みデータ (未展開ならNULL)
+  packcache_t lru;            // 展開済みブロックのLRUリスト (先頭が最新)
+  size_t cached;
+  // statistics
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long lookups;
+  unsigned long probes;
+} packfs_t;
+
+typedef struct {
+  uint32_t index;             // エントリ番号
+} packfile_t;
+
+typedef struct {
+  uint32_t cur;
+  uint32_t end;
+  int dots;                   // "."と".."を返した数
+} packdir_t;
+
+//****************************************************************************
+// Local functions
+//****************************************************************************
+
+#define ENT_NAME(fs, e)     ((fs)->names + be32toh((e)->name))
+#define ENT_ISDIR(e)        ((e)->attr & PACK_ATTR_DIR)
+
+// ディレクトリdir内の名前nameのエントリを二分探索する
+static const packent_t *pack_find(packfs_t *fs, const packent_t *dir, const char *name)
+{
+  uint32_t lo = be32toh(dir->size);
+  uint32_t hi = lo + be32toh(dir->block);
+
+  fs->lookups++;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    const packent_t *e = &fs->ent[mid];
+    fs->probes++;
+    int r = strcasecmp(name, ENT_NAME(fs, e));
+    if (r == 0)
+      return e;
+    if (r < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return NULL;
+}
+
+// パス名に対応するエントリを探す
+static const packent_t *pack_lookup(packfs_t *fs, int *err, const char *path)
+{
+  const packent_t *e = &fs->ent[0];
+  char elem[256];
+
+  while (*path) {
+    if (*path == '/') {
+      path++;
+      continue;
+    }
+    int l = strcspn(path, "/");
+    if (l >= sizeof(elem)) {
+      if (err)
+        *err = ENAMETOOLONG;
+      return NULL;
+    }
+    memcpy(elem, path, l);
+    elem[l] = '\0';
+    path += l;
+
+    if (!ENT_ISDIR(e)) {
+      if (err)
+        *err = ENOTDIR;
+      return NULL;
+    }
+    if (strcmp(elem, ".") == 0)
+      continue;
+    if (strcmp(elem, "..") == 0) {
+      if (be32toh(e->parent) != PACK_NOPARENT)
+        e = &fs->ent[be32toh(e->parent)];
+      continue;
+    }
+    if ((e = pack_find(fs, e, elem)) == NULL) {
+      if (err)
+        *err = ENOENT;
+      return NULL;
+    }
+  }
+  return e;
+}
+
+static void pack_fillstat(packfs_t *fs, const packent_t *e, TYPE_STAT *st)
+{
+  memset(st, 0, sizeof(*st));
+  st->st_mode = ENT_ISDIR(e) ? S_IFDIR|0555 : S_IFREG|0444;
+  st->st_size = ENT_ISDIR(e) ? 0 : be32toh(e->size);
+  st->st_mtime = be32toh(e->mtime);
+  st->st_ino = e - fs->ent;
+  st->st_nlink = 1;
+}
+
+// マウント時にパックファイルの内容が正しいか確認する
+static int pack_check(packfs_t *fs)
+{
+  const packhdr_t *h = (const packhdr_t *)fs->map;
+  if (fs->mapsize < sizeof(*h) || memcmp(h->magic, PACK_MAGIC, 8) != 0 ||
+      be16toh(h->version) != PACK_VERSION)
+    return -1;
+  fs->blocksize = be32toh(h->blocksize);
+  fs->nent = be32toh(h->nent);
+  fs->nblk = be32toh(h->nblk);
+  uint64_t blkofs = be32toh(h->blkofs);
+  uint64_t nameofs = be32toh(h->nameofs);
+  if (fs->blocksize == 0 || fs->nent == 0 ||
+      sizeof(*h) + (uint64_t)fs->nent * sizeof(packent_t) > blkofs ||
+      blkofs + (uint64_t)fs->nblk * sizeof(packblk_t) > nameofs ||
+      nameofs >= fs->mapsize)
+    return -1;
+  fs->ent = (const packent_t *)(fs->map + sizeof(*h));
+  fs->blk = (const packblk_t *)(fs->map + blkofs);
+  fs->names = (const char *)(fs->map + nameofs);
+
+  for (uint32_t i = 0; i < fs->nent; i++) {
+    const packent_t *e = &fs->ent[i];
+    uint64_t a = be32toh(e->size);
+    uint64_t b = be32toh(e->block);
+    if (nameofs + be32toh(e->name) >= fs->mapsize ||
+        memchr(ENT_NAME(fs, e), '\0', fs->mapsize - nameofs - be32toh(e->name)) == NULL)
+      return -1;
+    if (ENT_ISDIR(e) ? a + b > fs->nent
+                     : b + (a + fs->blocksize - 1) / fs->blocksize > fs->nblk)
+      return -1;
+    // 親を持たないのはルートディレクトリ(ent[0])だけ
+    uint32_t p = be32toh(e->parent);
+    if (i == 0 ? p != PACK_NOPARENT
+               : p == PACK_NOPARENT || p >= fs->nent || !ENT_ISDIR(&fs->ent[p]))
+      return -1;
+  }
+  for (uint32_t i = 0; i < fs->nblk; i++) {
+    if ((uint64_t)be32toh(fs->blk[i].offset) + be32toh(fs->blk[i].csize) > fs->mapsize ||
+        be32toh(fs->blk[i].csize) > fs->blocksize)
+      return -1;
+  }
+  return ENT_ISDIR(&fs->ent[0]) ? 0 : -1;
+}
+
+//****************************************************************************
+// Decompressed block cache
+//****************************************************************************
+
+static void lru_unlink(packcache_t *c)
+{
+  c->prev->next = c->next;
+  c->next->prev = c->prev;
+}
+
+static void lru_push(packfs_t *fs, packcache_t *c)
+{
+  c->prev = &fs->lru;
+  c->next = fs->lru.next;
+  c->next->prev = c;
+  fs->lru.next = c;
+}
+
+// index番目のブロックを展開したデータを得る
+static const uint8_t *pack_getblk(packfs_t *fs, int *err, uint32_t index, size_t len)
+{
+  packcache_t *c = fs->cache[index];
+  if (c) {
+    fs->hits++;
+    lru_unlink(c);
+    lru_push(fs, c);
+    return c->data;
+  }
+  fs->misses++;
+
+  uint8_t *data = malloc(len);
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  z.next_in = fs->map + be32toh(fs->blk[index].offset);
+  z.avail_in = be32toh(fs->blk[index].csize);
+  z.next_out = data;
+  z.avail_out = len;
+  if (inflateInit2(&z, -MAX_WBITS) != Z_OK) {
+    free(data);
+    goto errout;
+  }
+  int r = inflate(&z, Z_FINISH);
+  inflateEnd(&z);
+  if (r != Z_STREAM_END || z.avail_out != 0) {
+    free(data);
+    goto errout;
+  }
+
+  while (fs->cached + len > CONFIG_ARCCACHE && fs->lru.prev != &fs->lru) {
+    packcache_t *old = fs->lru.prev;
+    lru_unlink(old);
+    fs->cache[old->index] = NULL;
+    fs->cached -= fs->blocksize;
+    free(old->data);
+    free(old);
+  }
+  c = malloc(sizeof(*c));
+  c->index = index;
+  c->data = data;
+  lru_push(fs, c);
+  fs->cache[index] = c;
+  fs->cached += fs->blocksize;
+  return data;
+
+errout:
+  DPRINTF1("PACK: block %u: broken data\n", index);
+  if (err)
+    *err = EIO;
+  return NULL;
+}
+
+//****************************************************************************
+// Filesystem operations
+//****************************************************************************
+
+static int pack_mount(vfs_t *v, const char *spec)
+{
+  int err;
+  TYPE_FD fd = FUNC_OPEN(&err, spec, O_RDONLY|O_BINARY);
+  if (fd == FD_BADFD)
+    return -1;
+  TYPE_STAT st;
+  if (FUNC_FSTAT(&err, fd, &st) < 0 || st.st_size < sizeof(packhdr_t)) {
+    FUNC_CLOSE(NULL, fd);
+    return -1;
+  }
+
+  packfs_t *fs = calloc(1, sizeof(*fs));
+  fs->mapsize = st.st_size;
+  fs->map = FUNC_MMAP(&err, fd, fs->mapsize);
+  FUNC_CLOSE(NULL, fd);       // マップした領域はクローズ後も使える
+  if (fs->map == NULL) {
+    free(fs);
+    return -1;
+  }
+  if (pack_check(fs) < 0) {
+    printf("%s: unknown or broken pack file\n", spec);
+    FUNC_MUNMAP(fs->map, fs->mapsize);
+    free(fs);
+    return -1;
+  }
+  fs->cache = calloc(fs->nblk, sizeof(packcache_t *));
+  fs->lru.prev = fs->lru.next = &fs->lru;
+  DPRINTF1("PACK: %s: %u entries %u blocks\n", spec, fs->nent, fs->nblk);
+  v->base = "";
+  v->priv = fs;
+  return 0;
+}
+
+static int pack_stat(vfs_t *v, int *err, const char *path, TYPE_STAT *st)
+{
+  const packent_t *e = pack_lookup(v->priv, err, path);
+  if (e == NULL)
+    return -1;
+  pack_fillstat(v->priv, e, st);
+  return 0;
+}
+
+// パックファイルの内容は変更できない
+static int pack_rofs(int *err)
+{
+  if (err)
+    *err = EROFS;
+  return -1;
+}
+
+static int pack_mkdir(vfs_t *v, int *err, const char *path)
+{
+  return pack_rofs(err);
+}
+
+static int pack_rmdir(vfs_t *v, int *err, const char *path)
+{
+  return pack_rofs(err);
+}
+
+static int pack_rename(vfs_t *v, int *err, const char *pathold, const char *pathnew)
+{
+  return pack_rofs(err);
+}
+
+static int pack_unlink(vfs_t *v, int *err, const char *path)
+{
+  return pack_rofs(err);
+}
+
+static int pack_chmod(vfs_t *v, int *err, const char *path, int mode)
+{
+  return pack_rofs(err);
+}
+
+//****************************************************************************
+// Directory operations
+//****************************************************************************
+
+static vfs_dir_t *pack_opendir(vfs_t *v, int *err, const char *path)
+{
+  const packent_t *e = pack_lookup(v->priv, err, path);
+  if (e == NULL)
+    return NULL;
+  if (!ENT_ISDIR(e)) {
+    if (err)
+      *err = ENOTDIR;
+    return NULL;
+  }
+  packdir_t *d = malloc(sizeof(*d));
+  d->cur = be32toh(e->size);
+  d->end = d->cur + be32toh(e->block);
+  d->dots = 0;
+  return d;
+}
+
+static const char *pack_readdir(vfs_t *v, vfs_dir_t *dir)
+{
+  packfs_t *fs = v->priv;
+  packdir_t *d = dir;
+  if (d->dots < 2)
+    return d->dots++ == 0 ? "." : "..";
+  if (d->cur >= d->end)
+    return NULL;
+  return ENT_NAME(fs, &fs->ent[d->cur++]);
+}
+
+static void pack_closedir(vfs_t *v, vfs_dir_t *dir)
+{
+  free(dir);
+}
+
+//****************************************************************************
+// File operations
+//****************************************************************************
+
+static vfs_file_t *pack_open(vfs_t *v, int *err, const char *path, int flags)
+{
+  packfs_t *fs = v->priv;
+  if (flags & (O_WRONLY|O_RDWR|O_CREAT|O_TRUNC)) {
+    pack_rofs(err);
+    return NULL;
+  }
+  const packent_t *e = pack_lookup(fs, err, path);
+  if (e == NULL)
+    return NULL;
+  if (ENT_ISDIR(e)) {
+    if (err)
+      *err = EISDIR;
+    return NULL;
+  }
+  packfile_t *f = malloc(sizeof(*f));
+  f->index = e - fs->ent;
+  return f;
+}
+
+static int pack_close(vfs_t *v, int *err, vfs_file_t *fh)
+{
+  free(fh);
+  return 0;
+}
+
+static ssize_t pack_read(vfs_t *v, int *err, vfs_file_t *fh, void *buf, size_t count, off_t pos,
+                         const void **data)
+{
+  packfs_t *fs = v->priv;
+  const packent_t *e = &fs->ent[((packfile_t *)fh)->index];
+  uint32_t size = be32toh(e->size);
+
+  if (data)
+    *data = buf;
+  if (pos >= size)
+    return 0;
+  count = size - pos < count ? size - pos : count;
+
+  size_t done = 0;
+  while (done < count) {
+    off_t p = pos + done;
+    uint32_t bi = p / fs->blocksize;
+    size_t off = p % fs->blocksize;
+    size_t len = size - (off_t)bi * fs->blocksize < fs->blocksize ?
+                 size - (off_t)bi * fs->blocksize : fs->blocksize;
+    size_t l = len - off < count - done ? len - off : count - done;
+    uint32_t index = be32toh(e->block) + bi;
+    const uint8_t *src;
+
+    if (be32toh(fs->blk[index].csize) == len) {
+      // 無圧縮のブロックに収まっていればマップした領域から直接送信する
+      src = fs->map + be32toh(fs->blk[index].offset);
+      if (data && done == 0 && l == count) {
+        *data = src + off;
+        return count;
+      }
+    } else if ((src = pack_getblk(fs, err, index, len)) == NULL) {
+      return done > 0 ? done : -1;
+    }
+    memcpy((uint8_t *)buf + done, src + off, l);
+    done += l;
+  }
+  return done;
+}
+
+static ssize_t pack_write(vfs_t *v, int *err, vfs_file_t *fh, const void *buf, size_t count, off_t pos)
+{
+  return pack_rofs(err);
+}
+
+static int pack_ftruncate(vfs_t *v, int *err, vfs_file_t *fh, off_t length)
+{
+  return pack_rofs(err);
+}
+
+static int pack_fstat(vfs_t *v, int *err, vfs_file_t *fh, TYPE_STAT *st)
+{
+  packfs_t *fs = v->priv;
+  pack_fillstat(fs, &fs->ent[((packfile_t *)fh)->index], st);
+  return 0;
+}
+
+static int pack_filedate(vfs_t *v, int *err, vfs_file_t *fh, uint16_t time, uint16_t date)
+{
+  return pack_rofs(err);
+}
+
+//****************************************************************************
+// Misc functions
+//****************************************************************************
+
+static int pack_statfs(vfs_t *v, int *err, uint64_t *total, uint64_t *free)
+{
+  packfs_t *fs = v->priv;
+  *total = fs->mapsize;
+  *free = 0;
+  DPRINTF2("PACK: entries=%u cached=%lu hit=%lu miss=%lu lookups=%lu avgprobe=%.2f\n",
+           fs->nent, (unsigned long)fs->cached, fs->hits, fs->misses, fs->lookups,
+           fs->lookups ? (double)fs->probes / fs->lookups : 0.0);
+  return 0;
+}
+
+const vfs_ops_t vfs_pack_ops = {
+  .name = "pack",
+  .mount = pack_mount,
+  .stat = pack_stat,
+  .mkdir = pack_mkdir,
+  .rmdir = pack_rmdir,
+  .rename = pack_rename,
+  .unlink = pack_unlink,
+  .chmod = pack_chmod,
+  .opendir = pack_opendir,
+  .readdir = pack_readdir,
+  .closedir = pack_closedir,
+  .open = pack_open,
+  .close = pack_close,
+  .read = pack_read,
+  .write = pack_write,
+  .ftruncate = pack_ftruncate,
+  .fstat = pack_fstat,
+  .filedate = pack_filedate,
+  .statfs = pack_statfs,
+};
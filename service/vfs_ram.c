@@ -0,0 +1,660 @@
+/*
+ * Copyright (c) 2023 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+
+#include <config.h>
+#include <fileop.h>
+#include "remoteserv.h"
+#include "vfs.h"
+
+//****************************************************************************
+// RAM disk backend
+//****************************************************************************
+
+// メモリ上のディレクトリツリーをルートにするバックエンド
+// ルートディレクトリの指定は "ram:<サイズ>[:<退避先ディレクトリ>]"
+// (サイズにはK/M/Gの単位を付けられる)
+// 使用量がサイズを越える書き込みはエラーになるが、退避先ディレクトリが指定されていれば
+// 書き込もうとしたファイルの内容をホストのファイルに移してから続ける
+
+typedef struct ramnode {
+  char *name;
+  int mode;                   // st_modeと同じ形式
+  time_t mtime;
+  uint32_t ino;
+  uint8_t *data;              // ファイルの内容
+  size_t size;
+  size_t alloc;               // dataの確保サイズ
+  TYPE_FD fd;                 // 内容を退避したホストのファイル (FD_BADFDなら退避していない)
+  char *spill;                // 退避したホストのファイル名
+  int nopen;                  // オープン中の数
+  struct ramnode *parent;
+  struct ramnode *child;      // ディレクトリ内のファイル
+  struct ramnode *next;
+} ramnode_t;
+
+typedef struct {
+  ramnode_t root;
+  size_t limit;               // 使用量の上限
+  size_t used;                // 使用量 (ファイルの内容と管理領域)
+  size_t peak;
+  const char *spilldir;       // 退避先ディレクトリ (NULLなら退避しない)
+  uint32_t ino;
+  unsigned long nspill;
+} ramfs_t;
+
+typedef struct {
+  ramnode_t *node;
+  int flags;
+} ramfile_t;
+
+typedef struct {
+  ramnode_t *dir;
+  ramnode_t *cur;
+  int dots;                   // "."と".."を返した数
+} ramdir_t;
+
+#define RAM_NODESIZE(name)  (sizeof(ramnode_t) + strlen(name) + 1)
+
+//****************************************************************************
+// Local functions
+//****************************************************************************
+
+static bool ram_use(ramfs_t *fs, ssize_t size)
+{
+  if (size > 0 && fs->used + size > fs->limit)
+    return false;
+  fs->used += size;
+  if (fs->used > fs->peak)
+    fs->peak = fs->used;
+  return true;
+}
+
+static ramnode_t *ram_newnode(ramfs_t *fs, int *err, ramnode_t *dir, const char *name, int mode)
+{
+  if (!ram_use(fs, RAM_NODESIZE(name))) {
+    if (err)
+      *err = ENOSPC;
+    return NULL;
+  }
+  ramnode_t *n = calloc(1, sizeof(*n));
+  n->name = strdup(name);
+  n->mode = mode;
+  n->mtime = time(NULL);
+  n->ino = ++fs->ino;
+  n->fd = FD_BADFD;
+  n->parent = dir;
+  n->next = dir->child;
+  dir->child = n;
+  dir->mtime = n->mtime;
+  return n;
+}
+
+// ディレクトリからノードを外す
+static void ram_detach(ramnode_t *n)
+{
+  for (ramnode_t **p = &n->parent->child; *p; p = &(*p)->next) {
+    if (*p == n) {
+      *p = n->next;
+      break;
+    }
+  }
+  n->parent->mtime = time(NULL);
+  n->parent = NULL;
+  n->next = NULL;
+}
+
+static void ram_freedata(ramfs_t *fs, ramnode_t *n)
+{
+  if (n->fd != FD_BADFD) {
+    FUNC_CLOSE(NULL, n->fd);
+    FUNC_UNLINK(NULL, n->spill);
+    free(n->spill);
+    n->fd = FD_BADFD;
+    n->spill = NULL;
+  }
+  ram_use(fs, -(ssize_t)n->alloc);
+  free(n->data);
+  n->data = NULL;
+  n->size = n->alloc = 0;
+}
+
+// ツリーから外れていてオープンもされていないノードを解放する
+static void ram_release(ramfs_t *fs, ramnode_t *n)
+{
+  if (n->parent || n->nopen > 0)
+    return;
+  ram_freedata(fs, n);
+  ram_use(fs, -(ssize_t)RAM_NODESIZE(n->name));
+  free(n->name);
+  free(n);
+}
+
+// パス名に対応するノードを探す
+// parentがNULLでなければ最後の要素を含むディレクトリと最後の要素名を返す
+// (この場合は最後の要素が存在しなくてもディレクトリがあればエラーにしない)
+static ramnode_t *ram_lookup(ramfs_t *fs, int *err, const char *path,
+                             ramnode_t **parent, char *name)
+{
+  ramnode_t *dir = &fs->root;
+  ramnode_t *n = dir;
+  char elem[256];
+
+  if (parent)
+    *parent = NULL;
+  while (*path) {
+    if (*path == '/') {
+      path++;
+      continue;
+    }
+    int l = strcspn(path, "/");
+    if (l >= sizeof(elem)) {
+      if (err)
+        *err = ENAMETOOLONG;
+      return NULL;
+    }
+    memcpy(elem, path, l);
+    elem[l] = '\0';
+    path += l;
+
+    if (!S_ISDIR(n->mode)) {
+      if (err)
+        *err = ENOTDIR;
+      return NULL;
+    }
+    dir = n;
+    if (strcmp(elem, ".") == 0) {
+      continue;
+    } else if (strcmp(elem, "..") == 0) {
+      n = dir->parent ? dir->parent : dir;
+      continue;
+    }
+    for (n = dir->child; n; n = n->next) {
+      if (strcasecmp(n->name, elem) == 0)
+        break;
+    }
+    if (n == NULL) {
+      if (parent && path[strspn(path, "/")] == '\0') {
+        // 最後の要素が存在しない
+        *parent = dir;
+        strcpy(name, elem);
+        return NULL;
+      }
+      if (err)
+        *err = ENOENT;
+      return NULL;
+    }
+  }
+  if (parent && n != &fs->root) {
+    *parent = n->parent;
+    strcpy(name, elem);
+  }
+  return n;
+}
+
+// ファイルの内容をホストの退避先ファイルに移す
+static int ram_spill(ramfs_t *fs, int *err, ramnode_t *n)
+{
+  char path[512];
+  snprintf(path, sizeof(path), "%s/x68kram.%lx.%u", fs->spilldir, (unsigned long)getpid(), n->ino);
+  TYPE_FD fd = FUNC_OPEN(err, path, O_RDWR|O_CREAT|O_TRUNC|O_BINARY);
+  if (fd == FD_BADFD)
+    return -1;
+  if (n->size > 0 && FUNC_WRITE(err, fd, n->data, n->size) != n->size) {
+    FUNC_CLOSE(NULL, fd);
+    FUNC_UNLINK(NULL, path);
+    return -1;
+  }
+  size_t size = n->size;
+  ram_freedata(fs, n);
+  n->size = size;
+  n->fd = fd;
+  n->spill = strdup(path);
+  fs->nspill++;
+  DPRINTF1("RAM: spilled %s (%lu bytes) to %s\n", n->name, (unsigned long)size, path);
+  return 0;
+}
+
+// ファイルの内容をsizeバイトまで格納できるようにする
+static int ram_reserve(ramfs_t *fs, int *err, ramnode_t *n, size_t size)
+{
+  if (n->fd != FD_BADFD || size <= n->alloc)
+    return 0;
+  size_t alloc = n->alloc * 2 > size ? n->alloc * 2 : size;
+  if (!ram_use(fs, alloc - n->alloc)) {
+    alloc = size;
+    if (!ram_use(fs, alloc - n->alloc)) {
+      if (fs->spilldir)
+        return ram_spill(fs, err, n);
+      if (err)
+        *err = ENOSPC;
+      return -1;
+    }
+  }
+  uint8_t *data = realloc(n->data, alloc);
+  if (data == NULL) {
+    ram_use(fs, -(ssize_t)(alloc - n->alloc));
+    if (err)
+      *err = ENOMEM;
+    return -1;
+  }
+  n->data = data;
+  n->alloc = alloc;
+  return 0;
+}
+
+//****************************************************************************
+// Filesystem operations
+//****************************************************************************
+
+static int ram_mount(vfs_t *v, const char *spec)
+{
+  char *p;
+  unsigned long size = strtoul(spec, &p, 0);
+  switch (*p) {
+  case 'G': case 'g':
+    size *= 1024;
+  case 'M': case 'm':
+    size *= 1024;
+  case 'K': case 'k':
+    size *= 1024;
+    p++;
+  }
+  if (size == 0 || (*p != '\0' && *p != ':'))
+    return -1;
+
+  ramfs_t *fs = calloc(1, sizeof(*fs));
+  fs->root.name = "";
+  fs->root.mode = S_IFDIR|0777;
+  fs->root.mtime = time(NULL);
+  fs->root.fd = FD_BADFD;
+  fs->limit = size;
+  fs->spilldir = *p == ':' ? p + 1 : NULL;
+  v->base = "";
+  v->priv = fs;
+  return 0;
+}
+
+static int ram_stat(vfs_t *v, int *err, const char *path, TYPE_STAT *st)
+{
+  ramnode_t *n = ram_lookup(v->priv, err, path, NULL, NULL);
+  if (n == NULL)
+    return -1;
+  memset(st, 0, sizeof(*st));
+  st->st_mode = n->mode;
+  st->st_size = n->size;
+  st->st_mtime = n->mtime;
+  st->st_ino = n->ino;
+  st->st_nlink = 1;
+  return 0;
+}
+
+static int ram_mkdir(vfs_t *v, int *err, const char *path)
+{
+  ramnode_t *dir;
+  char name[256];
+  if (ram_lookup(v->priv, err, path, &dir, name)) {
+    if (err)
+      *err = EEXIST;
+    return -1;
+  }
+  if (dir == NULL)
+    return -1;
+  return ram_newnode(v->priv, err, dir, name, S_IFDIR|0777) ? 0 : -1;
+}
+
+static int ram_rmdir(vfs_t *v, int *err, const char *path)
+{
+  ramfs_t *fs = v->priv;
+  ramnode_t *n = ram_lookup(fs, err, path, NULL, NULL);
+  if (n == NULL)
+    return -1;
+  int e = !S_ISDIR(n->mode) ? ENOTDIR :
+          n == &fs->root ? EBUSY :
+          n->child ? ENOTEMPTY : 0;
+  if (e) {
+    if (err)
+      *err = e;
+    return -1;
+  }
+  ram_detach(n);
+  ram_release(fs, n);
+  return 0;
+}
+
+static int ram_rename(vfs_t *v, int *err, const char *pathold, const char *pathnew)
+{
+  ramfs_t *fs = v->priv;
+  ramnode_t *n = ram_lookup(fs, err, pathold, NULL, NULL);
+  if (n == NULL)
+    return -1;
+  if (n == &fs->root) {
+    if (err)
+      *err = EBUSY;
+    return -1;
+  }
+  ramnode_t *dir;
+  char name[256];
+  ramnode_t *t = ram_lookup(fs, err, pathnew, &dir, name);
+  if (dir == NULL)
+    return -1;
+  for (ramnode_t *d = dir; d; d = d->parent) {
+    if (d == n) {             // 自分の下には移動できない
+      if (err)
+        *err = EINVAL;
+      return -1;
+    }
+  }
+  if (t == n) {               // 大文字小文字だけの変更
+    ram_use(fs, strlen(name) - strlen(n->name));
+    free(n->name);
+    n->name = strdup(name);
+    return 0;
+  }
+  if (t) {                    // 移動先が存在したら置き換える
+    if (S_ISDIR(t->mode) != S_ISDIR(n->mode) || t->child) {
+      if (err)
+        *err = S_ISDIR(t->mode) ? (t->child ? ENOTEMPTY : EISDIR) : ENOTDIR;
+      return -1;
+    }
+    ram_detach(t);
+    ram_release(fs, t);
+  }
+  ram_use(fs, strlen(name) - strlen(n->name));
+  ram_detach(n);
+  free(n->name);
+  n->name = strdup(name);
+  n->parent = dir;
+  n->next = dir->child;
+  dir->child = n;
+  dir->mtime = time(NULL);
+  return 0;
+}
+
+static int ram_unlink(vfs_t *v, int *err, const char *path)
+{
+  ramfs_t *fs = v->priv;
+  ramnode_t *n = ram_lookup(fs, err, path, NULL, NULL);
+  if (n == NULL)
+    return -1;
+  if (S_ISDIR(n->mode)) {
+    if (err)
+      *err = EISDIR;
+    return -1;
+  }
+  ram_detach(n);
+  ram_release(fs, n);         // オープン中ならクローズ時に解放する
+  return 0;
+}
+
+static int ram_chmod(vfs_t *v, int *err, const char *path, int mode)
+{
+  ramnode_t *n = ram_lookup(v->priv, err, path, NULL, NULL);
+  if (n == NULL)
+    return -1;
+  n->mode = (n->mode & S_IFMT) | (mode & ~S_IFMT);
+  return 0;
+}
+
+//****************************************************************************
+// Directory operations
+//****************************************************************************
+
+static vfs_dir_t *ram_opendir(vfs_t *v, int *err, const char *path)
+{
+  ramnode_t *n = ram_lookup(v->priv, err, path, NULL, NULL);
+  if (n == NULL)
+    return NULL;
+  if (!S_ISDIR(n->mode)) {
+    if (err)
+      *err = ENOTDIR;
+    return NULL;
+  }
+  ramdir_t *d = malloc(sizeof(*d));
+  d->dir = n;
+  d->cur = n->child;
+  d->dots = 0;
+  return d;
+}
+
+static const char *ram_readdir(vfs_t *v, vfs_dir_t *dir)
+{
+  ramdir_t *d = dir;
+  if (d->dots < 2)
+    return d->dots++ == 0 ? "." : "..";
+  ramnode_t *n = d->cur;
+  if (n == NULL)
+    return NULL;
+  d->cur = n->next;
+  return n->name;
+}
+
+static void ram_closedir(vfs_t *v, vfs_dir_t *dir)
+{
+  free(dir);
+}
+
+//****************************************************************************
+// File operations
+//****************************************************************************
+
+static vfs_file_t *ram_open(vfs_t *v, int *err, const char *path, int flags)
+{
+  ramfs_t *fs = v->priv;
+  ramnode_t *dir;
+  char name[256];
+  ramnode_t *n = ram_lookup(fs, err, path, &dir, name);
+
+  if (n && (flags & (O_CREAT|O_EXCL)) == (O_CREAT|O_EXCL)) {
+    if (err)
+      *err = EEXIST;
+    return NULL;
+  }
+  if (n == NULL) {
+    if (dir == NULL)
+      return NULL;
+    if (!(flags & O_CREAT)) {
+      if (err)
+        *err = ENOENT;
+      return NULL;
+    }
+    if ((n = ram_newnode(fs, err, dir, name, S_IFREG|0666)) == NULL)
+      return NULL;
+  }
+  if (S_ISDIR(n->mode)) {
+    if (err)
+      *err = EISDIR;
+    return NULL;
+  }
+  if ((flags & (O_WRONLY|O_RDWR)) && !(n->mode & S_IWUSR)) {
+    if (err)
+      *err = EACCES;
+    return NULL;
+  }
+  if (flags & O_TRUNC) {
+    ram_freedata(fs, n);
+    n->mtime = time(NULL);
+  }
+
+  ramfile_t *f = malloc(sizeof(*f));
+  f->node = n;
+  f->flags = flags;
+  n->nopen++;
+  return f;
+}
+
+static int ram_close(vfs_t *v, int *err, vfs_file_t *fh)
+{
+  ramfile_t *f = fh;
+  f->node->nopen--;
+  ram_release(v->priv, f->node);
+  free(f);
+  return 0;
+}
+
+static ssize_t ram_read(vfs_t *v, int *err, vfs_file_t *fh, void *buf, size_t count, off_t pos,
+                        const void **data)
+{
+  ramfile_t *f = fh;
+  ramnode_t *n = f->node;
+  if (data)
+    *data = buf;
+  if (f->flags & O_WRONLY) {
+    if (err)
+      *err = EBADF;
+    return -1;
+  }
+  if (pos >= n->size)
+    return 0;
+  count = n->size - pos < count ? n->size - pos : count;
+  if (n->fd != FD_BADFD) {
+    if (FUNC_LSEEK(err, n->fd, pos, SEEK_SET) < 0)
+      return -1;
+    return FUNC_READ(err, n->fd, buf, count);
+  }
+  memcpy(buf, n->data + pos, count);
+  return count;
+}
+
+static ssize_t ram_write(vfs_t *v, int *err, vfs_file_t *fh, const void *buf, size_t count, off_t pos)
+{
+  ramfile_t *f = fh;
+  ramnode_t *n = f->node;
+  if (!(f->flags & (O_WRONLY|O_RDWR))) {
+    if (err)
+      *err = EBADF;
+    return -1;
+  }
+  if (ram_reserve(v->priv, err, n, pos + count) < 0)
+    return -1;
+  n->mtime = time(NULL);
+  if (n->fd != FD_BADFD) {
+    if (FUNC_LSEEK(err, n->fd, pos, SEEK_SET) < 0)
+      return -1;
+    ssize_t r = FUNC_WRITE(err, n->fd, buf, count);
+    if (r > 0 && pos + r > n->size)
+      n->size = pos + r;
+    return r;
+  }
+  if (pos > n->size)
+    memset(n->data + n->size, 0, pos - n->size);
+  memcpy(n->data + pos, buf, count);
+  if (pos + count > n->size)
+    n->size = pos + count;
+  return count;
+}
+
+static int ram_ftruncate(vfs_t *v, int *err, vfs_file_t *fh, off_t length)
+{
+  ramfile_t *f = fh;
+  ramnode_t *n = f->node;
+  if (!(f->flags & (O_WRONLY|O_RDWR))) {
+    if (err)
+      *err = EBADF;
+    return -1;
+  }
+  if (ram_reserve(v->priv, err, n, length) < 0)
+    return -1;
+  n->mtime = time(NULL);
+  if (n->fd != FD_BADFD) {
+    if (FUNC_FTRUNCATE(err, n->fd, length) < 0)
+      return -1;
+  } else if (length > n->size) {
+    memset(n->data + n->size, 0, length - n->size);
+  }
+  n->size = length;
+  return 0;
+}
+
+static int ram_fstat(vfs_t *v, int *err, vfs_file_t *fh, TYPE_STAT *st)
+{
+  ramnode_t *n = ((ramfile_t *)fh)->node;
+  memset(st, 0, sizeof(*st));
+  st->st_mode = n->mode;
+  st->st_size = n->size;
+  st->st_mtime = n->mtime;
+  st->st_ino = n->ino;
+  st->st_nlink = 1;
+  return 0;
+}
+
+static int ram_filedate(vfs_t *v, int *err, vfs_file_t *fh, uint16_t time, uint16_t date)
+{
+  ramnode_t *n = ((ramfile_t *)fh)->node;
+  struct tm tm;
+  tm.tm_sec = (time << 1) & 0x3f;
+  tm.tm_min = (time >> 5) & 0x3f;
+  tm.tm_hour = (time >> 11) & 0x1f;
+  tm.tm_mday = date & 0x1f;
+  tm.tm_mon = ((date >> 5) & 0xf) - 1;
+  tm.tm_year = ((date >> 9) & 0x7f) + 80;
+  tm.tm_isdst = -1;
+  n->mtime = mktime(&tm);
+  return 0;
+}
+
+//****************************************************************************
+// Misc functions
+//****************************************************************************
+
+static int ram_statfs(vfs_t *v, int *err, uint64_t *total, uint64_t *free)
+{
+  ramfs_t *fs = v->priv;
+  *total = fs->limit;
+  *free = fs->limit - fs->used;
+  DPRINTF2("RAM: used=%lu/%lu peak=%lu spilled=%lu\n",
+           (unsigned long)fs->used, (unsigned long)fs->limit,
+           (unsigned long)fs->peak, fs->nspill);
+  return 0;
+}
+
+const vfs_ops_t vfs_ram_ops = {
+  .name = "ram",
+  .mount = ram_mount,
+  .stat = ram_stat,
+  .mkdir = ram_mkdir,
+  .rmdir = ram_rmdir,
+  .rename = ram_rename,
+  .unlink = ram_unlink,
+  .chmod = ram_chmod,
+  .opendir = ram_opendir,
+  .readdir = ram_readdir,
+  .closedir = ram_closedir,
+  .open = ram_open,
+  .close = ram_close,
+  .read = ram_read,
+  .write = ram_write,
+  .ftruncate = ram_ftruncate,
+  .fstat = ram_fstat,
+  .filedate = ram_filedate,
+  .statfs = ram_statfs,
+};
@@ -31,8 +31,13 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #ifndef WINNT
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <termios.h>
 #else
 #include <windows.h>
@@ -41,6 +46,10 @@
 #include <config.h>
 #include <x68kremote.h>
 #include "remoteserv.h"
+#include "hostfd.h"
+#include "vfs.h"
+#include "fcache.h"
+#include "spscq.h"
 
 //****************************************************************************
 // Global type and variables
@@ -63,11 +72,15 @@ union cbuf {
   struct cmd_write    cmd_write;
   struct cmd_filedate cmd_filedate;
   struct cmd_dskfre   cmd_dskfre;
+  struct cmd_openread cmd_openread;
+  struct cmd_createwrite cmd_createwrite;
+  struct cmd_compound cmd_compound;
 };
 
 union rbuf {
   struct res_init     res_init;
   struct res_dirop    res_dirop;
+  struct res_chdir    res_chdir;
   struct res_rename   res_rename;
   struct res_chmod    res_chmod;
   struct res_files    res_files;
@@ -79,8 +92,35 @@ union rbuf {
   struct res_write    res_write;
   struct res_filedate res_filedate;
   struct res_dskfre   res_dskfre;
+  struct res_openread res_openread;
+  struct res_createwrite res_createwrite;
+  struct res_compound res_compound;
 };
 
+// パイプラインの各段の間で受け渡すフレーム
+typedef struct {
+  uint8_t cbuf[sizeof(union cbuf)];
+  uint8_t rbuf[sizeof(union rbuf)];
+  rdata_t ext;
+  int csize;
+  int rsize;
+} frame_t;
+
+static frame_t frames[CONFIG_PIPELINE];
+static spscq_t q_free = SPSCQ_INITIALIZER;    // tx -> rx 空きフレーム
+static spscq_t q_cmd = SPSCQ_INITIALIZER;     // rx -> worker 受信したコマンド
+static spscq_t q_res = SPSCQ_INITIALIZER;     // worker -> tx 送信する応答
+
+// 各段の処理時間の統計
+// 各段のスレッドが更新し、workerスレッドが表示するのでアトミックに読み書きする
+typedef struct {
+  atomic_ulong count;
+  _Atomic uint64_t busy;      // 処理していた時間 (ns)
+} stage_t;
+
+static stage_t st_rx, st_worker, st_tx;
+static uint64_t st_start;
+
 //****************************************************************************
 // for debugging
 //****************************************************************************
@@ -95,33 +135,75 @@ void DPRINTF(int level, char *fmt, ...)
   }
 }
 
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void stage_add(stage_t *st, uint64_t t0)
+{
+  atomic_fetch_add_explicit(&st->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&st->busy, now_ns() - t0, memory_order_relaxed);
+}
+
+// パイプラインの各段が処理をしていた時間の割合を表示する
+void pipe_stats(void)
+{
+  uint64_t elapsed = now_ns() - st_start;
+  static const char *name[] = { "rx", "worker", "tx" };
+  stage_t *st[] = { &st_rx, &st_worker, &st_tx };
+  for (int i = 0; i < 3; i++) {
+    unsigned long count = atomic_load_explicit(&st[i]->count, memory_order_relaxed);
+    uint64_t busy = atomic_load_explicit(&st[i]->busy, memory_order_relaxed);
+    DPRINTF1("pipeline: %-6s frames=%lu busy=%.3fs (%.1f%%) avg=%.1fus\n",
+             name[i], count, busy / 1e9,
+             elapsed ? busy * 100.0 / elapsed : 0.0,
+             count ? busy / 1e3 / count : 0.0);
+  }
+}
+
 //****************************************************************************
 // Communication
 //****************************************************************************
 
-int serout(int fd, void *buf, size_t len)
+int serout(int fd, void *buf, size_t len, rdata_t *ext)
 {
-  uint8_t lenbuf[2];
-  lenbuf[0] = len >> 8;
-  lenbuf[1] = len & 0xff;
+  uint8_t hdr[7] = { 'Z', 'Z', 'Z', 'X' };
+  size_t total = len + ext->len;
+  hdr[4] = total >> 8;
+  hdr[5] = total & 0xff;
+  hdr[6] = ext->gen;
 
-  if (write(fd, "ZZZX", 4) < 0 ||
-      write(fd, lenbuf, 2) < 0 ||
-      write(fd, buf, len) < 0) {
+#ifndef WINNT
+  struct iovec iov[3] = {
+    { hdr, sizeof(hdr) }, { buf, len }, { (void *)ext->buf, ext->len }
+  };
+  if (writev(fd, iov, ext->len ? 3 : 2) < 0) {
     return -1;
   }
+#else
+  if (write(fd, hdr, sizeof(hdr)) < 0 ||
+      write(fd, buf, len) < 0 ||
+      (ext->len && write(fd, ext->buf, ext->len) < 0)) {
+    return -1;
+  }
+#endif
   DPRINTF3("%02X %02X %02X %02X ", 'Z', 'Z', 'Z', 'X');
-  DPRINTF3("%02X %02X\n", lenbuf[0], lenbuf[1]);
-  for (int i = 0; i < len; i++) {
+  DPRINTF3("%02X %02X %02X\n", hdr[4], hdr[5], hdr[6]);
+  for (int i = 0; i < total; i++) {
+    uint8_t c = i < len ? ((uint8_t *)buf)[i] : ((uint8_t *)ext->buf)[i - len];
     if ((i % 16) == 0) DPRINTF3("%03X: ", i);
-    DPRINTF3("%02X ", ((uint8_t *)buf)[i]);
+    DPRINTF3("%02X ", c);
     if ((i % 16) == 15) DPRINTF3("\n");
   }
   DPRINTF3("\n");
-  DPRINTF2("send %d bytes\n", len);
+  DPRINTF2("send %d bytes\n", total);
+  return 0;
 }
 
-int serin(int fd, void *buf, size_t len)
+int serin(int fd, void *buf, size_t len, uint64_t *t0)
 {
   uint8_t c;
   int l;
@@ -131,6 +213,7 @@ int serin(int fd, void *buf, size_t len)
     l = read(fd, &c, 1);
     DPRINTF3("%02X ", c);
   } while (l < 1 || c != 'Z');
+  *t0 = now_ns();
   do {
     l = read(fd, &c, 1);
     DPRINTF3("%02X ", c);
@@ -167,7 +250,7 @@ int serin(int fd, void *buf, size_t len)
   }
   DPRINTF3("\n");
   DPRINTF2("recv %d bytes\n", size);
-  return 0;
+  return size;
 }
 
 int seropen(char *port, int baudrate)
@@ -246,6 +329,42 @@ int seropen(char *port, int baudrate)
   return fd;
 }
 
+//****************************************************************************
+// Pipeline stages
+//****************************************************************************
+
+// 受信したフレームをrx -> worker -> txの順に受け渡して処理する
+// X68000側は応答を受け取ってから次のコマンドを送るが、各段を別スレッドにしておくことで
+// 応答の送信中に次のコマンドの受信やファイル操作の後処理を並行して行える
+// workerは1つだけなので、コマンドは受信した順に処理・応答される
+
+static void *worker_thread(void *arg)
+{
+  while (1) {
+    frame_t *f = spscq_pop(&q_cmd);
+    uint64_t t0 = now_ns();
+    f->rsize = remote_serv(f->cbuf, f->csize, f->rbuf, &f->ext);
+    stage_add(&st_worker, t0);
+    spscq_push(&q_res, f);
+  }
+  return NULL;
+}
+
+static void *tx_thread(void *arg)
+{
+  int fd = (intptr_t)arg;
+  while (1) {
+    frame_t *f = spscq_pop(&q_res);
+    if (f->rsize >= 0) {
+      uint64_t t0 = now_ns();
+      serout(fd, f->rbuf, f->rsize, &f->ext);
+      stage_add(&st_tx, t0);
+    }
+    spscq_push(&q_free, f);
+  }
+  return NULL;
+}
+
 //****************************************************************************
 // main
 //****************************************************************************
@@ -259,6 +378,13 @@ int main(int argc, char **argv)
   for (int i = 1; i < argc; i++) {
     if (strcmp(argv[i], "-D") == 0) {
       debuglevel++;
+    } else if (strcmp(argv[i], "-w") == 0) {
+      hf_writebehind = true;
+    } else if (strcmp(argv[i], "-p") == 0) {
+      if (i + 1 < argc) {
+        i++;
+        fc_pin(argv[i]);
+      }
     } else if (strcmp(argv[i], "-s") == 0) {
       if (i + 1 < argc) {
         i++;
@@ -274,10 +400,17 @@ int main(int argc, char **argv)
   }
 
   if (device == NULL) {
-    printf("Usage: %s [-D|-s <speed>] <COM port> [<base directory> ...]\n", argv[0]);
+    printf("Usage: %s [-D|-w|-p <pattern>|-s <speed>] <COM port> [<base directory> ...]\n", argv[0]);
     return 1;
   }
 
+  for (int i = 0; i < 8; i++) {
+    if (rootpath[i] && vfs_mount(i, rootpath[i]) < 0) {
+      printf("Cannot mount %s\n", rootpath[i]);
+      return 1;
+    }
+  }
+
   int fd = seropen(device, baudrate);
   if (fd < 0) {
     printf("COM port open error\n");
@@ -286,18 +419,25 @@ int main(int argc, char **argv)
 
   printf("X68000 Serial Remote Drive Service (version %s)\n", GIT_REPO_VERSION);
 
-  while (1) {
-    uint8_t cbuf[sizeof(union cbuf)];
-    uint8_t rbuf[sizeof(union rbuf)];
-    int rsize;
+  st_start = now_ns();
+  for (int i = 0; i < CONFIG_PIPELINE; i++) {
+    spscq_push(&q_free, &frames[i]);
+  }
+  pthread_t th;
+  if (pthread_create(&th, NULL, worker_thread, NULL) != 0 ||
+      pthread_create(&th, NULL, tx_thread, (void *)(intptr_t)fd) != 0) {
+    printf("thread create error\n");
+    return 1;
+  }
 
-    if (serin(fd, cbuf, sizeof(cbuf)) < 0) {
-      continue;
-    }
-    if ((rsize = remote_serv(cbuf, rbuf)) < 0) {
-      continue;
-    }
-    serout(fd, rbuf, rsize);
+  // メインスレッドは受信を行う
+  while (1) {
+    frame_t *f = spscq_pop(&q_free);
+    uint64_t t0;
+    while ((f->csize = serin(fd, f->cbuf, sizeof(f->cbuf), &t0)) < 0)
+      ;
+    stage_add(&st_rx, t0);
+    spscq_push(&q_cmd, f);
   }
 
   close(fd);